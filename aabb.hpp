@@ -0,0 +1,152 @@
+/*
+* aabb.hpp
+* Contains the axis aligned bounding box type used by the acceleration structures.
+* An empty box has pmin = +infinity and pmax = -infinity so that extending it
+* with anything gives the right answer.
+*/
+
+#ifndef AABB_H
+#define AABB_H
+
+#include <limits>
+#include <algorithm>
+#include "vec.hpp"
+#include "ray.hpp"
+#include "matrix.hpp"
+
+const float INF = std::numeric_limits<float>::infinity();
+
+struct aabb
+{
+    vec3 pmin; // lower corner
+    vec3 pmax; // upper corner
+
+    aabb() : pmin(INF), pmax(-INF) {}
+    aabb(const vec3 &pmin_, const vec3 &pmax_) : pmin(pmin_), pmax(pmax_) {}
+
+    void extend(const vec3 &p)
+    {
+        pmin = minVec(pmin, p);
+        pmax = maxVec(pmax, p);
+    }
+
+    void extend(const aabb &b)
+    {
+        pmin = minVec(pmin, b.pmin);
+        pmax = maxVec(pmax, b.pmax);
+    }
+
+    bool empty() const
+    {
+        return pmin.x > pmax.x || pmin.y > pmax.y || pmin.z > pmax.z;
+    }
+
+    /* A box is bounded if every corner is finite. Planes etc. are not. */
+    bool bounded() const
+    {
+        return !empty() &&
+               std::isfinite(pmin.x) && std::isfinite(pmin.y) && std::isfinite(pmin.z) &&
+               std::isfinite(pmax.x) && std::isfinite(pmax.y) && std::isfinite(pmax.z);
+    }
+
+    vec3 centroid() const { return 0.5f * (pmin + pmax); }
+    vec3 diagonal() const { return pmax - pmin; }
+
+    float surfaceArea() const
+    {
+        if (empty()) {
+            return 0.0f;
+        }
+
+        vec3 d = diagonal();
+        return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    /*
+    * Slab test. invDir is 1/r.direction, precomputed once per ray.
+    * On a hit, [tnear, tfar] is the overlap of the ray with the box.
+    */
+    bool hit(const ray &r, const vec3 &invDir, float tmin, float tmax, float &tnear, float &tfar) const
+    {
+        for (int a = 0; a < 3; a++) {
+            float t0 = (pmin.e[a] - r.origin.e[a]) * invDir.e[a];
+            float t1 = (pmax.e[a] - r.origin.e[a]) * invDir.e[a];
+
+            if (invDir.e[a] < 0.0f) {
+                std::swap(t0, t1);
+            }
+
+            // written so that NaNs (0 * inf) leave the interval alone
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+
+            if (tmax < tmin) {
+                return false;
+            }
+        }
+
+        tnear = tmin;
+        tfar = tmax;
+        return true;
+    }
+};
+
+inline vec3 reciprocal(const vec3 &d)
+{
+    return vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+}
+
+/* Bound the image of b under the affine transform mat (a tmat or affineMat) by transforming its 8 corners */
+template <typename M>
+inline aabb transformBox(const M &mat, const aabb &b)
+{
+    if (!b.bounded()) {
+        return aabb(vec3(-INF), vec3(INF));
+    }
+
+    aabb out;
+
+    for (int i = 0; i < 8; i++) {
+        vec3 corner((i & 1) ? b.pmax.x : b.pmin.x,
+                    (i & 2) ? b.pmax.y : b.pmin.y,
+                    (i & 4) ? b.pmax.z : b.pmin.z);
+        out.extend(transformPt(mat, corner));
+    }
+
+    return out;
+}
+
+/* Spread the low 10 bits of v out to every third bit */
+inline uint32_t expandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/*
+* 30 bit Morton code of p: its position within b quantized to 10 bits per axis
+* and interleaved, x in the top bit of each group of three.
+*/
+inline uint32_t mortonCode(const vec3 &p, const aabb &b)
+{
+    vec3 extent = b.diagonal();
+    uint32_t q[3];
+
+    for (int a = 0; a < 3; a++) {
+        float t = extent.e[a] > 0.0f ? (p.e[a] - b.pmin.e[a]) / extent.e[a] : 0.0f;
+        q[a] = (uint32_t) std::min(std::max(t * 1024.0f, 0.0f), 1023.0f);
+    }
+
+    return (expandBits(q[0]) << 2) | (expandBits(q[1]) << 1) | expandBits(q[2]);
+}
+
+inline std::ostream &operator <<(std::ostream &out, const aabb &b)
+{
+    out << "[(" << b.pmin << "), (" << b.pmax << ")]";
+    return out;
+}
+
+#endif
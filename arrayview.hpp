@@ -0,0 +1,33 @@
+/*
+* arrayview.hpp
+* Contains arrayView, a read-only pointer and length that looks like a const
+* std::vector. Structures that can either be built in memory or used straight
+* out of a mapped file (e.g. a mesh's kd-tree, see meshaccel.hpp) read through
+* one, so the code using them doesn't care which it was.
+*/
+
+#ifndef ARRAYVIEW_H
+#define ARRAYVIEW_H
+
+#include <vector>
+#include <cstddef>
+
+template <typename T>
+struct arrayView
+{
+    const T* ptr;
+    size_t count;
+
+    arrayView() : ptr(nullptr), count(0) {}
+    arrayView(const T* ptr_, size_t count_) : ptr(ptr_), count(count_) {}
+    arrayView(const std::vector<T> &v) : ptr(v.data()), count(v.size()) {}
+
+    const T &operator[](size_t i) const { return ptr[i]; }
+    const T* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+};
+
+#endif
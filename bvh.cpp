@@ -0,0 +1,434 @@
+/*
+* bvh.cpp
+* Builds the bvh from bvh.hpp, with one of two builders:
+*
+* - SAH: top down, splitting each node where the surface area heuristic is
+*   lowest, evaluated over a fixed number of bins along each axis.
+* - LBVH: sorts the primitives along a Morton curve through their centroids,
+*   then splits each node where the first bit of the codes in it changes. Much
+*   cheaper to build, but the tree is worse.
+*
+* With a thread pool, the top of the tree is built first, binning big nodes in
+* parallel, and everything below it is left as subtrees of a few thousand
+* primitives. Those get built at once on the pool, then put in place.
+*
+* Traversal keeps a stack of BVH_STACK_SIZE nodes, so no leaf can be deeper
+* than BVH_MAX_DEPTH. Both builders switch to splitting in the middle once a
+* node gets close enough to that for it to matter.
+*/
+
+#include <algorithm>
+#include "bvh.hpp"
+#include "threadpool.hpp"
+
+const int SAH_BINS = 16;
+const float SAH_TRAVERSAL_COST = 1.0f;          // cost of visiting a node, relative to testing a primitive
+const uint32_t BVH_TASK_PRIMS = 4096;           // subtrees about this size are built by one thread
+const uint32_t BVH_PARALLEL_PRIMS = 1 << 16;    // passes over more primitives than this are split up
+const uint16_t BVH_PENDING = 0xffff;            // axis of a stand in for a subtree that's built later
+const int BVH_MAX_DEPTH = BVH_STACK_SIZE - 1;    // the root is at depth 0
+
+struct sahBin
+{
+    aabb box;
+    int count = 0;
+};
+
+/*
+* Run f(begin, end, chunk) over [0, n) in numChunks(pool, n) pieces, on the
+* pool if there is one and n is big enough to be worth it.
+*/
+static int numChunks(threadPool* pool, uint32_t n)
+{
+    return (pool && n >= BVH_PARALLEL_PRIMS) ? 4 * pool->size() : 1;
+}
+
+template <typename F>
+static void forChunks(threadPool* pool, uint32_t n, F f)
+{
+    int chunks = numChunks(pool, n);
+
+    if (chunks == 1) {
+        f(0, n, 0);
+        return;
+    }
+
+    pool->parallelFor(chunks, [&](int c, int) {
+        f((uint64_t) n * c / chunks, (uint64_t) n * (c + 1) / chunks, c);
+    });
+}
+
+/* Sort indices by codes (30 bits), keeping them side by side, 10 bits a pass */
+static void radixSort(std::vector<uint32_t> &codes, std::vector<uint32_t> &indices)
+{
+    std::vector<uint32_t> codesTmp(codes.size()), indicesTmp(indices.size());
+
+    for (int shift = 0; shift < 30; shift += 10) {
+        std::vector<uint32_t> start(1025, 0);
+        for (uint32_t c : codes) {
+            start[((c >> shift) & 1023) + 1]++;
+        }
+
+        for (int b = 0; b < 1024; b++) {
+            start[b + 1] += start[b];
+        }
+
+        for (size_t i = 0; i < codes.size(); i++) {
+            uint32_t dst = start[(codes[i] >> shift) & 1023]++;
+            codesTmp[dst] = codes[i];
+            indicesTmp[dst] = indices[i];
+        }
+
+        codes.swap(codesTmp);
+        indices.swap(indicesTmp);
+    }
+}
+
+/* A subtree left for later: indices[begin, end), with its root at depth */
+struct bvhPending
+{
+    uint32_t begin, end;
+    int depth;
+};
+
+/* Levels of splits in the middle it takes to get n primitives down to one a leaf */
+static int ceilLog2(uint32_t n)
+{
+    return n <= 1 ? 0 : 32 - __builtin_clz(n - 1);
+}
+
+struct bvhBuilder
+{
+    bvh &tree;
+    const std::vector<aabb> &primBounds;
+    const bvhBuildOptions &options;
+    std::vector<vec3> centroids;
+    std::vector<uint32_t> codes;  // LBVH: Morton code of tree.indices[i], sorted
+    uint32_t taskPrims;           // while building the top, ranges this small are left for later
+    std::vector<bvhPending> pending;  // subtrees left for later
+
+    bvhBuilder(bvh &tree_, const std::vector<aabb> &primBounds_, const bvhBuildOptions &options_) :
+    tree(tree_), primBounds(primBounds_), options(options_), taskPrims(0) {}
+
+    /* Bounds of indices[begin, end) and of their centroids */
+    void rangeBounds(uint32_t begin, uint32_t end, threadPool* pool, aabb &box, aabb &centroidBox)
+    {
+        std::vector<aabb> boxes(numChunks(pool, end - begin)), centroidBoxes(boxes.size());
+
+        forChunks(pool, end - begin, [&](uint32_t b, uint32_t e, int c) {
+            for (uint32_t i = begin + b; i < begin + e; i++) {
+                boxes[c].extend(primBounds[tree.indices[i]]);
+                centroidBoxes[c].extend(centroids[tree.indices[i]]);
+            }
+        });
+
+        for (size_t c = 0; c < boxes.size(); c++) {
+            box.extend(boxes[c]);
+            centroidBox.extend(centroidBoxes[c]);
+        }
+    }
+
+    /*
+    * Pick the SAH split of indices[begin, end), trying every axis, and partition
+    * them around it. Returns where the second half starts (and sets axis), begin
+    * if the node should be a leaf, or end if there's no good split and it should
+    * be split in the middle of axis.
+    */
+    uint32_t sahSplit(uint32_t begin, uint32_t end, int &axis, const aabb &box, const aabb &centroidBox, threadPool* pool)
+    {
+        uint32_t n = end - begin;
+        vec3 lo = centroidBox.pmin;
+        vec3 extent = centroidBox.diagonal();
+
+        if (extent.x <= 0.0f && extent.y <= 0.0f && extent.z <= 0.0f) {
+            return end;
+        }
+
+        auto binOf = [&](uint32_t p, int a) {
+            if (extent.e[a] <= 0.0f) {
+                return 0;
+            }
+
+            int b = (int) (SAH_BINS * (centroids[p].e[a] - lo.e[a]) / extent.e[a]);
+            return std::min(b, SAH_BINS - 1);
+        };
+
+        // drop every primitive into a bin by its centroid on each axis, a chunk of them at a time
+        std::vector<sahBin> chunkBins(numChunks(pool, n) * 3 * SAH_BINS);
+        forChunks(pool, n, [&](uint32_t b, uint32_t e, int c) {
+            for (uint32_t i = begin + b; i < begin + e; i++) {
+                uint32_t p = tree.indices[i];
+                for (int a = 0; a < 3; a++) {
+                    sahBin &bin = chunkBins[(c * 3 + a) * SAH_BINS + binOf(p, a)];
+                    bin.count++;
+                    bin.box.extend(primBounds[p]);
+                }
+            }
+        });
+
+        float bestCost = INF;
+        int bestAxis = -1;
+        int bestSplit = -1;
+
+        for (int a = 0; a < 3; a++) {
+            if (extent.e[a] <= 0.0f) {
+                continue;
+            }
+
+            sahBin bins[SAH_BINS];
+            for (size_t i = a * SAH_BINS; i < chunkBins.size(); i += 3 * SAH_BINS) {
+                for (int b = 0; b < SAH_BINS; b++) {
+                    bins[b].count += chunkBins[i + b].count;
+                    bins[b].box.extend(chunkBins[i + b].box);
+                }
+            }
+
+            // sweep from the right to get the cost of everything right of each split
+            float rightArea[SAH_BINS];
+            int rightCount[SAH_BINS];
+            aabb acc;
+            int cnt = 0;
+            for (int b = SAH_BINS - 1; b > 0; b--) {
+                acc.extend(bins[b].box);
+                cnt += bins[b].count;
+                rightArea[b] = acc.surfaceArea();
+                rightCount[b] = cnt;
+            }
+
+            // then sweep from the left to find the cheapest split
+            acc = aabb();
+            cnt = 0;
+            for (int b = 1; b < SAH_BINS; b++) {
+                acc.extend(bins[b - 1].box);
+                cnt += bins[b - 1].count;
+                float cost = cnt * acc.surfaceArea() + rightCount[b] * rightArea[b];
+                if (cnt > 0 && rightCount[b] > 0 && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        float leafCost = n * box.surfaceArea();
+        bestCost = SAH_TRAVERSAL_COST * box.surfaceArea() + bestCost;
+
+        if (bestSplit > 0 && bestCost < leafCost) {
+            axis = bestAxis;
+            uint32_t* part = std::partition(&tree.indices[begin], &tree.indices[begin] + n,
+                [&](uint32_t p) { return binOf(p, bestAxis) < bestSplit; });
+            return part - &tree.indices[0];
+        }
+
+        // splitting doesn't pay for itself, and the leaf isn't huge
+        return n <= 16 ? begin : end;
+    }
+
+    /*
+    * Split indices[begin, end) where the highest bit that differs between their
+    * (sorted) codes changes, and set axis to the axis that bit belongs to.
+    * Returns end if every code is the same.
+    */
+    uint32_t mortonSplit(uint32_t begin, uint32_t end, int &axis)
+    {
+        uint32_t diff = codes[begin] ^ codes[end - 1];
+
+        if (diff == 0) {
+            return end;
+        }
+
+        int bit = 31 - __builtin_clz(diff);
+        axis = 2 - bit % 3;  // x is the top bit of each group of three
+
+        return std::partition_point(codes.begin() + begin, codes.begin() + end,
+            [&](uint32_t c) { return !((c >> bit) & 1); }) - codes.begin();
+    }
+
+    /*
+    * Build the subtree for indices[begin, end), whose root is at depth, and
+    * append its nodes to out. Returns the index of the subtree's root. With a
+    * pool, ranges of taskPrims or fewer get a BVH_PENDING node instead, and are
+    * built later.
+    */
+    uint32_t build(std::vector<bvhNode> &out, uint32_t begin, uint32_t end, int depth, threadPool* pool)
+    {
+        uint32_t nodeIdx = out.size();
+        out.push_back(bvhNode());
+        uint32_t n = end - begin;
+
+        if (pool && n <= taskPrims) {
+            out[nodeIdx].offset = pending.size();
+            out[nodeIdx].count = 0;
+            out[nodeIdx].axis = BVH_PENDING;
+            pending.push_back({ begin, end, depth });
+            return nodeIdx;
+        }
+
+        aabb box, centroidBox;
+        rangeBounds(begin, end, pool, box, centroidBox);
+        out[nodeIdx].box = box;
+
+        // make a leaf if we're small enough, or as deep as traversal can go
+        if (n <= (uint32_t) options.maxLeafSize || depth >= BVH_MAX_DEPTH) {
+            out[nodeIdx].offset = begin;
+            out[nodeIdx].count = n;
+            return nodeIdx;
+        }
+
+        // lopsided splits could go on past BVH_MAX_DEPTH. Near it, split in the middle,
+        // which always gets down to single primitives in time.
+        int axis = indexOfMaxComponent(centroidBox.diagonal());
+        uint32_t mid = end;
+
+        if (depth + ceilLog2(n) < BVH_MAX_DEPTH) {
+            mid = options.method == BVH_LBVH ? mortonSplit(begin, end, axis)
+                                             : sahSplit(begin, end, axis, box, centroidBox, pool);
+        }
+
+        if (mid == begin) {
+            out[nodeIdx].offset = begin;
+            out[nodeIdx].count = n;
+            return nodeIdx;
+        }
+
+        // all centroids in the same spot, no split worked or too deep: split in the middle
+        if (mid == end) {
+            mid = begin + n / 2;
+
+            if (options.method == BVH_SAH) {
+                std::nth_element(&tree.indices[begin], &tree.indices[mid], &tree.indices[begin] + n,
+                    [&](uint32_t a, uint32_t b) {
+                        return centroids[a].e[axis] < centroids[b].e[axis];
+                    });
+            }
+        }
+
+        build(out, begin, mid, depth + 1, pool);
+        uint32_t second = build(out, mid, end, depth + 1, pool);
+
+        out[nodeIdx].offset = second;
+        out[nodeIdx].count = 0;
+        out[nodeIdx].axis = axis;
+
+        return nodeIdx;
+    }
+
+    /* Copy the top of the tree into tree.nodes depth first, with the subtrees in place of their stand ins */
+    void flatten(const std::vector<bvhNode> &top, uint32_t cur, const std::vector<std::vector<bvhNode>> &subtrees)
+    {
+        const bvhNode &node = top[cur];
+
+        if (node.count == 0 && node.axis == BVH_PENDING) {
+            const std::vector<bvhNode> &sub = subtrees[node.offset];
+            uint32_t base = tree.nodes.size();
+
+            for (bvhNode n : sub) {
+                if (n.count == 0) {
+                    n.offset += base;
+                }
+                tree.nodes.push_back(n);
+            }
+
+            return;
+        }
+
+        uint32_t nodeIdx = tree.nodes.size();
+        tree.nodes.push_back(node);
+
+        if (node.count == 0) {
+            flatten(top, cur + 1, subtrees);
+            tree.nodes[nodeIdx].offset = tree.nodes.size();
+            flatten(top, node.offset, subtrees);
+        }
+    }
+};
+
+/* Build the tree over primBounds. Primitive i of the tree is primBounds[i]. */
+void bvh::build(const std::vector<aabb> &primBounds, const bvhBuildOptions &options)
+{
+    nodes.clear();
+    indices.resize(primBounds.size());
+
+    if (primBounds.empty()) {
+        return;
+    }
+
+    uint32_t n = primBounds.size();
+    threadPool* pool = options.pool;
+    bvhBuilder builder(*this, primBounds, options);
+
+    builder.centroids.resize(n);
+    forChunks(pool, n, [&](uint32_t b, uint32_t e, int) {
+        for (uint32_t i = b; i < e; i++) {
+            indices[i] = i;
+            builder.centroids[i] = primBounds[i].centroid();
+        }
+    });
+
+    if (options.method == BVH_LBVH) {
+        aabb centroidBox;
+        for (const vec3 &c : builder.centroids) {
+            centroidBox.extend(c);
+        }
+
+        builder.codes.resize(n);
+        forChunks(pool, n, [&](uint32_t b, uint32_t e, int) {
+            for (uint32_t i = b; i < e; i++) {
+                builder.codes[i] = mortonCode(builder.centroids[i], centroidBox);
+            }
+        });
+
+        radixSort(builder.codes, indices);
+    }
+
+    nodes.reserve(2 * n);
+
+    if (!pool || n <= BVH_TASK_PRIMS) {
+        builder.build(nodes, 0, n, 0, nullptr);
+        return;
+    }
+
+    // build the top of the tree, then the subtrees below it all at once
+    builder.taskPrims = std::max(BVH_TASK_PRIMS, n / (16 * pool->size()));
+    std::vector<bvhNode> top;
+    builder.build(top, 0, n, 0, pool);
+
+    std::vector<std::vector<bvhNode>> subtrees(builder.pending.size());
+    pool->parallelFor(builder.pending.size(), [&](int t, int) {
+        const bvhPending &p = builder.pending[t];
+        subtrees[t].reserve(2 * (p.end - p.begin));
+        builder.build(subtrees[t], p.begin, p.end, p.depth, nullptr);
+    });
+
+    builder.flatten(top, 0, subtrees);
+}
+
+aabb bvh::bounds() const
+{
+    if (nodes.empty()) {
+        return aabb();
+    }
+
+    return nodes[0].box;
+}
+
+/*
+* Expected cost of tracing a ray through the tree, by the surface area
+* heuristic: every node costs SAH_TRAVERSAL_COST and every primitive in a leaf
+* costs 1, weighted by the chance a ray through the root goes through it.
+*/
+float bvh::sahCost() const
+{
+    if (nodes.empty() || nodes[0].box.surfaceArea() <= 0.0f) {
+        return 0.0f;
+    }
+
+    float invRootArea = 1.0f / nodes[0].box.surfaceArea();
+    double cost = 0.0;
+
+    for (const bvhNode &node : nodes) {
+        cost += node.box.surfaceArea() * invRootArea * (node.count > 0 ? node.count : SAH_TRAVERSAL_COST);
+    }
+
+    return cost;
+}
@@ -0,0 +1,208 @@
+/*
+* bvh.hpp
+* Contains a bounding volume hierarchy over a list of primitive bounds.
+* The bvh doesn't know what its primitives are; it only stores their indices,
+* and callers hand traverse() a function that intersects the primitives in a leaf.
+* Used for the top level of the scene and the light tree.
+*/
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cstdint>
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "packet.hpp"
+
+const int BVH_STACK_SIZE = 64;
+
+class threadPool;
+
+enum bvhBuildMethod
+{
+    BVH_SAH,   // binned surface area heuristic: slower to build, faster to trace
+    BVH_LBVH   // splits along a Morton curve: much faster to build, slower to trace
+};
+
+struct bvhBuildOptions
+{
+    int maxLeafSize = 4;
+    bvhBuildMethod method = BVH_SAH;
+    threadPool* pool = nullptr;  // builds in parallel on it if set
+};
+
+/*
+* A node in the flattened tree. Nodes are stored depth first, so the
+* first child of an interior node is always the next node in the array.
+*/
+struct bvhNode
+{
+    aabb box;         // bounds of everything below this node
+    uint32_t offset;  // leaf: first entry in indices. interior: index of second child
+    uint16_t count;   // leaf: number of primitives. interior: 0
+    uint16_t axis;    // interior: axis the children were split along
+};
+
+struct bvh
+{
+    std::vector<bvhNode> nodes;     // nodes[0] is the root
+    std::vector<uint32_t> indices;  // primitive ids, leaves refer to ranges of this
+
+    void build(const std::vector<aabb> &primBounds, const bvhBuildOptions &options = bvhBuildOptions());
+    aabb bounds() const;
+    float sahCost() const;
+    bool empty() const { return nodes.empty(); }
+
+    /*
+    * Find the closest hit. intersect(leaf, tmax) tests the primitives in a leaf
+    * (indices[leaf.offset] onwards) and returns true if any was hit, in which case
+    * it must also shrink tmax to the new distance. Children are visited front to
+    * back so tmax shrinks as quickly as possible.
+    */
+    template <typename F>
+    bool traverse(const ray &r, float tmin, float &tmax, F intersect) const
+    {
+        if (nodes.empty()) {
+            return false;
+        }
+
+        vec3 invDir = reciprocal(r.direction);
+        bool dirNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+        bool hitSomething = false;
+        float tnear, tfar;
+
+        while (true) {
+            const bvhNode &node = nodes[cur];
+
+            if (node.box.hit(r, invDir, tmin, tmax, tnear, tfar)) {
+                if (node.count > 0) {
+                    if (intersect(node, tmax)) {
+                        hitSomething = true;
+                    }
+                }
+
+                else if (dirNeg[node.axis]) {
+                    stack[top++] = cur + 1;
+                    cur = node.offset;
+                    continue;
+                }
+
+                else {
+                    stack[top++] = node.offset;
+                    cur = cur + 1;
+                    continue;
+                }
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            cur = stack[--top];
+        }
+
+        return hitSomething;
+    }
+
+    /* Same as traverse, but stops as soon as occluded(leaf, tmax) reports any hit. */
+    template <typename F>
+    bool traverseAny(const ray &r, float tmin, float tmax, F occluded) const
+    {
+        if (nodes.empty()) {
+            return false;
+        }
+
+        vec3 invDir = reciprocal(r.direction);
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+        float tnear, tfar;
+
+        while (true) {
+            const bvhNode &node = nodes[cur];
+
+            if (node.box.hit(r, invDir, tmin, tmax, tnear, tfar)) {
+                if (node.count > 0) {
+                    if (occluded(node, tmax)) {
+                        return true;
+                    }
+                }
+
+                else {
+                    stack[top++] = node.offset;
+                    cur = cur + 1;
+                    continue;
+                }
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            cur = stack[--top];
+        }
+
+        return false;
+    }
+
+    /*
+    * Find the closest hits of a packet. A node is skipped if the packet's frustum
+    * misses it, otherwise every lane is tested against it at once. intersect(leaf, lanes)
+    * tests the primitives in a leaf against the given lanes, shrinks their tmax, and
+    * returns the lanes it hit. It can also take lanes out of p.active (e.g. once a shadow ray
+    * is blocked); traversal stops when there are none left.
+    */
+    template <typename F>
+    laneMask traversePacket(rayPacket &p, float tmin, F intersect) const
+    {
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        packetFrustum frustum;
+        frustum.build(p);
+        float t0[PACKET_SIZE], t1[PACKET_SIZE];
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+        laneMask hitLanes = 0;
+        bool dirNeg[3] = { p.dx[0] < 0, p.dy[0] < 0, p.dz[0] < 0 };
+
+        while (p.active) {
+            const bvhNode &node = nodes[cur];
+            laneMask lanes = frustum.misses(node.box, tmin) ? 0 : packetHitsBox(p, node.box, tmin, t0, t1);
+
+            if (lanes) {
+                if (node.count > 0) {
+                    hitLanes |= intersect(node, lanes);
+                }
+
+                else if (dirNeg[node.axis]) {
+                    stack[top++] = cur + 1;
+                    cur = node.offset;
+                    continue;
+                }
+
+                else {
+                    stack[top++] = node.offset;
+                    cur = cur + 1;
+                    continue;
+                }
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            cur = stack[--top];
+        }
+
+        return hitLanes;
+    }
+};
+
+#endif
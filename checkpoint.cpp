@@ -0,0 +1,115 @@
+/*
+* checkpoint.cpp
+* Implements writing and reading checkpoints from checkpoint.hpp.
+*/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+#include "checkpoint.hpp"
+
+static const char CHECKPOINT_MAGIC[8] = { 'R', 'A', 'E', 'C', 'H', 'K', 'P', 'T' };
+
+/* Number of pixelStats img keeps, edge tiles included */
+static size_t storedPixels(const img &image)
+{
+    return (size_t) image.numTiles() * IMG_TILE_SIZE * IMG_TILE_SIZE;
+}
+
+bool writeCheckpoint(const std::string &path, const img &image, const renderState &state, std::string &error)
+{
+    checkpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+    h.version = CHECKPOINT_VERSION;
+    h.headerBytes = sizeof(checkpointHeader);
+    h.pixelBytes = sizeof(pixelStats);
+    h.tileSize = IMG_TILE_SIZE;
+    h.width = image.width();
+    h.height = image.height();
+    h.seed = state.seed;
+    h.samplerSpp = state.samplerSpp;
+
+    if (state.samplerName.size() >= sizeof(h.samplerName) || state.scene.size() >= sizeof(h.scene)) {
+        error = "sampler name or scene description too long";
+        return false;
+    }
+
+    memcpy(h.samplerName, state.samplerName.data(), state.samplerName.size());
+    memcpy(h.scene, state.scene.data(), state.scene.size());
+
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        error = strerror(errno);
+        return false;
+    }
+
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(image.tile(0), sizeof(pixelStats), storedPixels(image), f);
+
+    // make sure it's on disk before it replaces the last one
+    bool ok = !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        error = strerror(errno);
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool readCheckpoint(const std::string &path, img &image, renderState &state, std::string &error)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        error = strerror(errno);
+        return false;
+    }
+
+    checkpointHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CHECKPOINT_MAGIC, 8) != 0) {
+        error = "not a checkpoint";
+        fclose(f);
+        return false;
+    }
+
+    if (h.version != CHECKPOINT_VERSION || h.headerBytes != sizeof(checkpointHeader) ||
+        h.pixelBytes != sizeof(pixelStats) || h.tileSize != (uint32_t) IMG_TILE_SIZE) {
+        error = "written by a different version";
+        fclose(f);
+        return false;
+    }
+
+    if (h.width != image.width() || h.height != image.height()) {
+        error = "it's " + std::to_string(h.width) + "x" + std::to_string(h.height) + ", not " +
+                std::to_string(image.width()) + "x" + std::to_string(image.height());
+        fclose(f);
+        return false;
+    }
+
+    // read into a copy first, so a truncated file doesn't leave the image half overwritten
+    std::vector<pixelStats> pixels(storedPixels(image));
+    bool ok = fread(pixels.data(), sizeof(pixelStats), pixels.size(), f) == pixels.size();
+    fclose(f);
+
+    if (!ok) {
+        error = "truncated";
+        return false;
+    }
+
+    memcpy(image.tile(0), pixels.data(), pixels.size() * sizeof(pixelStats));
+
+    h.samplerName[sizeof(h.samplerName) - 1] = '\0';
+    h.scene[sizeof(h.scene) - 1] = '\0';
+    state.samplerName = h.samplerName;
+    state.samplerSpp = h.samplerSpp;
+    state.seed = h.seed;
+    state.scene = h.scene;
+
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+* checkpoint.hpp
+* Contains the checkpoint format, which saves a render in progress so it can be
+* picked up again. A checkpoint is the image's accumulators (the sum, count and
+* error estimate of the samples in every pixel) plus what the samplers need to
+* carry on where they left off. Samplers are pure functions of (seed, pixel,
+* sample index), and the next sample index of a pixel is its count, so that's
+* just the sampler's name, seed and spp: a resumed render takes the same
+* samples it would have taken had it never stopped.
+*
+* The pixels are stored exactly as img keeps them in memory, tile by tile, so a
+* checkpoint only works on the same kind of machine that wrote it.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+#include "img.hpp"
+
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct checkpointHeader
+{
+    char magic[8];          // "RAECHKPT"
+    uint32_t version;       // CHECKPOINT_VERSION
+    uint32_t headerBytes;   // sizeof(checkpointHeader)
+    uint32_t pixelBytes;    // sizeof(pixelStats)
+    uint32_t tileSize;      // IMG_TILE_SIZE
+    int32_t width;
+    int32_t height;
+    uint32_t seed;
+    int32_t samplerSpp;     // spp the sampler was made with, which its strata depend on
+    char samplerName[16];
+    char scene[128];        // the caller's description of the scene, which has to match to resume
+};
+
+/* Everything about a render that has to stay the same for a checkpoint to carry on with it */
+struct renderState
+{
+    std::string samplerName;
+    int samplerSpp;
+    uint32_t seed;
+    std::string scene;
+};
+
+/*
+* Write image and state to path. It's written to a temporary file which then
+* replaces path, so a render killed while writing leaves the last checkpoint.
+* Returns false with the reason in error if it can't be written.
+*/
+bool writeCheckpoint(const std::string &path, const img &image, const renderState &state, std::string &error);
+
+/*
+* Read the checkpoint at path into image, which must be the size it was
+* written from, and its state into state. Returns false with the reason in
+* error if it can't be read or doesn't fit image; image is left alone then.
+*/
+bool readCheckpoint(const std::string &path, img &image, renderState &state, std::string &error);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+* geometrycache.cpp
+* Implements loading clusters of streamed meshes and the cache around them,
+* from geometrycache.hpp.
+*/
+
+#include <iostream>
+#include <new>
+#include "geometrycache.hpp"
+
+size_t meshCluster::bytes() const
+{
+    return sizeof(meshCluster) + blocks.capacity() * sizeof(triBlock) +
+           triangles.capacity() * sizeof(meshTriangle) + normals.capacity() * sizeof(vec3);
+}
+
+/* Interpolate the vertex normals of triangle tidx at barycentric coordinates (beta, gamma) */
+vec3 meshCluster::shadingNormal(uint32_t tidx, float beta, float gamma) const
+{
+    const meshTriangle &tri = triangles[tidx];
+    vec3 n0 = normals[tri.i0];
+    vec3 n1 = normals[tri.i1];
+    vec3 n2 = normals[tri.i2];
+
+    return makeUnitVector(n0 + beta * (n1 - n0) + gamma * (n2 - n0));
+}
+
+/*
+* Read cluster c of file and put its triangles in blocks. A cluster that can't
+* be read is reported and comes back empty, so rays go through where it was.
+*/
+static meshCluster *loadCluster(const meshChunksFile &file, uint32_t c)
+{
+    meshCluster *cluster = new meshCluster();
+    std::vector<meshVertex> vertices;
+    std::string error;
+
+    if (!file.readCluster(c, vertices, cluster->triangles, error)) {
+        std::cerr << "ERROR: " << error << "\n";
+        cluster->triangles.clear();
+        return cluster;
+    }
+
+    cluster->normals.resize(vertices.size());
+    for (size_t v = 0; v < vertices.size(); v++) {
+        cluster->normals[v] = vertices[v].normal;
+    }
+
+    cluster->blocks.resize((cluster->triangles.size() + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE);
+    for (uint32_t i = 0; i < cluster->triangles.size(); i++) {
+        const meshTriangle &tri = cluster->triangles[i];
+        cluster->blocks[i / TRI_BLOCK_SIZE].set(i % TRI_BLOCK_SIZE, vertices[tri.i0].coords,
+                                                vertices[tri.i1].coords, vertices[tri.i2].coords, i);
+    }
+
+    return cluster;
+}
+
+geometryCache &geometryCache::shared()
+{
+    static geometryCache cache;
+    return cache;
+}
+
+void geometryCache::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    budgetBytes = bytes;
+    evict();
+}
+
+uint32_t geometryCache::addMesh(std::shared_ptr<const meshChunksFile> file)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t first = slots.size();
+
+    for (uint32_t c = 0; c < file->directory.size(); c++) {
+        slots.emplace_back(file, c);
+    }
+
+    return first;
+}
+
+geometryCache::~geometryCache()
+{
+    for (cacheSlot &s : slots) {
+        delete s.data.load(std::memory_order_relaxed);
+    }
+
+    for (const retiredCluster &r : retired) {
+        delete r.data;
+    }
+}
+
+void *geometryCache::threadRecord::operator new(size_t size)
+{
+    void *memory = nullptr;
+
+    if (posix_memalign(&memory, alignof(threadRecord), size) != 0) {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+/* The calling thread's record, made the first time it reads this cache */
+geometryCache::threadRecord &geometryCache::threadState()
+{
+    static thread_local const geometryCache *cachedFor = nullptr;
+    static thread_local threadRecord *cached = nullptr;
+
+    if (cachedFor == this) {
+        return *cached;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    threadRecord *record = nullptr;
+
+    for (const std::unique_ptr<threadRecord> &t : threads) {
+        if (t->owner == std::this_thread::get_id()) {
+            record = t.get();
+        }
+    }
+
+    if (!record) {
+        threads.emplace_back(new threadRecord());
+        record = threads.back().get();
+    }
+
+    cachedFor = this;
+    cached = record;
+    return *record;
+}
+
+/*
+* The outermost reader announces the current epoch. Reading the epoch, the
+* announcement and the loads of slot pointers after it are all sequentially
+* consistent, as are dropping a cluster, moving the epoch on and reclaim's
+* loads: either reclaim sees the announcement, or the reader can't see the
+* dropped cluster.
+*/
+geometryCache::reader::reader(geometryCache &cache) : cache(cache), record(&cache.threadState())
+{
+    if (record->depth++ == 0) {
+        record->epoch.store(cache.epoch.load());
+    }
+}
+
+geometryCache::reader::~reader()
+{
+    if (--record->depth == 0) {
+        record->epoch.store(READER_IDLE, std::memory_order_release);
+    }
+}
+
+const meshCluster *geometryCache::get(threadRecord &record, uint32_t slot)
+{
+    cacheSlot &s = slots[slot];
+
+    // only this thread writes its counts, so they don't need a locked add
+    record.lookups.store(record.lookups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    const meshCluster *data = s.data.load();
+    if (data) {
+        record.hits.store(record.hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        // only write the bit if it's clear, so threads sharing a cluster don't fight over its cache line
+        if (!s.referenced.load(std::memory_order_relaxed)) {
+            s.referenced.store(true, std::memory_order_relaxed);
+        }
+
+        return data;
+    }
+
+    // read it without holding the lock, so other threads keep going
+    std::unique_ptr<const meshCluster> loaded(loadCluster(*s.file, s.cluster));
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    // another thread might have read it in the meantime
+    data = s.data.load();
+    if (data) {
+        return data;
+    }
+
+    data = loaded.release();
+    s.bytes = data->bytes();
+    s.referenced.store(true, std::memory_order_relaxed);
+    s.data.store(data);
+    resident.push_back(slot);
+    newest = slot;
+    residentBytes += s.bytes;
+
+    counters.loads++;
+    counters.bytesLoaded += s.bytes;
+    evict();
+    counters.peakBytes = std::max(counters.peakBytes, residentBytes);
+
+    return data;
+}
+
+/*
+* Drop clusters until the rest fit in the budget. The hand goes round the
+* resident slots, clearing referenced bits, and drops the first one it finds
+* that's clear: one that hasn't been used since the hand last came by. The
+* newest one always stays.
+*/
+void geometryCache::evict()
+{
+    bool dropped = false;
+
+    while (residentBytes > budgetBytes && resident.size() > 1) {
+        if (hand >= resident.size()) {
+            hand = 0;
+        }
+
+        cacheSlot &s = slots[resident[hand]];
+
+        if (resident[hand] == newest || s.referenced.exchange(false, std::memory_order_relaxed)) {
+            hand++;
+            continue;
+        }
+
+        residentBytes -= s.bytes;
+        retired.push_back({s.data.exchange(nullptr), epoch.load(std::memory_order_relaxed)});
+        resident[hand] = resident.back();
+        resident.pop_back();
+        counters.evictions++;
+        dropped = true;
+    }
+
+    if (dropped) {
+        // readers that start from here on can't find what was just dropped
+        epoch.fetch_add(1);
+    }
+
+    reclaim();
+}
+
+/* Free the retired clusters no open reader could have got to */
+void geometryCache::reclaim()
+{
+    if (retired.empty()) {
+        return;
+    }
+
+    uint64_t oldest = READER_IDLE;
+    for (const std::unique_ptr<threadRecord> &t : threads) {
+        oldest = std::min(oldest, t->epoch.load());
+    }
+
+    // retired is in the order clusters were dropped, so the ones to free are at the front
+    while (!retired.empty() && retired.front().epoch < oldest) {
+        delete retired.front().data;
+        retired.pop_front();
+    }
+}
+
+geometryCacheStats geometryCache::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    geometryCacheStats st = counters;
+
+    for (const std::unique_ptr<threadRecord> &t : threads) {
+        st.lookups += t->lookups.load(std::memory_order_relaxed);
+        st.hits += t->hits.load(std::memory_order_relaxed);
+    }
+
+    return st;
+}
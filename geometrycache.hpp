@@ -0,0 +1,159 @@
+/*
+* geometrycache.hpp
+* Contains the cache streamed meshes page their clusters through. Every
+* cluster of every streamed mesh has a slot; a slot holds the cluster while
+* it's resident. When the clusters in memory go over the byte budget, ones that
+* haven't been used lately are dropped and get read again from their
+* .mesh.chunks file the next time a ray reaches them.
+*
+* Getting a resident cluster is a plain atomic load of the slot's pointer and
+* setting the slot's referenced bit; nothing is locked and no count is shared
+* between threads. Eviction is the clock algorithm over those bits rather than
+* an LRU list, which would have to be reordered on every hit. Only loading and
+* evicting lock the cache.
+*
+* Clusters are only read inside a reader, which announces the epoch it started
+* in. An evicted cluster is put on a retire list tagged with the epoch it was
+* dropped in, and freed once every thread still reading started after that, so
+* a ray that's testing it when it's dropped can finish.
+*/
+
+#ifndef GEOMETRYCACHE_H
+#define GEOMETRYCACHE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include "vec.hpp"
+#include "triblock.hpp"
+#include "meshchunks.hpp"
+
+const size_t GEOMETRY_CACHE_DEFAULT_BUDGET = 256 << 20;
+
+/* A cluster of a streamed mesh, ready to intersect */
+struct meshCluster
+{
+    std::vector<triBlock> blocks;         // its triangles, TRI_BLOCK_SIZE at a time. tri[] indexes triangles
+    std::vector<meshTriangle> triangles;  // indices into normals
+    std::vector<vec3> normals;            // of each vertex in the cluster
+
+    size_t bytes() const;
+    vec3 shadingNormal(uint32_t tidx, float beta, float gamma) const;
+};
+
+struct geometryCacheStats
+{
+    uint64_t lookups = 0;      // clusters asked for
+    uint64_t hits = 0;         // ...that were already resident
+    uint64_t loads = 0;        // clusters read from disk
+    uint64_t bytesLoaded = 0;
+    uint64_t evictions = 0;    // clusters dropped to stay in the budget
+    size_t peakBytes = 0;      // most bytes resident at once
+};
+
+class geometryCache
+{
+    struct threadRecord;
+
+public:
+    geometryCache() : epoch(1), hand(0), newest(0), residentBytes(0), budgetBytes(GEOMETRY_CACHE_DEFAULT_BUDGET) {}
+    ~geometryCache();
+
+    /*
+    * Clusters from get stay alive until the reader they came from goes away.
+    * A reader belongs to the thread that made it, and can be nested.
+    */
+    class reader
+    {
+    public:
+        explicit reader(geometryCache &cache);
+        ~reader();
+
+        /* The cluster in slot, read from its file first if it isn't resident */
+        const meshCluster *get(uint32_t slot) { return cache.get(*record, slot); }
+
+    private:
+        geometryCache &cache;
+        threadRecord *record;
+
+        reader(const reader &) = delete;
+        reader &operator =(const reader &) = delete;
+    };
+
+    void setBudget(size_t bytes);
+    size_t budget() const { return budgetBytes; }
+
+    /*
+    * Give every cluster of file a slot. Returns the slot of cluster 0; the rest
+    * follow it. Meshes have to be added before any thread starts calling get.
+    */
+    uint32_t addMesh(std::shared_ptr<const meshChunksFile> file);
+
+    geometryCacheStats stats() const;
+    bool empty() const { return slots.empty(); }
+
+    static geometryCache &shared();  // the cache every streamedMesh pages through
+
+private:
+    struct cacheSlot
+    {
+        std::shared_ptr<const meshChunksFile> file;
+        uint32_t cluster;
+        std::atomic<const meshCluster *> data;  // null unless resident
+        std::atomic<bool> referenced;           // used since the clock hand last passed it
+        size_t bytes;                           // of data, while resident
+
+        cacheSlot(std::shared_ptr<const meshChunksFile> f, uint32_t c) : file(f), cluster(c), data(nullptr), referenced(false), bytes(0) {}
+    };
+
+    /* What one thread is reading, and its counts. Only that thread writes it, so each gets its own cache line. */
+    struct alignas(64) threadRecord
+    {
+        std::atomic<uint64_t> epoch;    // the epoch its outermost reader started in, or READER_IDLE
+        std::atomic<uint64_t> lookups;  // clusters asked for
+        std::atomic<uint64_t> hits;     // ...that were already resident
+        int depth;                      // readers open
+        std::thread::id owner;
+
+        threadRecord() : epoch(READER_IDLE), lookups(0), hits(0), depth(0), owner(std::this_thread::get_id()) {}
+
+        // plain new doesn't honour alignas before C++17
+        static void *operator new(size_t size);
+        static void operator delete(void *p) { free(p); }
+    };
+
+    /* An evicted cluster, and the epoch it was dropped in */
+    struct retiredCluster
+    {
+        const meshCluster *data;
+        uint64_t epoch;
+    };
+
+    static const uint64_t READER_IDLE = ~uint64_t(0);
+
+    std::deque<cacheSlot> slots;  // a deque, since slots can't be moved
+    std::atomic<uint64_t> epoch;  // goes up with every eviction
+
+    // the rest is only touched with lock held
+    mutable std::mutex lock;
+    std::vector<uint32_t> resident;  // the clock: resident slots, in no particular order
+    size_t hand;                     // where in resident the clock is
+    uint32_t newest;                 // the last slot loaded, which is never evicted
+    size_t residentBytes;
+    size_t budgetBytes;
+    geometryCacheStats counters;     // but lookups and hits
+    std::vector<std::unique_ptr<threadRecord>> threads;  // every thread that has made a reader
+    std::deque<retiredCluster> retired;                  // evicted, but maybe still being read
+
+    threadRecord &threadState();
+    const meshCluster *get(threadRecord &record, uint32_t slot);
+    void evict();
+    void reclaim();
+};
+
+#endif
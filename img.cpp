@@ -1,50 +1,151 @@
 /*
 * img.cpp
 * Contains implementations of functions from img.hpp.
-* Allows the user to read, output, and alter .ppm images.
+* Allows the user to read, output, and alter images.
 */
 
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <algorithm>
 #include "img.hpp"
+#include "threadpool.hpp"
+
+static_assert(IMG_TILE_SIZE * IMG_TILE_SIZE * sizeof(pixelStats) % IMG_ALIGN == 0,
+              "a tile must be a whole number of cache lines");
 
 img::img(int w, int h)
 {
-    nx = w;
-    ny = h;
-    raster = new rgb*[ny];
+    allocate(w, h);
+}
+
+img::img(int w, int h, rgb bg)
+{
+    allocate(w, h);
 
     for (int j = 0; j < ny; j++) {
-        raster[j] = new rgb[nx];
+        for (int i = 0; i < nx; i++) {
+            set(i, j, bg);
+        }
     }
 }
 
-img::img(int w, int h, rgb bg)
+img::~img()
+{
+    free(pixels);
+}
+
+/* Allocate every tile in one block, with no samples in any pixel */
+void img::allocate(int w, int h)
 {
     nx = w;
     ny = h;
+    tilesX = (nx + IMG_TILE_SIZE - 1) / IMG_TILE_SIZE;
+    tilesY = (ny + IMG_TILE_SIZE - 1) / IMG_TILE_SIZE;
 
-    for (int j = 0; j < ny; j++) {
-        raster[j] = new rgb[nx];
-        for (int i = 0; i < nx; i++) {
-            raster[j][i] = bg;
-        }
+    size_t count = (size_t) numTiles() * IMG_TILE_SIZE * IMG_TILE_SIZE;
+    void* memory = nullptr;
+
+    if (posix_memalign(&memory, IMG_ALIGN, std::max(count, (size_t) 1) * sizeof(pixelStats)) != 0) {
+        throw std::bad_alloc();
+    }
+
+    pixels = (pixelStats*) memory;
+    for (size_t i = 0; i < count; i++) {
+        new (&pixels[i]) pixelStats();
     }
 }
 
+/* Where pixel (x, y) is in pixels */
+size_t img::index(int x, int y) const
+{
+    int t = (y / IMG_TILE_SIZE) * tilesX + x / IMG_TILE_SIZE;
+    return (size_t) t * IMG_TILE_SIZE * IMG_TILE_SIZE + (y % IMG_TILE_SIZE) * IMG_TILE_SIZE + x % IMG_TILE_SIZE;
+}
+
+void img::tileBounds(int t, int &x0, int &y0, int &x1, int &y1) const
+{
+    x0 = (t % tilesX) * IMG_TILE_SIZE;
+    y0 = (t / tilesX) * IMG_TILE_SIZE;
+    x1 = std::min(x0 + IMG_TILE_SIZE, nx);
+    y1 = std::min(y0 + IMG_TILE_SIZE, ny);
+}
+
+pixelStats &img::at(int x, int y)
+{
+    return pixels[index(x, y)];
+}
+
+const pixelStats &img::at(int x, int y) const
+{
+    return pixels[index(x, y)];
+}
+
 bool img::set(int x, int y, const rgb &colour)
 {
     // are we in bounds?
-    if (x < 0 || x > nx) {
+    if (x < 0 || x >= nx) {
         return false;
     }
 
-    if (y < 0 || y > ny) {
+    if (y < 0 || y >= ny) {
         return false;
     }
 
-    raster[y][x] = colour;
+    pixelStats &px = at(x, y);
+    px = pixelStats();
+    px.add(colour);
     return true;
 }
 
+bool img::add(int x, int y, const rgb &colour)
+{
+    if (x < 0 || x >= nx || y < 0 || y >= ny) {
+        return false;
+    }
+
+    at(x, y).add(colour);
+    return true;
+}
+
+rgb img::get(int x, int y) const
+{
+    if (x < 0 || x >= nx || y < 0 || y >= ny) {
+        return rgb(0.0f, 0.0f, 0.0f);
+    }
+
+    return at(x, y).value();
+}
+
+uint64_t img::sampleCount() const
+{
+    uint64_t count = 0;
+
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            count += at(i, j).n;
+        }
+    }
+
+    return count;
+}
+
+uint32_t img::minSamples() const
+{
+    uint32_t fewest = std::numeric_limits<uint32_t>::max();
+
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            fewest = std::min(fewest, at(i, j).n);
+        }
+    }
+
+    return fewest;
+}
+
 void img::gammaCorrect(float g)
 {
     rgb tmp;
@@ -52,49 +153,234 @@ void img::gammaCorrect(float g)
 
     for (int j = 0; j < ny; j++) {
         for (int i = 0; i < nx; i++) {
-            tmp = raster[j][i];
-            raster[j][i] = (rgb(pow(tmp.r, power)),
-                            rgb(pow(tmp.g, power)),
-                            rgb(pow(tmp.b, power)));
+            tmp = get(i, j);
+            set(i, j, rgb(fastPow(tmp.r, power),
+                          fastPow(tmp.g, power),
+                          fastPow(tmp.b, power)));
+        }
+    }
+}
+
+/* Run f(y0, y1) over bands of rows covering the image, on the pool if there is one */
+template <typename F>
+static void forRowBands(threadPool* pool, int ny, F f)
+{
+    int bands = (ny + IMG_TILE_SIZE - 1) / IMG_TILE_SIZE;
+
+    if (!pool) {
+        f(0, ny);
+        return;
+    }
+
+    pool->parallelFor(bands, [&](int b, int) {
+        f(b * IMG_TILE_SIZE, std::min((b + 1) * IMG_TILE_SIZE, ny));
+    });
+}
+
+/* Write the parts to fname one after the other, in as few writes as there are parts */
+static bool writeFile(const std::string &fname, const std::vector<std::vector<uint8_t>> &parts)
+{
+    FILE* f = fopen(fname.c_str(), "wb");
+    if (!f) {
+        std::cerr << "Error: Could not open '" << fname << "' for writing: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    for (const std::vector<uint8_t> &part : parts) {
+        fwrite(part.data(), 1, part.size(), f);
+    }
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok) {
+        std::cerr << "Error: Could not write '" << fname << "': " << strerror(errno) << "\n";
+    }
+
+    return ok;
+}
+
+static std::vector<uint8_t> textHeader(const std::string &text)
+{
+    return std::vector<uint8_t>(text.begin(), text.end());
+}
+
+/* The values of row j as rgb floats, read a tile's run of contiguous pixels at a time */
+void img::resolveRow(int j, float* row) const
+{
+    for (int x0 = 0; x0 < nx; x0 += IMG_TILE_SIZE) {
+        const pixelStats* px = &at(x0, j);
+        int x1 = std::min(x0 + IMG_TILE_SIZE, nx);
+
+        for (int i = x0; i < x1; i++, px++) {
+            rgb c = px->value();
+            row[3*i] = c.r;
+            row[3*i + 1] = c.g;
+            row[3*i + 2] = c.b;
         }
     }
 }
 
-void img::writePPM(std::string fname)
+void img::toBytes(uint8_t* out, const postSettings &post, threadPool* pool) const
 {
-    int i, j;
-    uint32_t ired, igreen, iblue;
-    uint8_t red, green, blue;
+    forRowBands(pool, ny, [&](int y0, int y1) {
+        std::vector<float> row(3 * nx);
 
-    std::ofstream out(fname);
-    if (!(out.is_open())) {
-        std::cerr << "Error: Could not open '" << fname << "' for writing.\n";
-        exit(-1);
+        for (int j = y0; j < y1; j++) {
+            resolveRow(j, row.data());
+
+            // then post-process and quantize the whole row in one go, while it's in cache
+            postProcessRow(post, row.data(), out + (size_t) j * nx * 3, 3 * nx, (uint32_t) j * nx * 3);
+        }
+    });
+}
+
+bool img::write(const std::string &fname, const postSettings &post, threadPool* pool) const
+{
+    std::string ext = fname.substr(fname.find_last_of('.') + 1);
+
+    if (ext == "pfm") {
+        return writePFM(fname, post, pool);
     }
 
-    // write header to output
-    out << "P6\n";
-    out << nx << " " << ny << "\n";
-    out << "255\n";
-    
-    // output clamped to [0, 255]
-    for (j = 0; j < ny; j++) {
-        for (i = 0; i < nx; i++) {
-            ired = (uint32_t) (256 * raster[j][i].r);
-            igreen = (uint32_t) (256 * raster[j][i].g);
-            iblue = (uint32_t) (256 * raster[j][i].b);
+    else if (ext == "qoi") {
+        return writeQOI(fname, post, pool);
+    }
 
-            if (ired > 255) ired = 255;
-            if (igreen > 255) igreen = 255;
-            if (iblue > 255) iblue = 255;
+    return writePPM(fname, post, pool);
+}
 
-            red = (uint8_t) ired;
-            green = (uint8_t) igreen;
-            blue = (uint8_t) iblue;
+bool img::writePPM(const std::string &fname, const postSettings &post, threadPool* pool) const
+{
+    std::vector<std::vector<uint8_t>> parts(2);
+    parts[0] = textHeader("P6\n" + std::to_string(nx) + " " + std::to_string(ny) + "\n255\n");
+    parts[1].resize((size_t) nx * ny * 3);
+    toBytes(parts[1].data(), post, pool);
 
-            out.put(red);
-            out.put(green);
-            out.put(blue);
+    return writeFile(fname, parts);
+}
+
+/* Little endian floats, rows from the bottom up as PFM wants */
+bool img::writePFM(const std::string &fname, const postSettings &post, threadPool* pool) const
+{
+    std::vector<std::vector<uint8_t>> parts(2);
+    parts[0] = textHeader("PF\n" + std::to_string(nx) + " " + std::to_string(ny) + "\n-1.0\n");
+    parts[1].resize((size_t) nx * ny * 3 * sizeof(float));
+    float* data = (float*) parts[1].data();
+
+    forRowBands(pool, ny, [&](int y0, int y1) {
+        for (int j = y0; j < y1; j++) {
+            float* dst = data + (size_t) (ny - 1 - j) * nx * 3;
+            resolveRow(j, dst);
+            toneMapRow(post, dst, 3 * nx);
         }
+    });
+
+    return writeFile(fname, parts);
+}
+
+/* ----- QOI ----- */
+
+const uint8_t QOI_OP_INDEX = 0x00;
+const uint8_t QOI_OP_DIFF = 0x40;
+const uint8_t QOI_OP_LUMA = 0x80;
+const uint8_t QOI_OP_RUN = 0xc0;
+const uint8_t QOI_OP_RGB = 0xfe;
+
+static inline int qoiHash(const uint8_t* p)
+{
+    return (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+}
+
+/*
+* Encode count rgb pixels as QOI ops, as if they came straight after whatever
+* the previous band ended with. That works because the band starts with a full
+* QOI_OP_RGB, and only refers to index entries set by its own pixels, which are
+* the latest ones with their hash when the decoder gets there.
+*/
+static void encodeQOIBand(const uint8_t* px, size_t count, std::vector<uint8_t> &out)
+{
+    uint8_t index[64][3];
+    bool indexed[64] = {};
+    const uint8_t* prev = nullptr;
+    int run = 0;
+
+    for (size_t i = 0; i < count; i++, px += 3) {
+        if (prev && px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+            run++;
+            if (run == 62 || i == count - 1) {
+                out.push_back(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            continue;
+        }
+
+        if (run > 0) {
+            out.push_back(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        int h = qoiHash(px);
+
+        if (indexed[h] && index[h][0] == px[0] && index[h][1] == px[1] && index[h][2] == px[2]) {
+            out.push_back(QOI_OP_INDEX | h);
+            prev = px;
+            continue;
+        }
+
+        indexed[h] = true;
+        memcpy(index[h], px, 3);
+
+        int dr = 0, dg = 0, db = 0;
+        if (prev) {
+            dr = (int8_t) (px[0] - prev[0]);
+            dg = (int8_t) (px[1] - prev[1]);
+            db = (int8_t) (px[2] - prev[2]);
+        }
+
+        int drdg = dr - dg, dbdg = db - dg;
+
+        if (prev && dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+            out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        }
+
+        else if (prev && dg >= -32 && dg <= 31 && drdg >= -8 && drdg <= 7 && dbdg >= -8 && dbdg <= 7) {
+            out.push_back(QOI_OP_LUMA | (dg + 32));
+            out.push_back((drdg + 8) << 4 | (dbdg + 8));
+        }
+
+        else {
+            out.push_back(QOI_OP_RGB);
+            out.insert(out.end(), px, px + 3);
+        }
+
+        prev = px;
     }
 }
+
+/* QOI (qoiformat.org), with every band of rows encoded on its own */
+bool img::writeQOI(const std::string &fname, const postSettings &post, threadPool* pool) const
+{
+    std::vector<uint8_t> bytes((size_t) nx * ny * 3);
+    toBytes(bytes.data(), post, pool);
+
+    int bands = (ny + IMG_TILE_SIZE - 1) / IMG_TILE_SIZE;
+    std::vector<std::vector<uint8_t>> parts(bands + 2);
+
+    uint8_t header[14] = { 'q', 'o', 'i', 'f',
+                           (uint8_t) (nx >> 24), (uint8_t) (nx >> 16), (uint8_t) (nx >> 8), (uint8_t) nx,
+                           (uint8_t) (ny >> 24), (uint8_t) (ny >> 16), (uint8_t) (ny >> 8), (uint8_t) ny,
+                           3, 0 };  // rgb, sRGB
+    parts[0].assign(header, header + 14);
+
+    forRowBands(pool, ny, [&](int y0, int y1) {
+        std::vector<uint8_t> &out = parts[1 + y0 / IMG_TILE_SIZE];
+        out.reserve((size_t) (y1 - y0) * nx * 4);
+        encodeQOIBand(bytes.data() + (size_t) y0 * nx * 3, (size_t) (y1 - y0) * nx, out);
+    });
+
+    parts[bands + 1] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    return writeFile(fname, parts);
+}
@@ -1,7 +1,13 @@
 /*
 * img.hpp
 * Contains the img class, which allows the user to
-* alter/output/update .ppm files.
+* alter/output/update images, and write them as .ppm, .pfm (float) or .qoi.
+*
+* Pixels are accumulators: the sum of the samples taken in them and how many
+* there were, so renders can keep adding samples in place. They're kept in one
+* cache line aligned allocation cut into IMG_TILE_SIZE x IMG_TILE_SIZE tiles,
+* each contiguous and a whole number of cache lines, so threads that each own
+* whole tiles can write them without locks or false sharing.
 */
 
 #ifndef IMG_H
@@ -11,22 +17,108 @@
 #include <string>
 #include <fstream>
 #include <cstdint>
+#include <limits>
+#include <vector>
 #include "vec.hpp"
+#include "postprocess.hpp"
+
+class threadPool;
+
+const int IMG_TILE_SIZE = 16;  // width and height of a tile, in pixels
+const size_t IMG_ALIGN = 64;   // tiles start on a cache line
+
+/* Running statistics of the samples taken in a pixel */
+struct pixelStats
+{
+    rgb sum;
+    uint32_t n = 0;
+    float mean = 0.0f; // running mean and sum of squared differences of the
+    float m2 = 0.0f;   // luminance of the samples (Welford's algorithm)
+
+    void add(const rgb &c)
+    {
+        sum += c;
+        n++;
+
+        float y = luminance(c);
+        float delta = y - mean;
+        mean += delta / n;
+        m2 += delta * (y - mean);
+    }
+
+    /* Standard error of the mean luminance */
+    float stdError() const
+    {
+        return n > 1 ? sqrt(m2 / (n - 1) / n) : std::numeric_limits<float>::infinity();
+    }
+
+    /* Average of the samples, black if there aren't any */
+    rgb value() const
+    {
+        return n > 0 ? sum / n : rgb(0.0f, 0.0f, 0.0f);
+    }
+};
 
 class img
 {
 public:
     img(int w, int h);         // ppm with width w, height h
     img(int w, int h, rgb bg); // ppm with background bg
+    ~img();
+    img(const img&) = delete;
+    img &operator=(const img&) = delete;
 
-    bool set(int x, int y, const rgb &colour);
-    void gammaCorrect(float g);
-    void writePPM(std::string fname);
+    int width() const { return nx; }
+    int height() const { return ny; }
+
+    bool set(int x, int y, const rgb &colour);  // replace the pixel's samples with one of colour
+    bool add(int x, int y, const rgb &colour);  // add a sample to the pixel
+    rgb get(int x, int y) const;                // average of the pixel's samples
+    pixelStats &at(int x, int y);
+    const pixelStats &at(int x, int y) const;
+
+    /*
+    * Tiles are numbered across then down. Tile t covers pixels [x0, x1) x [y0, y1);
+    * its pixels are stored row by row, IMG_TILE_SIZE to a row even at the edges.
+    */
+    int numTiles() const { return tilesX * tilesY; }
+    void tileBounds(int t, int &x0, int &y0, int &x1, int &y1) const;
+    pixelStats* tile(int t) { return pixels + (size_t) t * IMG_TILE_SIZE * IMG_TILE_SIZE; }
+    const pixelStats* tile(int t) const { return pixels + (size_t) t * IMG_TILE_SIZE * IMG_TILE_SIZE; }
+
+    uint64_t sampleCount() const;  // samples in all the pixels together
+    uint32_t minSamples() const;   // fewest samples any pixel has
+
+    void gammaCorrect(float g);  // replace every pixel with one sample of its value to the power 1/g
+
+    /*
+    * The image as rows of 8 bit rgb, top row first, put through post. Done a
+    * band of rows at a time, on the pool if there is one.
+    */
+    void toBytes(uint8_t* out, const postSettings &post = postSettings(), threadPool* pool = nullptr) const;
+
+    /*
+    * Writers. Each builds the whole file in memory (on the pool, if given) and
+    * writes it in one go. They report why on std::cerr and return false if it
+    * can't be written. write() picks the format from fname's extension.
+    */
+    bool write(const std::string &fname, const postSettings &post = postSettings(), threadPool* pool = nullptr) const;
+    bool writePPM(const std::string &fname, const postSettings &post = postSettings(), threadPool* pool = nullptr) const;
+    bool writeQOI(const std::string &fname, const postSettings &post = postSettings(), threadPool* pool = nullptr) const;
+
+    // 32 bit float, with only post's exposure and tonemap applied. Not clamped without a tonemap.
+    bool writePFM(const std::string &fname, const postSettings &post = postSettings(), threadPool* pool = nullptr) const;
 
 private:
-    rgb** raster; // array of pixels
-    int nx;       // number of pixels (hort)
-    int ny;       // number of pixels (vert)
+    void allocate(int w, int h);
+    size_t index(int x, int y) const;
+    void resolveRow(int j, float* row) const;
+
+    pixelStats* pixels; // every tile, one after the other
+    int nx;             // number of pixels (hort)
+    int ny;             // number of pixels (vert)
+    int tilesX;         // number of tiles across
+    int tilesY;         // number of tiles down
 };
 
-#endif
\ No newline at end of file
+#endif
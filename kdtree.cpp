@@ -0,0 +1,323 @@
+/*
+* kdtree.cpp
+* Builds the kd-tree from kdtree.hpp. At each node every axis is swept over the
+* sorted edges of the primitives' bounds, and the split plane with the lowest
+* surface area heuristic cost wins. A node becomes a leaf when no split is
+* cheaper than testing everything in it (allowing a few bad refinements first).
+*
+* With a thread pool, the top few levels are built first, and the subtrees
+* below them are built in parallel and spliced in after. The tree comes out
+* exactly the same as building it on one thread.
+*/
+
+#include <cmath>
+#include "kdtree.hpp"
+#include "threadpool.hpp"
+
+const int KD_MAX_BAD_REFINES = 3;
+const uint32_t KD_TASK_PRIMS = 4096;  // subtrees about this size are built by one thread
+
+/* One side of a primitive's bounds along an axis */
+struct boundEdge
+{
+    float t;
+    uint32_t prim;
+    bool start;
+
+    bool operator <(const boundEdge &other) const
+    {
+        if (t == other.t) {
+            return start && !other.start;
+        }
+
+        return t < other.t;
+    }
+};
+
+/* A node left for later while building the top of a tree, with what build() was called with */
+struct kdPending
+{
+    uint32_t nodeIdx;
+    aabb box;
+    std::vector<uint32_t> prims;
+    int depth;
+    int badRefines;
+};
+
+struct kdBuilder
+{
+    const std::vector<aabb> &primBounds;
+    const kdBuildOptions &options;
+    std::vector<boundEdge> edges[3];
+    std::vector<kdNode> nodes;         // this builder's part of the tree
+    std::vector<uint32_t> primIndices;
+
+    // while building the top of a tree in parallel, nodes with this few
+    // primitives are left as pending subtrees, built later by their own builder
+    uint32_t taskPrims;
+    std::vector<kdPending> pending;
+
+    kdBuilder(const std::vector<aabb> &primBounds_, const kdBuildOptions &options_) :
+    primBounds(primBounds_), options(options_), taskPrims(0) {}
+
+    void makeLeaf(uint32_t nodeIdx, const std::vector<uint32_t> &prims)
+    {
+        nodes[nodeIdx].primOffset = primIndices.size();
+        nodes[nodeIdx].flags = (prims.size() << 2) | 3;
+        primIndices.insert(primIndices.end(), prims.begin(), prims.end());
+    }
+
+    void build(const aabb &nodeBox, const std::vector<uint32_t> &prims, int depth, int badRefines)
+    {
+        uint32_t nodeIdx = nodes.size();
+        nodes.push_back(kdNode());
+        uint32_t n = prims.size();
+
+        if (n <= options.maxPrims || depth == 0) {
+            makeLeaf(nodeIdx, prims);
+            return;
+        }
+
+        if (n <= taskPrims) {
+            pending.push_back({ nodeIdx, nodeBox, prims, depth, badRefines });
+            return;
+        }
+
+        for (int a = 0; a < 3; a++) {
+            if (edges[a].size() < 2*n) {
+                edges[a].resize(2*n);
+            }
+        }
+
+        // find the cheapest split, trying the longest axis first
+        float bestCost = INF;
+        int bestAxis = -1;
+        int bestOffset = -1;
+        float oldCost = options.isectCost * n;
+        float totalSA = nodeBox.surfaceArea();
+        float invTotalSA = 1.0f / totalSA;
+        vec3 d = nodeBox.diagonal();
+        int axis = indexOfMaxComponent(d);
+
+        for (int tries = 0; tries < 3 && bestAxis == -1; tries++, axis = (axis + 1) % 3) {
+            for (uint32_t i = 0; i < n; i++) {
+                const aabb &b = primBounds[prims[i]];
+                edges[axis][2*i] = { b.pmin.e[axis], prims[i], true };
+                edges[axis][2*i + 1] = { b.pmax.e[axis], prims[i], false };
+            }
+            std::sort(edges[axis].begin(), edges[axis].begin() + 2*n);
+
+            // sweep the edges, keeping track of how many prims are on each side
+            uint32_t nBelow = 0, nAbove = n;
+            int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+
+            for (uint32_t i = 0; i < 2*n; i++) {
+                if (!edges[axis][i].start) {
+                    nAbove--;
+                }
+
+                float t = edges[axis][i].t;
+                if (t > nodeBox.pmin.e[axis] && t < nodeBox.pmax.e[axis]) {
+                    float belowSA = 2 * (d.e[a1]*d.e[a2] + (t - nodeBox.pmin.e[axis]) * (d.e[a1] + d.e[a2]));
+                    float aboveSA = 2 * (d.e[a1]*d.e[a2] + (nodeBox.pmax.e[axis] - t) * (d.e[a1] + d.e[a2]));
+                    float pBelow = belowSA * invTotalSA;
+                    float pAbove = aboveSA * invTotalSA;
+                    float bonus = (nAbove == 0 || nBelow == 0) ? options.emptyBonus : 0.0f;
+                    float cost = options.travCost + options.isectCost * (1 - bonus) * (pBelow * nBelow + pAbove * nAbove);
+
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestOffset = i;
+                    }
+                }
+
+                if (edges[axis][i].start) {
+                    nBelow++;
+                }
+            }
+        }
+
+        if (bestCost > oldCost) {
+            badRefines++;
+        }
+
+        if ((bestCost > 4 * oldCost && n < 16) || bestAxis == -1 || badRefines == KD_MAX_BAD_REFINES) {
+            makeLeaf(nodeIdx, prims);
+            return;
+        }
+
+        // split the primitives using the sorted edges, before the children reuse them
+        std::vector<uint32_t> below, above;
+        for (int i = 0; i < bestOffset; i++) {
+            if (edges[bestAxis][i].start) {
+                below.push_back(edges[bestAxis][i].prim);
+            }
+        }
+
+        for (uint32_t i = bestOffset + 1; i < 2*n; i++) {
+            if (!edges[bestAxis][i].start) {
+                above.push_back(edges[bestAxis][i].prim);
+            }
+        }
+
+        float split = edges[bestAxis][bestOffset].t;
+        aabb belowBox = nodeBox, aboveBox = nodeBox;
+        belowBox.pmax.e[bestAxis] = split;
+        aboveBox.pmin.e[bestAxis] = split;
+
+        build(belowBox, below, depth - 1, badRefines);
+        uint32_t aboveIdx = nodes.size();
+        build(aboveBox, above, depth - 1, badRefines);
+
+        nodes[nodeIdx].split = split;
+        nodes[nodeIdx].flags = (aboveIdx << 2) | bestAxis;
+    }
+
+    /*
+    * Copy the subtree at cur into tree depth first, putting the pending subtrees
+    * (built into subtrees) in place and moving every offset to match.
+    */
+    void splice(kdTree &tree, uint32_t cur, const std::vector<int> &pendingAt, std::vector<kdBuilder*> &subtrees)
+    {
+        if (pendingAt[cur] >= 0) {
+            const kdBuilder &sub = *subtrees[pendingAt[cur]];
+            uint32_t nodeBase = tree.builtNodes.size();
+            uint32_t primBase = tree.builtPrimIndices.size();
+
+            for (kdNode node : sub.nodes) {
+                if (node.isLeaf()) {
+                    node.primOffset += primBase;
+                }
+
+                else {
+                    node.flags += nodeBase << 2;
+                }
+                tree.builtNodes.push_back(node);
+            }
+
+            tree.builtPrimIndices.insert(tree.builtPrimIndices.end(), sub.primIndices.begin(), sub.primIndices.end());
+            return;
+        }
+
+        kdNode node = nodes[cur];
+        uint32_t nodeIdx = tree.builtNodes.size();
+
+        if (node.isLeaf()) {
+            uint32_t offset = node.primOffset;
+            node.primOffset = tree.builtPrimIndices.size();
+            tree.builtNodes.push_back(node);
+            tree.builtPrimIndices.insert(tree.builtPrimIndices.end(), primIndices.begin() + offset,
+                                         primIndices.begin() + offset + node.numPrims());
+            return;
+        }
+
+        tree.builtNodes.push_back(node);
+        splice(tree, cur + 1, pendingAt, subtrees);
+        tree.builtNodes[nodeIdx].flags = (tree.builtNodes.size() << 2) | node.axis();
+        splice(tree, node.aboveChild(), pendingAt, subtrees);
+    }
+};
+
+/* Build the tree over primBounds. Primitive i of the tree is primBounds[i]. */
+void kdTree::build(const std::vector<aabb> &primBounds, const kdBuildOptions &options)
+{
+    builtNodes.clear();
+    builtPrimIndices.clear();
+    use(arrayView<kdNode>(), arrayView<uint32_t>(), aabb());
+
+    if (primBounds.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> prims(primBounds.size());
+    for (uint32_t i = 0; i < primBounds.size(); i++) {
+        prims[i] = i;
+        box.extend(primBounds[i]);
+    }
+
+    // pad flat boxes (e.g. a single quad) so the SAH has some area to work with
+    for (int a = 0; a < 3; a++) {
+        if (box.pmax.e[a] - box.pmin.e[a] < 1e-6f) {
+            box.pmin.e[a] -= 1e-4f;
+            box.pmax.e[a] += 1e-4f;
+        }
+    }
+
+    int maxDepth = (int) std::round(8 + 1.3f * std::log2((float) primBounds.size()));
+    maxDepth = std::min(maxDepth, KD_STACK_SIZE - 1);
+
+    kdBuilder builder(primBounds, options);
+    threadPool* pool = options.pool;
+
+    if (!pool || pool->size() <= 1 || primBounds.size() <= KD_TASK_PRIMS) {
+        builder.build(box, prims, maxDepth, 0);
+        builtNodes.swap(builder.nodes);
+        builtPrimIndices.swap(builder.primIndices);
+        use(builtNodes, builtPrimIndices, box);
+        return;
+    }
+
+    // build the top of the tree, then every subtree below it on the pool at once
+    builder.taskPrims = std::max(KD_TASK_PRIMS, (uint32_t) primBounds.size() / (16 * pool->size()));
+    builder.build(box, prims, maxDepth, 0);
+
+    std::vector<kdBuilder*> subtrees(builder.pending.size());
+    pool->parallelFor(builder.pending.size(), [&](int t, int) {
+        const kdPending &p = builder.pending[t];
+        subtrees[t] = new kdBuilder(primBounds, options);
+        subtrees[t]->build(p.box, p.prims, p.depth, p.badRefines);
+    });
+
+    std::vector<int> pendingAt(builder.nodes.size(), -1);
+    for (size_t t = 0; t < builder.pending.size(); t++) {
+        pendingAt[builder.pending[t].nodeIdx] = t;
+    }
+
+    builder.splice(*this, 0, pendingAt, subtrees);
+
+    for (kdBuilder* sub : subtrees) {
+        delete sub;
+    }
+
+    use(builtNodes, builtPrimIndices, box);
+}
+
+/* Use nodes and primIndices that live somewhere else, e.g. in a mapped file */
+void kdTree::use(arrayView<kdNode> nodes_, arrayView<uint32_t> primIndices_, const aabb &box_)
+{
+    nodes = nodes_;
+    primIndices = primIndices_;
+    box = box_;
+}
+
+/* Cost of the subtree at cur, whose bounds are nodeBox, times the surface area of the root */
+static float subtreeCost(const kdTree &tree, uint32_t cur, const aabb &nodeBox, const kdBuildOptions &options)
+{
+    const kdNode &node = tree.nodes[cur];
+
+    if (node.isLeaf()) {
+        return options.isectCost * node.numPrims() * nodeBox.surfaceArea();
+    }
+
+    aabb belowBox = nodeBox, aboveBox = nodeBox;
+    belowBox.pmax.e[node.axis()] = node.split;
+    aboveBox.pmin.e[node.axis()] = node.split;
+
+    return options.travCost * nodeBox.surfaceArea() + subtreeCost(tree, cur + 1, belowBox, options) +
+           subtreeCost(tree, node.aboveChild(), aboveBox, options);
+}
+
+/*
+* Expected cost of tracing a ray through the tree by the surface area heuristic,
+* with the costs in options: a node or primitive costs what it does times the
+* chance a ray through the root goes through it.
+*/
+float kdTree::sahCost(const kdBuildOptions &options) const
+{
+    if (nodes.empty() || box.surfaceArea() <= 0.0f) {
+        return 0.0f;
+    }
+
+    return subtreeCost(*this, 0, box, options) / box.surfaceArea();
+}
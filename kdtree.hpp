@@ -0,0 +1,324 @@
+/*
+* kdtree.hpp
+* Contains a kd-tree built with the surface area heuristic over a list of
+* primitive bounds. Like the bvh, it only knows about primitive indices; callers
+* pass traverse() a function that intersects primitive i. triangleMesh uses
+* one over its triangles.
+*/
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+#include <cstdint>
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "packet.hpp"
+#include "arrayview.hpp"
+
+const int KD_STACK_SIZE = 64;
+
+class threadPool;
+
+/*
+* A node in the flattened tree, 8 bytes. The low 2 bits of flags are the split
+* axis for interior nodes and 3 for leaves. The rest of flags is the index of
+* the child above the split plane (the child below is always the next node), or
+* the number of primitives in a leaf.
+*/
+struct kdNode
+{
+    union {
+        float split;          // interior: position of the split plane
+        uint32_t primOffset;  // leaf: first entry in primIndices
+    };
+    uint32_t flags;
+
+    bool isLeaf() const { return (flags & 3) == 3; }
+    int axis() const { return flags & 3; }
+    uint32_t numPrims() const { return flags >> 2; }
+    uint32_t aboveChild() const { return flags >> 2; }
+};
+
+/*
+* Costs used by the surface area heuristic while building. The defaults suit a
+* primitive at a time intersector; cheaper intersection (e.g. testing several
+* triangles at once) should lower isectCost and raise maxPrims to get bigger leaves.
+*/
+struct kdBuildOptions
+{
+    float isectCost = 80.0f;  // cost of testing a primitive
+    float travCost = 1.0f;    // cost of visiting an interior node
+    float emptyBonus = 0.5f;  // discount for splits that leave one side empty
+    uint32_t maxPrims = 2;    // stop splitting at this many primitives
+    threadPool* pool = nullptr;  // builds in parallel on it if set
+};
+
+/*
+* The nodes and primitive ids are read through views, which point either at the
+* tree's own storage when it was built here, or at a cache file it was mapped
+* from (see meshaccel.hpp).
+*/
+struct kdTree
+{
+    arrayView<kdNode> nodes;             // nodes[0] is the root
+    arrayView<uint32_t> primIndices;     // primitive ids, leaves refer to ranges of this
+    aabb box;                            // bounds of the whole tree
+
+    std::vector<kdNode> builtNodes;      // storage for a tree built by build()
+    std::vector<uint32_t> builtPrimIndices;
+
+    kdTree() {}
+    kdTree(const kdTree&) = delete;      // the views would point at the other tree's storage
+    kdTree &operator=(const kdTree&) = delete;
+
+    void build(const std::vector<aabb> &primBounds, const kdBuildOptions &options = kdBuildOptions());
+    void use(arrayView<kdNode> nodes_, arrayView<uint32_t> primIndices_, const aabb &box_);
+    bool empty() const { return nodes.empty(); }
+    float sahCost(const kdBuildOptions &options) const;
+
+    /*
+    * Find the closest hit, visiting leaves front to back. intersect(leaf, tmax)
+    * tests the primitives in a (non-empty) leaf and returns true if any was hit,
+    * in which case it must also shrink tmax. The leaf's primitives are
+    * primIndices[leaf.primOffset] onwards; callers can also keep their own data
+    * per leaf keyed on primOffset. Traversal stops as soon as the closest hit is
+    * nearer than the next node.
+    */
+    template <typename F>
+    bool traverse(const ray &r, float tmin, float &tmax, F intersect) const
+    {
+        struct entry { uint32_t node; float t0, t1; };
+
+        vec3 invDir = reciprocal(r.direction);
+        float t0, t1;
+
+        if (nodes.empty() || !box.hit(r, invDir, tmin, tmax, t0, t1)) {
+            return false;
+        }
+
+        entry stack[KD_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+        bool hitSomething = false;
+
+        while (true) {
+            // everything left is behind the closest hit
+            if (tmax < t0) {
+                break;
+            }
+
+            const kdNode &node = nodes[cur];
+
+            if (!node.isLeaf()) {
+                int a = node.axis();
+                float tPlane = (node.split - r.origin.e[a]) * invDir.e[a];
+                bool belowFirst = r.origin.e[a] < node.split ||
+                                  (r.origin.e[a] == node.split && r.direction.e[a] <= 0);
+                uint32_t first = belowFirst ? cur + 1 : node.aboveChild();
+                uint32_t second = belowFirst ? node.aboveChild() : cur + 1;
+
+                if (tPlane > t1 || tPlane <= 0) {
+                    cur = first;
+                }
+
+                else if (tPlane < t0) {
+                    cur = second;
+                }
+
+                else {
+                    stack[top++] = { second, tPlane, t1 };
+                    cur = first;
+                    t1 = tPlane;
+                }
+
+                continue;
+            }
+
+            if (node.numPrims() > 0 && intersect(node, tmax)) {
+                hitSomething = true;
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            top--;
+            cur = stack[top].node;
+            t0 = stack[top].t0;
+            t1 = stack[top].t1;
+        }
+
+        return hitSomething;
+    }
+
+    /* Same as traverse, but stops as soon as occluded(leaf, tmax) reports any hit. */
+    template <typename F>
+    bool traverseAny(const ray &r, float tmin, float tmax, F occluded) const
+    {
+        struct entry { uint32_t node; float t0, t1; };
+
+        vec3 invDir = reciprocal(r.direction);
+        float t0, t1;
+
+        if (nodes.empty() || !box.hit(r, invDir, tmin, tmax, t0, t1)) {
+            return false;
+        }
+
+        entry stack[KD_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+
+        while (true) {
+            const kdNode &node = nodes[cur];
+
+            if (!node.isLeaf()) {
+                int a = node.axis();
+                float tPlane = (node.split - r.origin.e[a]) * invDir.e[a];
+                bool belowFirst = r.origin.e[a] < node.split ||
+                                  (r.origin.e[a] == node.split && r.direction.e[a] <= 0);
+                uint32_t first = belowFirst ? cur + 1 : node.aboveChild();
+                uint32_t second = belowFirst ? node.aboveChild() : cur + 1;
+
+                if (tPlane > t1 || tPlane <= 0) {
+                    cur = first;
+                }
+
+                else if (tPlane < t0) {
+                    cur = second;
+                }
+
+                else {
+                    stack[top++] = { second, tPlane, t1 };
+                    cur = first;
+                    t1 = tPlane;
+                }
+
+                continue;
+            }
+
+            if (node.numPrims() > 0 && occluded(node, tmax)) {
+                return true;
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            top--;
+            cur = stack[top].node;
+            t0 = stack[top].t0;
+            t1 = stack[top].t1;
+        }
+
+        return false;
+    }
+
+    /*
+    * Find the closest hits of a packet whose lanes all point the same way along
+    * every axis (check with rayPacket::commonSign first). Lanes go through the tree
+    * together; at each split the packet visits the near child with the lanes that
+    * need it, then the far child with the lanes that need that. intersect(i, lanes)
+    * tests primitive i against the given lanes, shrinks their tmax, and returns the
+    * lanes it hit. Lanes drop out once their closest hit is in front of the node,
+    * or when intersect() takes them out of p.active (e.g. blocked shadow rays).
+    */
+    template <typename F>
+    laneMask traversePacket(rayPacket &p, float tmin, F intersect) const
+    {
+        struct entry { uint32_t node; laneMask lanes; float t0[PACKET_SIZE], t1[PACKET_SIZE]; };
+
+        float t0[PACKET_SIZE], t1[PACKET_SIZE], tPlane[PACKET_SIZE];
+        laneMask lanes = nodes.empty() ? 0 : packetHitsBox(p, box, tmin, t0, t1);
+        laneMask hitLanes = 0;
+
+        if (!lanes) {
+            return 0;
+        }
+
+        int sign[3] = { p.commonSign(0), p.commonSign(1), p.commonSign(2) };
+        entry stack[KD_STACK_SIZE];
+        int top = 0;
+        uint32_t cur = 0;
+
+        while (p.active) {
+            // drop the lanes whose closest hit is in front of this node, and
+            // any that intersect() took out of the packet
+            lanes &= p.active;
+            for (int l = 0; l < PACKET_SIZE; l++) {
+                lanes &= ~((laneMask) (p.tmax[l] < t0[l]) << l);
+            }
+
+            if (lanes) {
+                const kdNode &node = nodes[cur];
+
+                if (!node.isLeaf()) {
+                    int a = node.axis();
+                    const float* o = a == 0 ? p.ox : (a == 1 ? p.oy : p.oz);
+                    const float* id = a == 0 ? p.idx : (a == 1 ? p.idy : p.idz);
+                    laneMask needNear = 0, needFar = 0;
+
+                    // written so a NaN plane distance sends the lane both ways
+                    for (int l = 0; l < PACKET_SIZE; l++) {
+                        tPlane[l] = (node.split - o[l]) * id[l];
+                        needNear |= (laneMask) !(tPlane[l] < t0[l]) << l;
+                        needFar |= (laneMask) !(tPlane[l] > t1[l]) << l;
+                    }
+
+                    uint32_t nearChild = sign[a] > 0 ? cur + 1 : node.aboveChild();
+                    uint32_t farChild = sign[a] > 0 ? node.aboveChild() : cur + 1;
+                    needNear &= lanes;
+                    needFar &= lanes;
+
+                    if (needFar && needNear) {
+                        entry &e = stack[top++];
+                        e.node = farChild;
+                        e.lanes = needFar;
+                        for (int l = 0; l < PACKET_SIZE; l++) {
+                            e.t0[l] = std::max(t0[l], tPlane[l]);
+                            e.t1[l] = t1[l];
+                        }
+                    }
+
+                    if (needNear) {
+                        for (int l = 0; l < PACKET_SIZE; l++) {
+                            t1[l] = std::min(t1[l], tPlane[l]);
+                        }
+                        cur = nearChild;
+                        lanes = needNear;
+                    }
+
+                    else {
+                        for (int l = 0; l < PACKET_SIZE; l++) {
+                            t0[l] = std::max(t0[l], tPlane[l]);
+                        }
+                        cur = farChild;
+                        lanes = needFar;
+                    }
+
+                    continue;
+                }
+
+                for (uint32_t i = 0; i < node.numPrims(); i++) {
+                    hitLanes |= intersect(primIndices[node.primOffset + i], lanes);
+                }
+            }
+
+            if (top == 0) {
+                break;
+            }
+
+            top--;
+            cur = stack[top].node;
+            lanes = stack[top].lanes;
+            for (int l = 0; l < PACKET_SIZE; l++) {
+                t0[l] = stack[top].t0[l];
+                t1[l] = stack[top].t1[l];
+            }
+        }
+
+        return hitLanes;
+    }
+};
+
+#endif
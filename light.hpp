@@ -1,6 +1,7 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <vector>
 #include "vec.hpp"
 #include "matrix.hpp"
 
@@ -16,7 +17,30 @@ struct pointLight {
     pointLight(vec3 location_, float strength_, rgb colour_) : location(location_), strength(strength_), colour(colour_) {}
 };
 
-std::ostream& operator <<(std::ostream &out, pointLight &toString)
+/*
+* lightList: the position and radiance (colour * strength) of every point light,
+* stored as structure of arrays so shadow rays towards several lights can be
+* set up together.
+*/
+struct lightList {
+    std::vector<float> x, y, z;  // positions
+    std::vector<rgb> radiance;
+
+    lightList(const std::vector<pointLight*> &pointLights)
+    {
+        for (auto l : pointLights) {
+            x.push_back(l->location.x);
+            y.push_back(l->location.y);
+            z.push_back(l->location.z);
+            radiance.push_back(l->colour * l->strength);
+        }
+    }
+
+    int size() const { return x.size(); }
+    vec3 position(int i) const { return vec3(x[i], y[i], z[i]); }
+};
+
+inline std::ostream& operator <<(std::ostream &out, pointLight &toString)
 {
     out << "pointLight: " << "(" << toString.location << ") .. Strength: " << toString.strength;
     return out; 
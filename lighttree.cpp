@@ -0,0 +1,142 @@
+/*
+* lighttree.cpp
+* Implements building and sampling the light tree from lighttree.hpp.
+*/
+
+#include "lighttree.hpp"
+
+/* Build the bvh over the lights and add up their power from the leaves up. */
+void lightTree::build(const lightList &lights)
+{
+    std::vector<aabb> boxes;
+    for (int i = 0; i < lights.size(); i++) {
+        boxes.push_back(aabb(lights.position(i), lights.position(i)));
+    }
+
+    bvhBuildOptions options;
+    options.maxLeafSize = 1;
+    tree.build(boxes, options);
+    power.assign(tree.nodes.size(), 0.0f);
+
+    // children always come after their parent, so walk the nodes backwards
+    for (int cur = (int) tree.nodes.size() - 1; cur >= 0; cur--) {
+        const bvhNode &node = tree.nodes[cur];
+
+        if (node.count == 0) {
+            power[cur] = power[cur + 1] + power[node.offset];
+        }
+
+        else {
+            for (uint32_t i = 0; i < node.count; i++) {
+                power[cur] += luminance(lights.radiance[tree.indices[node.offset + i]]);
+            }
+        }
+    }
+}
+
+/*
+* How much lights with the given total power inside box could light p, up to a
+* constant factor: the power times the largest cosine between n and a corner of
+* the box. Point lights don't fall off with distance here, so that's all that
+* matters. It's only zero when the whole box is behind p, where none of the
+* lights can light it, so every light that can gets picked with some probability.
+*/
+static float importance(float power, const aabb &box, const vec3 &p, const vec3 &n)
+{
+    if (power <= 0.0f) {
+        return 0.0f;
+    }
+
+    bool inside = p.x >= box.pmin.x && p.y >= box.pmin.y && p.z >= box.pmin.z &&
+                  p.x <= box.pmax.x && p.y <= box.pmax.y && p.z <= box.pmax.z;
+    if (inside) {
+        return power;
+    }
+
+    float cosMax = 0.0f;
+    for (int k = 0; k < 8; k++) {
+        vec3 corner((k & 1) ? box.pmax.x : box.pmin.x,
+                    (k & 2) ? box.pmax.y : box.pmin.y,
+                    (k & 4) ? box.pmax.z : box.pmin.z);
+        vec3 d = corner - p;
+        cosMax = std::max(cosMax, dot(n, d) / length(d));
+    }
+
+    return power * cosMax;
+}
+
+int lightTree::sample(const lightList &lights, const vec3 &p, const vec3 &n, float u, float &pdf) const
+{
+    pdf = 0.0f;
+
+    if (tree.empty()) {
+        return -1;
+    }
+
+    vec3 normal = makeUnitVector(n);
+    float prob = 1.0f;
+    uint32_t cur = 0;
+
+    // pick a child at every interior node, reusing what's left of u for the next one
+    while (tree.nodes[cur].count == 0) {
+        uint32_t left = cur + 1;
+        uint32_t right = tree.nodes[cur].offset;
+        float il = importance(power[left], tree.nodes[left].box, p, normal);
+        float ir = importance(power[right], tree.nodes[right].box, p, normal);
+
+        if (il + ir <= 0.0f) {
+            return -1;
+        }
+
+        float pl = il / (il + ir);
+
+        if (u < pl) {
+            u /= pl;
+            prob *= pl;
+            cur = left;
+        }
+
+        else {
+            u = (u - pl) / (1.0f - pl);
+            prob *= 1.0f - pl;
+            cur = right;
+        }
+
+        u = std::min(u, 0.99999994f);
+    }
+
+    // leaves can hold a few lights (e.g. ones on a line); pick one in proportion to its own importance
+    const bvhNode &leaf = tree.nodes[cur];
+    float weights[16];  // the bvh never makes leaves bigger than 16
+    float total = 0.0f;
+
+    for (uint32_t i = 0; i < leaf.count; i++) {
+        uint32_t l = tree.indices[leaf.offset + i];
+        vec3 q = lights.position(l);
+        weights[i] = importance(luminance(lights.radiance[l]), aabb(q, q), p, normal);
+        total += weights[i];
+    }
+
+    if (total <= 0.0f) {
+        return -1;
+    }
+
+    float target = u * total;
+    for (uint32_t i = 0; i < leaf.count; i++) {
+        if (weights[i] > 0.0f && target < weights[i]) {
+            pdf = prob * weights[i] / total;
+            return tree.indices[leaf.offset + i];
+        }
+        target -= weights[i];
+    }
+
+    // rounding left target past the last light with any weight
+    for (int i = leaf.count - 1; i >= 0; i--) {
+        if (weights[i] > 0.0f) {
+            pdf = prob * weights[i] / total;
+            return tree.indices[leaf.offset + i];
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,34 @@
+/*
+* lighttree.hpp
+* Contains a light tree: a bvh over the point lights' positions with the total
+* power of the lights below each node. With many lights, a hit point picks a
+* few of them by walking down the tree, choosing each child in proportion to
+* how much its lights could contribute, instead of tracing a shadow ray towards
+* every light.
+*/
+
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include <vector>
+#include "bvh.hpp"
+#include "light.hpp"
+
+struct lightTree
+{
+    bvh tree;                  // one light per leaf
+    std::vector<float> power;  // per node: total luminance of the lights below it
+
+    void build(const lightList &lights);
+    bool empty() const { return tree.empty(); }
+
+    /*
+    * Pick a light to shade point p (with normal n) with, using u in [0,1).
+    * Returns its index in lights and the probability pdf of picking it, or -1 if
+    * no light can light p. Every light that could light p has pdf > 0, so
+    * dividing its contribution by pdf gives an unbiased estimate of all of them.
+    */
+    int sample(const lightList &lights, const vec3 &p, const vec3 &n, float u, float &pdf) const;
+};
+
+#endif
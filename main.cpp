@@ -5,19 +5,35 @@
 
 #include <iostream>
 #include <ctime>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
 #include "vec.hpp"
 #include "shape.hpp"
+#include "scene.hpp"
 #include "img.hpp"
 #include "light.hpp"
+#include "lighttree.hpp"
 #include "matrix.hpp"
+#include "threadpool.hpp"
+#include "sampler.hpp"
+#include "checkpoint.hpp"
 
 const int WIDTH  = 500;
 const int HEIGHT = 500;
 const int MAX_BOUNCE = 7;
 const float SMALL_VAL = 0.000001f;
 const float FAR = 1000000.0f;
-const int NUM_SAMPLES = 15;
+const int NUM_SAMPLES = 8;   // default samples per pixel, see --spp
+const int FRACTAL_DEPTH = 3;            // default levels in the fractal scenes, see --fractal-depth
+const int ADAPTIVE_MIN_SAMPLES = 4;     // default samples before checking the error, see --min-spp
+const float ADAPTIVE_MAX_ERROR = 0.01f; // default error a pixel can stop at, see --max-error
+const double CHECKPOINT_INTERVAL = 60.0; // default seconds between checkpoints, see --checkpoint-every
+const int TIME_BUDGET_MAX_SPP = 65536;   // most samples per pixel with --time-budget, unless --spp says
 const rgb background(0.0f, 0.0f, 0.0f);
 const rgb white(1.0, 1.0, 1.0);
 const rgb red(1.0, 0.0, 0.0);
@@ -25,84 +41,165 @@ const rgb ambient(0.3, 0.3, 0.3);
 const float pi = 3.14159265359;
 img image(WIDTH, HEIGHT);
 
-/* Compute the lighting of the scene using the rendering equation. */
-inline rgb lighting(hitRecord rec, const std::vector<shape*> &shapes, const std::vector<pointLight*> &pointLights)
+// set by SIGTERM or SIGINT while checkpointing, to stop at the next tile and save
+std::atomic<bool> stopRequested(false);
+
+void requestStop(int)
+{
+    stopRequested = true;
+}
+
+/*
+* Settings for many-light sampling. With samples > 0, each hit picks that many
+* lights from tree in proportion to how much they could light it, instead of
+* tracing a shadow ray towards every light.
+*/
+struct lightSampling
+{
+    int samples = 0;
+    lightTree tree;
+};
+
+/* Diffuse light reaching p from direction w_i, from a light with radiance Li */
+inline rgb diffuse(const hitRecord &rec, const vec3 &w_i, const rgb &Li)
+{
+    float rho_d = 0.7f; //todo
+    float fr = rho_d / pi;
+    return fr * Li * dot(w_i, rec.normal); // rendering equation
+}
+
+/*
+* Light from every light. The shadow rays towards the lights are traced
+* PACKET_SIZE lights at a time as one packet, and try the shape that blocked
+* the last one towards the same light first.
+*/
+inline rgb allLights(const hitRecord &rec, const scene &world, const lightList &lights, occluderCache &occluders)
 {
-    float tmax;
     vec3 p = rec.pointOnSurface;
-    vec3 q;
     rgb lightContribution(0.0, 0.0, 0.0);
-    int numLights = pointLights.size();
-    bool blocked;
+    int numLights = lights.size();
 
     // Now check if there is any shape in the way of the path from p to q, for all q = a pointLight position
-    for (auto l : pointLights) {
-        q = l->location;
-        tmax = length(p - q);
-        vec3 w_i = makeUnitVector(q - p);
-        ray r(p, w_i);
+    for (int base = 0; base < numLights; base += PACKET_SIZE) {
+        rayPacket shadowRays;
+        vec3 w_i[PACKET_SIZE];
+        shadowRays.active = 0;
+
+        for (int l = 0; l < PACKET_SIZE && base + l < numLights; l++) {
+            vec3 q = lights.position(base + l);
+            w_i[l] = makeUnitVector(q - p);
+            shadowRays.set(l, ray(p, w_i[l]), length(p - q));
+
+            if (dot(rec.normal, w_i[l]) >= 0) {
+                shadowRays.active |= 1u << l;
+            }
+        }
 
-        if (dot(rec.normal, w_i) < 0) {
+        if (!shadowRays.active) {
             continue;
         }
 
-        blocked = false;
-        for (auto s : shapes) {
-            // the shape is shadowed by another shape
-            if (s->shadowHit(r, SMALL_VAL + 0.01, tmax, 0)) {
-                blocked = true;
-                break;
+        shadowRays.padInactive();
+        laneMask lit = shadowRays.active & ~world.shadowPacket(shadowRays, SMALL_VAL + 0.01, &occluders.lastOccluder[base]);
+
+        // the lights whose shadow rays weren't blocked by another shape
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (lit & (1u << l)) {
+                lightContribution += diffuse(rec, w_i[l], lights.radiance[base + l]);
             }
         }
+    }
+
+    return lightContribution;
+}
+
+/*
+* Estimate the light from every light with a few picked from the light tree.
+* The k picks are stratified over u, and each one is divided by k times the
+* probability of picking it, so on average it adds up to allLights().
+*/
+inline rgb sampledLights(const hitRecord &rec, const scene &world, const lightList &lights,
+                         const lightSampling &lightSamp, occluderCache &occluders, float u)
+{
+    vec3 p = rec.pointOnSurface;
+    rgb lightContribution(0.0, 0.0, 0.0);
+    int k = lightSamp.samples;
+
+    for (int s = 0; s < k; s++) {
+        float pdf;
+        int light = lightSamp.tree.sample(lights, p, rec.normal, (s + u) / k, pdf);
 
-        if (blocked == false) {
-            vec3 Li = l->colour * l->strength;
-            float rho_d = 0.7f; //todo
-            float fr = rho_d / pi;
-            lightContribution += fr * Li * dot(w_i, rec.normal); // rendering equation
+        if (light < 0) {
+            continue;
+        }
+
+        vec3 q = lights.position(light);
+        vec3 w_i = makeUnitVector(q - p);
+
+        if (dot(rec.normal, w_i) >= 0 &&
+            !world.shadowHit(ray(p, w_i), SMALL_VAL + 0.01, length(p - q), occluders.lastOccluder[light])) {
+            lightContribution += diffuse(rec, w_i, lights.radiance[light]) / (k * pdf);
         }
     }
 
+    return lightContribution;
+}
+
+/*
+* Compute the lighting of the scene using the rendering equation, from every
+* light or, in many-light mode, from a few picked with samp.
+*/
+inline rgb lighting(const hitRecord &rec, const scene &world, const lightList &lights,
+                    const lightSampling &lightSamp, occluderCache &occluders, sampler &samp)
+{
+    rgb lightContribution = lightSamp.samples > 0 ?
+        sampledLights(rec, world, lights, lightSamp, occluders, samp.get1D()) :
+        allLights(rec, world, lights, occluders);
+
     lightContribution += ambient; // make sure everything in the scene isn't just black!
     lightContribution *= rec.colour;
 
     return lightContribution;
 }
 
-/* Trace a ray to a point and return the colour of that point */
-inline rgb trace(ray r, const std::vector<shape*> &shapes, const std::vector<pointLight*> &pointLights)
+/*
+* Trace a ray to a point and return the colour of that point. If the closest hit
+* of the first bounce is already known (from a packet), pass it in as firstHit,
+* with whether anything was hit in firstHitFound, so it isn't traced again.
+*/
+inline rgb trace(ray r, const scene &world, const lightList &lights, const lightSampling &lightSamp,
+                 occluderCache &occluders, sampler &samp, const hitRecord* firstHit = nullptr, bool firstHitFound = false)
 {   
     hitRecord rec;    // Contains information concerning what we hit
-    shape* hitShape;  // The shape we actually hit
-    float tmax;
+    bool hitSomething;
     int i;
     rgb colour;
 
     for (i = 0; i <= MAX_BOUNCE; i++) {
-        tmax = FAR;
-        hitShape = nullptr;
-
         // Find the closest shape hit by the ray, if one exists
-        for (auto s : shapes) {
-            if (s->hit(r, SMALL_VAL, tmax, 0, rec)) {
-                tmax = rec.t;
-                hitShape = s;
-            }
+        if (i == 0 && firstHit) {
+            rec = *firstHit;
+            hitSomething = firstHitFound;
+        }
+
+        else {
+            hitSomething = world.hit(r, SMALL_VAL, FAR, rec);
         }
 
-        // At this point, tmax contains the distance from the eye to the closest shape.
-        // Now we want to determine whether or not the point at distance tmax should be coloured.
-        if (hitShape) {
+        // At this point, rec.t contains the distance from the eye to the closest shape.
+        // Now we want to determine whether or not the point at distance rec.t should be coloured.
+        if (hitSomething) {
             rec.pointOnSurface = r.origin + rec.t * r.direction;
 
-            if (hitShape->mirror) {
+            if (rec.mirror) {
                 vec3 normal = makeUnitVector(rec.normal);
                 r.direction = r.direction - 2.0f * dot(normal, r.direction) * normal; // reflect
                 r.origin = rec.pointOnSurface + r.direction * 0.001f;
                 continue; // bounce
             }
 
-            colour = lighting(rec, shapes, pointLights) * (1.0f - (float)i / (MAX_BOUNCE + 1));
+            samp.startBounce(i);
+            colour = lighting(rec, world, lights, lightSamp, occluders, samp) * (1.0f - (float)i / (MAX_BOUNCE + 1));
             break;
         }
 
@@ -117,124 +214,160 @@ inline rgb trace(ray r, const std::vector<shape*> &shapes, const std::vector<poi
 }
 
 /* Initialize the lights to be put in the scene */
-inline void initLights(std::vector<pointLight*> &pointLights)
+inline void initLights(std::vector<pointLight*> &pointLights, int extraLights)
 {
     pointLights.push_back(new pointLight());
     pointLights.push_back( new pointLight( vec3(800, 400, -400), 2.0f, rgb(0.7, 0.7, 0.0f)));
     pointLights.push_back( new pointLight( vec3(0, 200, 100), 2.0f, rgb(0.5, 0.0, 0.9f)));
     pointLights.push_back( new pointLight( vec3(350, 300, 300), 2.0f, rgb(0.5, 0.7, 0.9f)));
     pointLights.push_back( new pointLight( vec3(600, 600, -600), 2.0f, rgb(0.7, 0.7, 0.7f)));
+
+    // dim lights scattered around the scene, the same ones every run, for scenes with many lights
+    for (int i = 0; i < extraLights; i++) {
+        vec3 u(toUnitFloat(hashedUint(0, i, 0, 0)), toUnitFloat(hashedUint(0, i, 0, 1)), toUnitFloat(hashedUint(0, i, 0, 2)));
+        vec3 location(-200 + 1200 * u.x, -200 + 1000 * u.y, -800 + 1200 * u.z);
+        pointLights.push_back(new pointLight(location, 4.0f / extraLights, rgb(0.7, 0.7, 0.7f)));
+    }
 }
 
 /* Load the fractal scene made of cubes */
-void initFractalCubes(std::vector<shape*> &shapes, int depth, vec3 centre, float size, shape* s) {
-    if (depth == 3) return; // max depth of fractal
+void initFractalCubes(scene &world, int depth, int maxDepth, vec3 centre, float size, shape* s) {
+    if (depth == maxDepth) return; // max depth of fractal
 
     tmat c = translate(centre.x, centre.y, centre.z);
     tmat sc = scale(size, size, size);
     tmat rot = rotateZ(50) * rotateY(50);
-    shapes.push_back(new instance(c * sc * rot, s));
-
-    if (depth % 2 != 0)
-        shapes.back()->mirror = true;
-
-    initFractalCubes(shapes, depth + 1, centre + vec3(size*1.5, 0, 0), size * 0.5, s);
-    initFractalCubes(shapes, depth + 1, centre + vec3(-size*1.5, 0, 0), size * 0.5, s);
-    initFractalCubes(shapes, depth + 1, centre + vec3(0, size*1.5, 0), size * 0.5, s);
-    initFractalCubes(shapes, depth + 1, centre + vec3(0, -size*1.5, 0), size * 0.5, s);
-    initFractalCubes(shapes, depth + 1, centre + vec3(0, 0, size*1.5), size * 0.5, s);
-    initFractalCubes(shapes, depth + 1, centre + vec3(0, 0, -size*1.5), size * 0.5, s);
+    world.addInstance(c * sc * rot, s, depth % 2 != 0);
+
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(size*1.5, 0, 0), size * 0.5, s);
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(-size*1.5, 0, 0), size * 0.5, s);
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(0, size*1.5, 0), size * 0.5, s);
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(0, -size*1.5, 0), size * 0.5, s);
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(0, 0, size*1.5), size * 0.5, s);
+    initFractalCubes(world, depth + 1, maxDepth, centre + vec3(0, 0, -size*1.5), size * 0.5, s);
 }
 
 /* Load the fractal scene made of spheres */
-void initFractalSpheres(std::vector<shape*> &shapes, int depth, vec3 centre, float size, shape* s) {
-    if (depth == 3) return; // max depth of fractal
+void initFractalSpheres(scene &world, int depth, int maxDepth, vec3 centre, float size, shape* s) {
+    if (depth == maxDepth) return; // max depth of fractal
 
     tmat c = translate(centre.x, centre.y, centre.z);
     tmat sc = scale(size, size, size);
-    shapes.push_back(new instance(c * sc, s));
+    world.addInstance(c * sc, s, depth % 2 != 0);
+
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(size*2, 0, 0), size * 0.5, s);
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(-size*2, 0, 0), size * 0.5, s);
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(0, size*2, 0), size * 0.5, s);
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(0, -size*2, 0), size * 0.5, s);
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(0, 0, size*2), size * 0.5, s);
+    initFractalSpheres(world, depth + 1, maxDepth, centre + vec3(0, 0, -size*2), size * 0.5, s);
+}
 
-    if (depth % 2 != 0)
-        shapes.back()->mirror = true;
+/*
+* Load a mesh for one of the scenes, streamed through the geometry cache if streamMeshes is set.
+* Returns nullptr if it couldn't be loaded (the error's already been reported).
+*/
+inline shape* loadMesh(const char* fname, const rgb &colour, bool compressMeshes, bool streamMeshes, bool verifyMeshCache,
+                       threadPool* pool)
+{
+    if (streamMeshes) {
+        streamedMesh* sm = new streamedMesh(fname, colour, pool);
+        if (!sm->loaded()) {
+            delete sm;
+            return nullptr;
+        }
+        return sm;
+    }
 
-    initFractalSpheres(shapes, depth + 1, centre + vec3(size*2, 0, 0), size * 0.5, s);
-    initFractalSpheres(shapes, depth + 1, centre + vec3(-size*2, 0, 0), size * 0.5, s);
-    initFractalSpheres(shapes, depth + 1, centre + vec3(0, size*2, 0), size * 0.5, s);
-    initFractalSpheres(shapes, depth + 1, centre + vec3(0, -size*2, 0), size * 0.5, s);
-    initFractalSpheres(shapes, depth + 1, centre + vec3(0, 0, size*2), size * 0.5, s);
-    initFractalSpheres(shapes, depth + 1, centre + vec3(0, 0, -size*2), size * 0.5, s);
+    triangleMesh* m = new triangleMesh(fname, colour, compressMeshes, pool, verifyMeshCache);
+    if (!m->loaded()) {
+        delete m;
+        return nullptr;
+    }
+    return m;
 }
 
-/* Initialize the shapes to be rendered in the scene */
-inline void initShapes(std::vector<shape*> &shapes, const int &id)
+/* Initialize the shapes to be rendered in the scene. Scenes go on without meshes that fail to load. */
+inline void initShapes(scene &world, const int &id, bool compressMeshes, bool streamMeshes, bool verifyMeshCache,
+                       int fractalDepth, threadPool* pool)
 {
-    shapes.push_back(new plane (vec3(0,20, 0), vec3(0,1,0), rgb(1,1,1)));
+    world.add(new plane (vec3(0,20, 0), vec3(0,1,0), rgb(1,1,1)));
 
     if (id == 1) { // default boring dummy scene
-        shapes.push_back(new sphere (vec3(180,250,-200), 50.0f, rgb(0.1,0.7,0.7)));
-        shapes.push_back(new sphere (vec3(400,250,-200), 100.0f, rgb(0.9,0.9,0.0)));
-        shapes.push_back(new sphere (vec3(300,100,-200), 60.0f, rgb(0.9,0.1,0.7)));
-        shapes.back()->mirror = true;
+        world.add(new sphere (vec3(180,250,-200), 50.0f, rgb(0.1,0.7,0.7)));
+        world.add(new sphere (vec3(400,250,-200), 100.0f, rgb(0.9,0.9,0.0)));
+        world.add(new sphere (vec3(300,100,-200), 60.0f, rgb(0.9,0.1,0.7)));
+        world.shapes.back()->mirror = true;
     }
 
     else if (id == 2) { // every second sphere is a mirror, shows instancing
         for (int i = 0; i < 10; i++) {
             tmat moveSphere = translate(i*200, 300, -200);
             sphere* s = new sphere(vec3(0,0,0), 100.0f, rgb(0.1,0.7,0.7));
-            shapes.push_back(new instance(moveSphere, s));
-            if (i % 2 == 0) {
-                shapes.back()->mirror = true;
-            }
+            world.addInstance(moveSphere, s, i % 2 == 0);
         }
     }
 
     else if (id == 3) { // scene that shows we can load a triangle mesh
         tmat move = translate(200, 200, -50);
         tmat scaleMesh = scale(100, 100, 100);
-        triangleMesh* m = new triangleMesh("cube.mesh", red);
-        shapes.push_back(new instance(move * scaleMesh, m));
+        shape* m = loadMesh("cube.mesh", red, compressMeshes, streamMeshes, verifyMeshCache, pool);
+        if (m) {
+            world.addInstance(move * scaleMesh, m);
+        }
     }
 
     else if (id == 4) { // scene showing that we can move stuff around with matrices
         tmat move = translate(200, 200, -50);
         tmat scaleSphere = scale(100, 100, 100);
         sphere* s = new sphere(vec3(0,0,0), 1.0f, rgb(0.1,0.7,0.7));
-        shapes.push_back(new instance(move * scaleSphere, s));
+        world.addInstance(move * scaleSphere, s);
     }
 
     else if (id == 5) { // scene containing lots of cubes!
-        triangleMesh* m1 = new triangleMesh("cube.mesh", rgb(0.1,0.7,0.7));
-        triangleMesh* m2 = new triangleMesh("cube.mesh", rgb(0.9,0.9,0.1));
+        shape* m1 = loadMesh("cube.mesh", rgb(0.1,0.7,0.7), compressMeshes, streamMeshes, verifyMeshCache, pool);
+        shape* m2 = loadMesh("cube.mesh", rgb(0.9,0.9,0.1), compressMeshes, streamMeshes, verifyMeshCache, pool);
         sphere* s = new sphere(vec3(0,0,0), 1.0f, rgb(0.3,0.7,0.0));
 
-        shapes.push_back(new instance(translate(50, 260, -400) * scale(200, 200, 200) * rotateZ(70), m1));
-        shapes.push_back(new instance(translate(100, 500, -50) * scale(90, 90, 90) * rotateY(56), m2));
-        shapes.push_back(new instance(translate(500, 400, -150) * scale(200, 200, 200) * rotateZ(50), m1));
-        shapes.push_back(new instance(translate(600, 210, -300) * scale(90, 90, 90) * rotateX(90), m2));
-        shapes.push_back(new instance(translate(700, 600, -200) * scale(90, 90, 90) * rotateX(90), m1));
+        if (m1) {
+            world.addInstance(translate(50, 260, -400) * scale(200, 200, 200) * rotateZ(70), m1);
+            world.addInstance(translate(500, 400, -150) * scale(200, 200, 200) * rotateZ(50), m1);
+            world.addInstance(translate(700, 600, -200) * scale(90, 90, 90) * rotateX(90), m1);
+        }
+
+        if (m2) {
+            world.addInstance(translate(100, 500, -50) * scale(90, 90, 90) * rotateY(56), m2);
+            world.addInstance(translate(600, 210, -300) * scale(90, 90, 90) * rotateX(90), m2);
+        }
     }
 
     else if (id == 6) { // cubes with rotations in fractal
-        triangleMesh* m = new triangleMesh("cube.mesh", rgb(0.1,0.7,0.7));
-        initFractalCubes(shapes, 0, vec3(WIDTH/2, HEIGHT/2, -200), 100.0f, m);
+        shape* m = loadMesh("cube.mesh", rgb(0.1,0.7,0.7), compressMeshes, streamMeshes, verifyMeshCache, pool);
+        if (m) {
+            initFractalCubes(world, 0, fractalDepth, vec3(WIDTH/2, HEIGHT/2, -200), 100.0f, m);
+        }
     }
 
     else if (id == 7) { // spheres as fractal
         sphere* s = new sphere(vec3(0,0,0), 1.0f, rgb(0.1, 0.7, 0.7));
-        initFractalSpheres(shapes, 0, vec3(WIDTH/2, HEIGHT/2, -200), 100.0f, s);
+        initFractalSpheres(world, 0, fractalDepth, vec3(WIDTH/2, HEIGHT/2, -200), 100.0f, s);
     }
 }
 
-/* Randomly pick a place to sample in the pixel coordinate system */
-inline vec2 sample(const int &i, const int &j)
+/*
+* Pick a place to sample in the pixel coordinate system. samp has already been
+* started on this pixel and sample, so it knows which point to hand out.
+*/
+inline vec2 sample(const int &i, const int &j, sampler &samp)
 {  
-    return vec2(drand48() + i - 0.5f, drand48() + j - 0.5f);
+    vec2 u = samp.getPixel2D();
+    return vec2(u.x + i - 0.5f, u.y + j - 0.5f);
 }
 
 /* Return a ray to fire off at the scene, from a given point to give us perspective */
-inline ray getRayWithPerspective(const int &i, const int &j, const vec3 &origin)
+inline ray getRayWithPerspective(const int &i, const int &j, const vec3 &origin, sampler &samp)
 {
-    vec2 p = sample(i, j);
+    vec2 p = sample(i, j, samp);
     vec3 originToPixel(makeUnitVector(vec3(p.x, p.y, 0) - origin));
     return ray(origin, originToPixel);
 }
@@ -242,45 +375,586 @@ inline ray getRayWithPerspective(const int &i, const int &j, const vec3 &origin)
 /* Return a ray to fire off at the scene. Note that the origin of each ray changes here
 * as opposed to in getRayWithPerspective.
 */
-inline ray getRayOrthogonal(const int &i, const int &j, const vec3 &dir)
+inline ray getRayOrthogonal(const int &i, const int &j, const vec3 &dir, sampler &samp)
 {
-    vec2 p = sample(i, j);
+    vec2 p = sample(i, j, samp);
     return ray(vec3(p.x, p.y, 0), dir);
 }
 
+/*
+* Trace a shadow packet from the first hit of every step'th pixel towards every
+* light, and check each lane against a shadow ray of its own. Each packet is
+* traced twice: with no occluders cached, then with the ones it just found.
+* Returns the number of lanes that disagree.
+*/
+uint64_t checkShadowPackets(const scene &world, const lightList &lights, const vec3 &eye, int step, uint64_t &checked)
+{
+    uint64_t mismatches = 0;
+    sampler* samp = createSampler("random", 1, 0);
+    checked = 0;
+
+    for (int j = 0; j < HEIGHT; j += step) {
+        for (int x = 0; x < WIDTH; x += step) {
+            hitRecord rec;
+            samp->startPixelSample(j * WIDTH + x, 0);
+            ray r = getRayWithPerspective(x, j, eye, *samp);
+
+            if (!world.hit(r, SMALL_VAL, FAR, rec)) {
+                continue;
+            }
+
+            vec3 p = rec.pointOnSurface;
+
+            for (int base = 0; base < lights.size(); base += PACKET_SIZE) {
+                rayPacket shadowRays;
+                shadowRays.active = 0;
+
+                for (int l = 0; l < PACKET_SIZE && base + l < lights.size(); l++) {
+                    vec3 q = lights.position(base + l);
+                    shadowRays.set(l, ray(p, makeUnitVector(q - p)), length(p - q));
+                    shadowRays.active |= 1u << l;
+                }
+
+                shadowRays.padInactive();
+                uint32_t occluders[PACKET_SIZE];
+                std::fill(occluders, occluders + PACKET_SIZE, NO_PRIM);
+
+                for (int pass = 0; pass < 2; pass++) {
+                    laneMask blocked = world.shadowPacket(shadowRays, SMALL_VAL + 0.01, occluders);
+
+                    for (int l = 0; l < PACKET_SIZE; l++) {
+                        if (shadowRays.active & (1u << l)) {
+                            bool single = world.shadowHit(shadowRays.get(l), SMALL_VAL + 0.01, shadowRays.tmax[l]);
+                            mismatches += single != (bool) ((blocked >> l) & 1);
+                            checked++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    delete samp;
+    return mismatches;
+}
+
+
+/*
+* Settings for adaptive sampling. Each pixel takes minSpp samples, then another
+* minSpp at a time until the standard error of its mean luminance is at most
+* maxError, or it reaches the sampler's spp.
+*/
+struct adaptiveSettings
+{
+    bool enabled = false;
+    int minSpp = ADAPTIVE_MIN_SAMPLES;
+    float maxError = ADAPTIVE_MAX_ERROR;
+};
+
+/*
+* Trace sample k of the PACKET_COLS x PACKET_ROWS block of pixels with its top
+* left corner at (x0, y0) in the image as one packet, and add each lane's colour
+* to its pixel. Pixels past (x1, y1), and pixels that aren't up to sample k,
+* are left out. tile holds the pixels of the tile whose corner is (tx0, ty0).
+* Only the first hit is found as a packet: lanes that hit mirrors, and all the
+* shadow rays, carry on one ray at a time.
+*/
+void tracePacketSample(int x0, int y0, int x1, int y1, int k, sampler &samp, const vec3 &eye,
+                       const scene &world, const lightList &lights, const lightSampling &lightSamp,
+                       occluderCache &occluders, pixelStats* tile, int tx0, int ty0)
+{
+    rayPacket p;
+    hitRecord records[PACKET_SIZE];
+    p.active = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        int x = x0 + l % PACKET_COLS;
+        int y = y0 + l / PACKET_COLS;
+        int j = HEIGHT - y - 1;
+
+        if (x < x1 && y < y1 && tile[(y - ty0) * IMG_TILE_SIZE + (x - tx0)].n == (uint32_t) k) {
+            samp.startPixelSample(j * WIDTH + x, k);
+            p.set(l, getRayWithPerspective(x, j, eye, samp), FAR);
+            p.active |= 1u << l;
+        }
+    }
+
+    p.padInactive();
+    laneMask hitLanes = world.hitPacket(p, SMALL_VAL, records);
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (p.active & (1u << l)) {
+            int x = x0 + l % PACKET_COLS;
+            int y = y0 + l / PACKET_COLS;
+            int j = HEIGHT - y - 1;
+
+            samp.startPixelSample(j * WIDTH + x, k);
+            tile[(y - ty0) * IMG_TILE_SIZE + (x - tx0)].add(trace(p.get(l), world, lights, lightSamp, occluders, samp, &records[l], (hitLanes >> l) & 1));
+        }
+    }
+}
+
+/*
+* Render the pixels in tile number t of image up to limit samples each, adding
+* the samples straight into them. A tile is only ever rendered by one thread, and
+* everything else it touches is read only, so tiles can run on any thread without locks.
+* Every pixel first takes its first samples (as packets if usePackets is set),
+* then with adaptive sampling the pixels that haven't converged take more.
+* A pixel's next sample is always the one numbered by how many it has, so pixels
+* that already have some (from an earlier pass, or a checkpoint) carry on with
+* the samples they'd have taken in one go.
+* Image rows go down and ray rows (j) go up, so pixel (x, y) is traced as (x, HEIGHT - y - 1).
+* Returns the number of samples taken.
+*/
+uint64_t renderTile(int t, int limit, sampler &samp, occluderCache &occluders, const adaptiveSettings &adaptive, bool usePackets,
+                    const vec3 &eye, const scene &world, const lightList &lights, const lightSampling &lightSamp)
+{
+    int x0, y0, x1, y1;
+    image.tileBounds(t, x0, y0, x1, y1);
+    pixelStats* tile = image.tile(t);
+    uint64_t samplesBefore = 0, samplesAfter = 0;
+    int initial = adaptive.enabled ? std::min(adaptive.minSpp, limit) : limit;
+    int first = initial;
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            const pixelStats &px = tile[(y - y0) * IMG_TILE_SIZE + (x - x0)];
+            samplesBefore += px.n;
+            first = std::min(first, (int) px.n);
+        }
+    }
+
+    // Generate sampled rays
+    for (int k = first; k < initial; k++) {
+        if (usePackets) {
+            for (int y = y0; y < y1; y += PACKET_ROWS) {
+                for (int x = x0; x < x1; x += PACKET_COLS) {
+                    tracePacketSample(x, y, x1, y1, k, samp, eye, world, lights, lightSamp, occluders, tile, x0, y0);
+                }
+            }
+
+            continue;
+        }
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int j = HEIGHT - y - 1;
+                pixelStats &px = tile[(y - y0) * IMG_TILE_SIZE + (x - x0)];
+                if (px.n != (uint32_t) k) {
+                    continue;
+                }
+
+                samp.startPixelSample(j * WIDTH + x, k);
+                //ray r = getRayOrthogonal(x, j, eye, samp);
+                ray r = getRayWithPerspective(x, j, eye, samp);
+                px.add(trace(r, world, lights, lightSamp, occluders, samp));
+            }
+        }
+    }
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int j = HEIGHT - y - 1;
+            pixelStats &px = tile[(y - y0) * IMG_TILE_SIZE + (x - x0)];
+
+            // take more samples while the pixel hasn't converged yet
+            while (adaptive.enabled && (int) px.n < limit && px.stdError() > adaptive.maxError) {
+                int target = std::min((int) px.n + adaptive.minSpp, limit);
+
+                while ((int) px.n < target) {
+                    samp.startPixelSample(j * WIDTH + x, px.n);
+                    ray r = getRayWithPerspective(x, j, eye, samp);
+                    px.add(trace(r, world, lights, lightSamp, occluders, samp));
+                }
+            }
+
+            samplesAfter += px.n;
+        }
+    }
+
+    return samplesAfter - samplesBefore;
+}
 
-int main(void)
+/*
+* Command line options:
+*   --threads n      number of render threads (default: one per hardware thread)
+*   --seed n         random seed; the same seed gives the same image at any thread count
+*   --spp n          samples per pixel (the most any pixel takes with --adaptive)
+*   --sampler s      random, stratified, halton or sobol (default)
+*   --adaptive       take more samples only in pixels that haven't converged
+*   --min-spp n      samples every pixel takes with --adaptive
+*   --max-error e    standard error of a pixel's luminance it can stop at with --adaptive
+*   --no-packets     trace primary rays one at a time instead of in packets
+*   --compress-meshes  keep mesh vertices and triangle blocks quantized to save memory
+*   --stream-meshes mb   page meshes in from .mesh.chunks files, keeping at most mb megabytes of them in memory
+*   --verify-mesh-cache  only use a .mesh.accel built from a mesh with the same contents, not just the same stamp
+*   --light-samples n  shade each hit with n lights picked from a light tree instead of every light
+*   --extra-lights n add n dim lights around the scene, for trying out many lights
+*   --shadow-packets trace the shadow rays towards PACKET_SIZE lights through the scene together
+*   --check-shadows  check that shadow packets agree with single shadow rays, then exit
+*   --fractal-depth n  levels of recursion in the fractal scenes (6 and 7)
+*   --output file    image to write (default out.ppm): .ppm, .pfm for 32 bit float, or .qoi
+*   --exposure stops scale the image by 2^stops before writing it
+*   --tonemap op     none (default, clamps), reinhard or aces
+*   --gamma g        encode the output with gamma g, or srgb for the sRGB curve (default: linear)
+*   --dither         dither the output so smooth gradients don't band
+*   --bvh-builder b  sah (default) or lbvh, which builds the scene bvh faster but traces it slower
+*   --checkpoint file  save the render to file as it goes, and carry on from it if it's already there
+*   --checkpoint-every s  seconds between checkpoints (default 60). One is also saved at the end,
+*                    and on SIGTERM or SIGINT, which then stop the render after writing the image
+*   --time-budget s  take samples in passes over the whole image until s seconds after starting,
+*                    instead of a set number (--spp is then only a cap, 65536 if not given)
+*/
+int main(int argc, char** argv)
 {
+    auto startTime = std::chrono::steady_clock::now();
     vec3 eye(WIDTH/2, HEIGHT/2, 400);      // Where to shoot rays from
-    hitRecord rec;                         // Contains information concerning what we hit
-    std::vector<shape*> shapes;            // List of shapes in the scene 
+    scene world;                           // Shapes and instances in the scene, and the bvh over them
     std::vector<pointLight*> pointLights;  // List of pointLights in the scene
+    int numThreads = 0;
+    uint32_t seed = 0;
+    int spp = NUM_SAMPLES;
+    std::string samplerName = "sobol";
+    adaptiveSettings adaptive;
+    bool usePackets = true;
+    bool compressMeshes = false;
+    bool verifyMeshCache = false;
+    bool streamMeshes = false;
+    std::string outputName = "out.ppm";
+    postSettings post;
+    lightSampling lightSamp;
+    int fractalDepth = FRACTAL_DEPTH;
+    bvhBuildMethod bvhMethod = BVH_SAH;
+    int sceneId = 6;
+    std::string checkpointName;
+    double checkpointInterval = CHECKPOINT_INTERVAL;
+    int extraLights = 0;
+    bool checkShadows = false;
+    bool shadowPackets = false;
+    double timeBudget = 0.0;  // seconds, 0 for none
+    bool sppGiven = false;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) {
+            numThreads = atoi(argv[++a]);
+        }
+
+        else if (!strcmp(argv[a], "--seed") && a + 1 < argc) {
+            seed = strtoul(argv[++a], nullptr, 10);
+        }
+
+        else if (!strcmp(argv[a], "--spp") && a + 1 < argc) {
+            spp = std::max(1, atoi(argv[++a]));
+            sppGiven = true;
+        }
+
+        else if (!strcmp(argv[a], "--sampler") && a + 1 < argc) {
+            samplerName = argv[++a];
+        }
+
+        else if (!strcmp(argv[a], "--adaptive")) {
+            adaptive.enabled = true;
+        }
+
+        else if (!strcmp(argv[a], "--min-spp") && a + 1 < argc) {
+            adaptive.minSpp = std::max(1, atoi(argv[++a]));
+        }
+
+        else if (!strcmp(argv[a], "--max-error") && a + 1 < argc) {
+            adaptive.maxError = atof(argv[++a]);
+        }
+
+        else if (!strcmp(argv[a], "--no-packets")) {
+            usePackets = false;
+        }
+
+        else if (!strcmp(argv[a], "--compress-meshes")) {
+            compressMeshes = true;
+        }
+
+        else if (!strcmp(argv[a], "--verify-mesh-cache")) {
+            verifyMeshCache = true;
+        }
+
+        else if (!strcmp(argv[a], "--stream-meshes") && a + 1 < argc) {
+            streamMeshes = true;
+            geometryCache::shared().setBudget((size_t) std::max(1, atoi(argv[++a])) << 20);
+        }
+
+        else if (!strcmp(argv[a], "--output") && a + 1 < argc) {
+            outputName = argv[++a];
+        }
+
+        else if (!strcmp(argv[a], "--exposure") && a + 1 < argc) {
+            post.exposure = atof(argv[++a]);
+        }
+
+        else if (!strcmp(argv[a], "--tonemap") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "none")) {
+                post.toneMap = TONEMAP_NONE;
+            }
+
+            else if (!strcmp(argv[a], "reinhard")) {
+                post.toneMap = TONEMAP_REINHARD;
+            }
+
+            else if (!strcmp(argv[a], "aces")) {
+                post.toneMap = TONEMAP_ACES;
+            }
+
+            else {
+                std::cerr << "Unknown tonemap '" << argv[a] << "'.\n";
+                return -1;
+            }
+        }
+
+        else if (!strcmp(argv[a], "--gamma") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "srgb")) {
+                post.transfer = TRANSFER_SRGB;
+            }
+
+            else if (atof(argv[a]) > 0.0) {
+                post.transfer = TRANSFER_GAMMA;
+                post.gamma = atof(argv[a]);
+            }
+
+            else {
+                std::cerr << "Bad gamma '" << argv[a] << "'.\n";
+                return -1;
+            }
+        }
+
+        else if (!strcmp(argv[a], "--dither")) {
+            post.dither = true;
+        }
+
+        else if (!strcmp(argv[a], "--fractal-depth") && a + 1 < argc) {
+            fractalDepth = std::max(1, atoi(argv[++a]));
+        }
+
+        else if (!strcmp(argv[a], "--extra-lights") && a + 1 < argc) {
+            extraLights = std::max(0, atoi(argv[++a]));
+        }
+
+        else if (!strcmp(argv[a], "--shadow-packets")) {
+            shadowPackets = true;
+        }
+
+        else if (!strcmp(argv[a], "--check-shadows")) {
+            checkShadows = true;
+        }
+
+        else if (!strcmp(argv[a], "--light-samples") && a + 1 < argc) {
+            lightSamp.samples = std::max(0, atoi(argv[++a]));
+        }
+
+        else if (!strcmp(argv[a], "--bvh-builder") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "sah")) {
+                bvhMethod = BVH_SAH;
+            }
+
+            else if (!strcmp(argv[a], "lbvh")) {
+                bvhMethod = BVH_LBVH;
+            }
 
-    initLights(pointLights);
-    initShapes(shapes, 6);   // init shapes for the scene, number is id of scene
+            else {
+                std::cerr << "Unknown bvh builder '" << argv[a] << "'.\n";
+                return -1;
+            }
+        }
 
-    std::cout << "Ray tracing... (number of shapes = " << shapes.size() << ")\n";
+        else if (!strcmp(argv[a], "--checkpoint") && a + 1 < argc) {
+            checkpointName = argv[++a];
+        }
+
+        else if (!strcmp(argv[a], "--checkpoint-every") && a + 1 < argc) {
+            checkpointInterval = atof(argv[++a]);
+        }
+
+        else if (!strcmp(argv[a], "--time-budget") && a + 1 < argc) {
+            timeBudget = std::max(0.0, atof(argv[++a]));
+        }
+
+        else {
+            std::cerr << "Unknown option '" << argv[a] << "'.\n";
+            return -1;
+        }
+    }
+
+    if (timeBudget > 0.0 && !sppGiven) {
+        spp = TIME_BUDGET_MAX_SPP;
+    }
+
+    // what a checkpoint has to have been rendered with to carry on from it
+    renderState state;
+    state.samplerName = samplerName;
+    state.samplerSpp = spp;
+    state.seed = seed;
+    state.scene = "scene " + std::to_string(sceneId) + ", fractal depth " + std::to_string(fractalDepth) + ", " +
+                  std::to_string(extraLights) + " extra lights, " + std::to_string(lightSamp.samples) + " light samples" + (compressMeshes ? ", compressed meshes" : "");
+
+    if (!checkpointName.empty() && access(checkpointName.c_str(), F_OK) == 0) {
+        renderState saved;
+        std::string error;
+
+        if (!readCheckpoint(checkpointName, image, saved, error)) {
+            std::cerr << "Error: Could not resume from '" << checkpointName << "': " << error << "\n";
+            return -1;
+        }
+
+        if (saved.scene != state.scene) {
+            std::cerr << "Error: '" << checkpointName << "' is a render of a different scene (" << saved.scene << ").\n";
+            return -1;
+        }
+
+        // carry on with the same samples, whatever the command line says
+        state = saved;
+        samplerName = saved.samplerName;
+        seed = saved.seed;
+
+        std::cout << "Resuming from " << checkpointName << ": " << image.sampleCount() << " samples, at least "
+                  << image.minSamples() << " in every pixel (" << samplerName << ", seed " << seed << ").\n";
+    }
+
+    if (!checkpointName.empty()) {
+        signal(SIGTERM, requestStop);
+        signal(SIGINT, requestStop);
+    }
+
+    initLights(pointLights, extraLights);
+    lightList lights(pointLights);
+    if (lightSamp.samples > 0) {
+        lightSamp.tree.build(lights);
+        std::cout << "Built light tree: " << lights.size() << " lights, " << lightSamp.tree.tree.nodes.size()
+                  << " nodes, " << lightSamp.samples << " sampled per hit.\n";
+    }
 
-    // Iterate over every pixel, firing off rays at objects
-    for (int j = 0; j < HEIGHT; j++) {
-        for (int i = 0; i < WIDTH; i++) {
-            rgb avgColour = background;
+    // the pool also builds the acceleration structures
+    threadPool pool(numThreads);
 
-            // Generate randomly sampled rays
-            for (int k = 0; k < NUM_SAMPLES; k++) {
-                //ray r = getRayOrthogonal(i, j, eye);
-                ray r = getRayWithPerspective(i, j, eye);
-                avgColour += trace(r, shapes, pointLights);
+    initShapes(world, sceneId, compressMeshes, streamMeshes, verifyMeshCache, fractalDepth, &pool);   // init shapes for the scene, number is id of scene
+    world.build(bvhMethod, &pool);
+
+    // the check is of the packet path, so it's always on for that
+    world.packetShadows = shadowPackets || checkShadows;
+
+    if (checkShadows) {
+        uint64_t checked;
+        uint64_t mismatches = checkShadowPackets(world, lights, eye, 4, checked);
+        std::cout << "Shadow packet check: " << checked << " shadow rays, " << mismatches << " mismatches.\n";
+        return mismatches ? 1 : 0;
+    }
+
+    // every thread gets its own sampler, since they keep track of the current pixel
+    std::vector<sampler*> samplers;
+    for (int t = 0; t < pool.size(); t++) {
+        samplers.push_back(createSampler(samplerName, state.samplerSpp, seed));
+        if (!samplers.back()) {
+            std::cerr << "Unknown sampler '" << samplerName << "'.\n";
+            return -1;
+        }
+    }
+
+    // and its own cache of the last shape to block each light
+    std::vector<occluderCache> occluders(pool.size(), occluderCache(pointLights.size()));
+
+    int numTiles = image.numTiles();
+
+    std::cout << "Ray tracing... (number of shapes = " << world.size() << ", threads = " << pool.size()
+              << ", " << (adaptive.enabled || timeBudget > 0.0 ? "up to " : "") << spp << " spp " << samplerName;
+    if (timeBudget > 0.0) {
+        std::cout << ", for " << timeBudget << " s";
+    }
+    std::cout << ")\n";
+
+    /*
+    * Render every tile, firing off rays at objects. When checkpointing or on a
+    * time budget, that's done in passes that each take a sample (or with
+    * adaptive sampling, a round of minSpp samples) in every pixel. There's a
+    * checkpoint after any pass that ends checkpointInterval after the last one.
+    * On a time budget, a pass is only started if the last one would still fit
+    * before the deadline, and one that runs over anyway skips the tiles it
+    * hasn't started. Every pixel is still the mean of its own samples then,
+    * some of them having one fewer. Renders come out the same whether they're
+    * done in passes or not.
+    */
+    std::atomic<uint64_t> totalSamples(0);
+    bool inPasses = !checkpointName.empty() || timeBudget > 0.0;
+    int passSpp = inPasses ? (adaptive.enabled ? adaptive.minSpp : 1) : spp;
+    int limit = std::min((int) image.minSamples(), spp);
+    auto deadline = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeBudget));
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+    bool outOfTime = false;
+    int passes = 0;
+
+    while (limit < spp && !stopRequested && !outOfTime) {
+        auto passStart = std::chrono::steady_clock::now();
+
+        // the pass that gives pixels their first sample always finishes, so none are left black
+        bool mayCutShort = timeBudget > 0.0 && limit > 0;
+        limit = std::min(limit + passSpp, spp);
+
+        pool.parallelFor(numTiles, [&](int t, int thread) {
+            // tiles that are skipped keep their counts, so the checkpoint knows where they got to
+            if (stopRequested || (mayCutShort && std::chrono::steady_clock::now() >= deadline)) {
+                return;
             }
 
-            image.set(i, HEIGHT - j - 1, avgColour/NUM_SAMPLES);
-        }        
+            totalSamples += renderTile(t, limit, *samplers[thread], occluders[thread], adaptive, usePackets, eye, world, lights, lightSamp);
+        });
+
+        auto now = std::chrono::steady_clock::now();
+        passes++;
+        outOfTime = timeBudget > 0.0 && now + (now - passStart) > deadline;
+
+        double sinceCheckpoint = std::chrono::duration<double>(now - lastCheckpoint).count();
+        if (checkpointName.empty() || (limit < spp && !stopRequested && !outOfTime && sinceCheckpoint < checkpointInterval)) {
+            continue;
+        }
+
+        std::string error;
+        if (!writeCheckpoint(checkpointName, image, state, error)) {
+            std::cerr << "Error: Could not write checkpoint '" << checkpointName << "': " << error << "\n";
+        }
+
+        else {
+            std::cout << "Saved checkpoint " << checkpointName << " (" << image.sampleCount() << " samples).\n";
+        }
+
+        lastCheckpoint = std::chrono::steady_clock::now();
+    }
+
+    if (timeBudget > 0.0) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "Time budget: " << passes << (passes == 1 ? " pass, " : " passes, ") << elapsed << " of " << timeBudget << " s used, "
+                  << image.minSamples() << " spp reached in every pixel" << (limit < spp ? "" : " (the most --spp allows)") << ".\n";
+    }
+
+    std::cout << (stopRequested ? "Stopped" : "Done") << " ray tracing. (" << totalSamples << " samples, average spp = "
+              << (double) image.sampleCount() / (WIDTH * HEIGHT) << ")\n";
+
+    if (!geometryCache::shared().empty()) {
+        geometryCacheStats cs = geometryCache::shared().stats();
+        std::cout << "Geometry cache: " << cs.lookups << " lookups, " << (cs.lookups ? 100.0 * cs.hits / cs.lookups : 0.0)
+                  << "% hits, " << cs.loads << " clusters read (" << cs.bytesLoaded / 1048576.0 << " MB), " << cs.evictions
+                  << " evicted, peak " << cs.peakBytes / 1048576.0 << " MB of " << (geometryCache::shared().budget() >> 20) << " MB.\n";
     }
 
-    std::cout << "Done ray tracing.\nWriting out.ppm.\n";
+    std::cout << "Writing " << outputName << ".\n";
 
-    // Output the image to a ppm file
-    image.writePPM("out.ppm");
-    std::cout << "Done writing out.ppm.\n";
+    // Output the image, in the format its name asks for
+    post.seed = seed;
+    if (!image.write(outputName, post, &pool)) {
+        return -1;
+    }
+    std::cout << "Done writing " << outputName << ".\n";
+
+    if (stopRequested) {
+        std::cout << "The render was stopped early; run again with --checkpoint " << checkpointName << " to finish it.\n";
+        return 1;
+    }
     
 }
\ No newline at end of file
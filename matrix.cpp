@@ -218,8 +218,8 @@ tmat inverse(const tmat &mat)
 void tmat::setToTranspose()
 {
     float tmp;
-    for (int i = 0; i < 2; i++) {
-        for (int j = 0; j < 2; j++) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = i + 1; j < 4; j++) {
             tmp = m[i][j];
             m[i][j] = m[j][i];
             m[j][i] = tmp;
@@ -0,0 +1,298 @@
+/*
+* meshaccel.cpp
+* Implements reading and writing the .mesh.accel cache from meshaccel.hpp.
+*/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include "meshaccel.hpp"
+
+static const char MESH_ACCEL_MAGIC[8] = { 'R', 'A', 'E', 'A', 'C', 'C', 'E', 'L' };
+
+/* ----- hashing ----- */
+
+template <typename T>
+static uint64_t hashValue(const T &v, uint64_t h)
+{
+    return hashBytes((const uint8_t*) &v, sizeof(T), h);
+}
+
+uint64_t meshAccelKey(const meshFile &file, const kdBuildOptions &options, bool compressed)
+{
+    uint64_t h = hashValue(file.stamp.size, MESH_ACCEL_VERSION);
+    h = hashValue(file.stamp.time, h);
+    h = hashValue(file.stamp.inode, h);
+
+    h = hashValue(options.isectCost, h);
+    h = hashValue(options.travCost, h);
+    h = hashValue(options.emptyBonus, h);
+    h = hashValue(options.maxPrims, h);
+    h = hashValue(compressed, h);  // blocks hold grid coordinates when compressed
+
+    uint32_t layout[5] = { (uint32_t) sizeof(kdNode), (uint32_t) sizeof(triBlock), (uint32_t) sizeof(qTriBlock),
+                           (uint32_t) TRI_BLOCK_SIZE, (uint32_t) sizeof(meshAccelHeader) };
+    return hashValue(layout, h);
+}
+
+uint64_t meshContentHash(const meshFile &file)
+{
+    return hashBytes(file.data, file.size, MESH_ACCEL_VERSION);
+}
+
+/* ----- reading ----- */
+
+meshAccel::~meshAccel()
+{
+    unmapFile(data, size);
+}
+
+aabb meshAccel::box() const
+{
+    const meshAccelHeader &h = header();
+    return aabb(vec3(h.boxMin[0], h.boxMin[1], h.boxMin[2]), vec3(h.boxMax[0], h.boxMax[1], h.boxMax[2]));
+}
+
+arrayView<kdNode> meshAccel::nodes() const
+{
+    return arrayView<kdNode>((const kdNode*) (data + header().nodesOffset), header().numNodes);
+}
+
+arrayView<uint32_t> meshAccel::primIndices() const
+{
+    return arrayView<uint32_t>((const uint32_t*) (data + header().primIndicesOffset), header().numPrimIndices);
+}
+
+arrayView<triBlock> meshAccel::blocks() const
+{
+    uint32_t n = header().blockBytes == sizeof(triBlock) ? header().numBlocks : 0;
+    return arrayView<triBlock>((const triBlock*) (data + header().blocksOffset), n);
+}
+
+arrayView<qTriBlock> meshAccel::qBlocks() const
+{
+    uint32_t n = header().blockBytes == sizeof(qTriBlock) ? header().numBlocks : 0;
+    return arrayView<qTriBlock>((const qTriBlock*) (data + header().blocksOffset), n);
+}
+
+arrayView<uint32_t> meshAccel::leafBlocks() const
+{
+    return arrayView<uint32_t>((const uint32_t*) (data + header().leafBlocksOffset), header().numPrimIndices);
+}
+
+/* True if an array of count elements of elemSize bytes at offset fits in size bytes and is aligned */
+static bool arrayFits(uint64_t offset, uint64_t count, uint64_t elemSize, uint64_t size)
+{
+    return offset % MESH_ACCEL_ALIGN == 0 && offset <= size && count <= (size - offset) / elemSize;
+}
+
+/*
+* Walk the arrays the way the kd-tree and triangleMesh do. Nodes are stored
+* depth first, so both children of a node have to come after it, which rules
+* out loops, and the tree has to be shallow enough for the traversal stack.
+* Leaves have to stay inside primIndices and their blocks inside blocks, and
+* every triangle index has to be one of the mesh's.
+*/
+bool meshAccel::indicesValid(uint32_t numTriangles, std::string &reason) const
+{
+    arrayView<kdNode> nodes = this->nodes();
+    arrayView<uint32_t> prims = primIndices();
+    arrayView<triBlock> blocks = this->blocks();
+    arrayView<qTriBlock> qBlocks = this->qBlocks();
+    arrayView<uint32_t> leafBlocks = this->leafBlocks();
+    uint32_t numBlocks = header().numBlocks;
+
+    if (nodes.size() == 0) {
+        reason = "broken: no kd-tree nodes";
+        return false;
+    }
+
+    // depth of each node, -1 if nothing points at it
+    std::vector<int8_t> depth(nodes.size(), -1);
+    depth[0] = 0;
+
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        const kdNode &node = nodes[i];
+
+        if (depth[i] < 0) {
+            continue;
+        }
+
+        if (!node.isLeaf()) {
+            uint32_t above = node.aboveChild();
+            if (above <= i + 1 || above >= nodes.size()) {
+                reason = "broken: node " + std::to_string(i) + "'s child is out of range";
+                return false;
+            }
+
+            if (depth[i] + 1 >= KD_STACK_SIZE) {
+                reason = "broken: the kd-tree is deeper than traversal can go";
+                return false;
+            }
+
+            depth[i + 1] = std::max(depth[i + 1], (int8_t) (depth[i] + 1));
+            depth[above] = std::max(depth[above], (int8_t) (depth[i] + 1));
+            continue;
+        }
+
+        uint64_t count = node.numPrims();
+        if (count == 0) {
+            continue;
+        }
+
+        if ((uint64_t) node.primOffset + count > prims.size()) {
+            reason = "broken: leaf " + std::to_string(i) + " is past the end of the triangle ids";
+            return false;
+        }
+
+        uint64_t leafBlockCount = (count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+        if ((uint64_t) leafBlocks[node.primOffset] + leafBlockCount > numBlocks) {
+            reason = "broken: leaf " + std::to_string(i) + "'s blocks are past the last block";
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < prims.size(); i++) {
+        if (prims[i] >= numTriangles) {
+            reason = "broken: triangle id " + std::to_string(i) + " is past the last triangle";
+            return false;
+        }
+    }
+
+    for (uint32_t b = 0; b < numBlocks; b++) {
+        const uint32_t* tri = blocks.size() ? blocks[b].tri : qBlocks[b].tri;
+
+        for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+            if (tri[k] >= numTriangles) {
+                reason = "broken: block " + std::to_string(b) + " has a triangle past the last one";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+std::shared_ptr<const meshAccel> meshAccel::open(const std::string &path, uint64_t key, uint32_t numTriangles,
+                                                 bool compressed, std::string &reason)
+{
+    std::shared_ptr<meshAccel> accel(new meshAccel());
+    accel->data = mapFile(path, accel->size, reason);
+
+    if (!accel->data) {
+        return nullptr;
+    }
+
+    if (accel->size < sizeof(meshAccelHeader) || memcmp(accel->header().magic, MESH_ACCEL_MAGIC, 8) != 0) {
+        reason = "not a mesh cache";
+        return nullptr;
+    }
+
+    const meshAccelHeader &h = accel->header();
+
+    uint32_t blockBytes = compressed ? sizeof(qTriBlock) : sizeof(triBlock);
+    if (h.version != MESH_ACCEL_VERSION || h.headerBytes != sizeof(meshAccelHeader) || h.key != key ||
+        h.blockBytes != blockBytes) {
+        reason = "stale";
+        return nullptr;
+    }
+
+    bool fits = arrayFits(h.nodesOffset, h.numNodes, sizeof(kdNode), accel->size) &&
+                arrayFits(h.primIndicesOffset, h.numPrimIndices, sizeof(uint32_t), accel->size) &&
+                arrayFits(h.blocksOffset, h.numBlocks, blockBytes, accel->size) &&
+                arrayFits(h.leafBlocksOffset, h.numPrimIndices, sizeof(uint32_t), accel->size);
+
+    if (!fits) {
+        reason = "truncated";
+        return nullptr;
+    }
+
+    if (!accel->indicesValid(numTriangles, reason)) {
+        return nullptr;
+    }
+
+    return accel;
+}
+
+/* ----- writing ----- */
+
+/* Write count elements of elemSize bytes at the next aligned offset, and return that offset */
+static uint64_t writeArray(FILE* f, uint64_t &offset, const void* data, size_t count, size_t elemSize)
+{
+    static const uint8_t zeros[MESH_ACCEL_ALIGN] = {};
+    uint64_t padding = (MESH_ACCEL_ALIGN - offset % MESH_ACCEL_ALIGN) % MESH_ACCEL_ALIGN;
+
+    fwrite(zeros, 1, padding, f);
+    uint64_t start = offset + padding;
+
+    fwrite(data, elemSize, count, f);
+    offset = start + (uint64_t) count * elemSize;
+    return start;
+}
+
+/* Write a cache whose blocks are numBlocks of blockBytes each, which saveMeshAccel has checked are one kind */
+static bool saveAccel(const std::string &path, uint64_t key, uint64_t contentHash, const kdTree &tree,
+                      const void* blocks, uint32_t numBlocks, uint32_t blockBytes, arrayView<uint32_t> leafBlocks,
+                      std::string &error)
+{
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        error = strerror(errno);
+        return false;
+    }
+
+    meshAccelHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MESH_ACCEL_MAGIC, 8);
+    h.version = MESH_ACCEL_VERSION;
+    h.headerBytes = sizeof(meshAccelHeader);
+    h.key = key;
+    h.contentHash = contentHash;
+
+    for (int a = 0; a < 3; a++) {
+        h.boxMin[a] = tree.box.pmin.e[a];
+        h.boxMax[a] = tree.box.pmax.e[a];
+    }
+
+    h.numNodes = tree.nodes.size();
+    h.numPrimIndices = tree.primIndices.size();
+    h.numBlocks = numBlocks;
+    h.blockBytes = blockBytes;
+
+    // the header goes in last, once the offsets are known
+    fwrite(&h, sizeof(h), 1, f);
+    uint64_t offset = sizeof(h);
+
+    h.nodesOffset = writeArray(f, offset, tree.nodes.data(), tree.nodes.size(), sizeof(kdNode));
+    h.primIndicesOffset = writeArray(f, offset, tree.primIndices.data(), tree.primIndices.size(), sizeof(uint32_t));
+    h.blocksOffset = writeArray(f, offset, blocks, numBlocks, blockBytes);
+    h.leafBlocksOffset = writeArray(f, offset, leafBlocks.data(), leafBlocks.size(), sizeof(uint32_t));
+
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        error = strerror(errno);
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool saveMeshAccel(const std::string &path, uint64_t key, uint64_t contentHash, const kdTree &tree,
+                   arrayView<triBlock> blocks, arrayView<uint32_t> leafBlocks, std::string &error)
+{
+    return saveAccel(path, key, contentHash, tree, blocks.data(), blocks.size(), sizeof(triBlock), leafBlocks, error);
+}
+
+bool saveMeshAccel(const std::string &path, uint64_t key, uint64_t contentHash, const kdTree &tree,
+                   arrayView<qTriBlock> blocks, arrayView<uint32_t> leafBlocks, std::string &error)
+{
+    return saveAccel(path, key, contentHash, tree, blocks.data(), blocks.size(), sizeof(qTriBlock), leafBlocks, error);
+}
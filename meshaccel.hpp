@@ -0,0 +1,100 @@
+/*
+* meshaccel.hpp
+* Contains the .mesh.accel cache: a file next to a .mesh file holding the
+* kd-tree and triangle blocks built for it, laid out exactly as they are in
+* memory. Loading a mesh maps its cache and points the tree straight at it, so
+* nothing gets built or even copied. The cache is keyed on the mesh file's
+* size, modification time and inode, the build options and the layout of the
+* structures, and is rebuilt whenever the key doesn't match. It also holds a
+* hash of the mesh's contents, which is only compared when asked for, since
+* computing it reads the whole mesh. A cache whose key matches is still checked
+* through before it's used, since the file could have been damaged or written
+* by something else: every index in it has to be in range. A compressed mesh's
+* cache holds qTriBlocks where an uncompressed one holds triBlocks.
+*/
+
+#ifndef MESHACCEL_H
+#define MESHACCEL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "kdtree.hpp"
+#include "triblock.hpp"
+#include "meshfile.hpp"
+
+const uint32_t MESH_ACCEL_VERSION = 3;  // bump when the format or the builders change
+const size_t MESH_ACCEL_ALIGN = 64;     // every array starts on a cache line
+
+/*
+* Start of a .mesh.accel file. The arrays follow at the given byte offsets: the
+* kd-tree's nodes and primitive ids, then the triangle blocks and the first
+* block of each leaf (one entry per primitive id, as in triangleMesh).
+*/
+struct meshAccelHeader
+{
+    char magic[8];            // "RAEACCEL"
+    uint32_t version;         // MESH_ACCEL_VERSION
+    uint32_t headerBytes;     // sizeof(meshAccelHeader)
+    uint64_t key;             // meshAccelKey() of what it was built from
+    uint64_t contentHash;     // meshContentHash() of the mesh it was built from
+    float boxMin[3];          // bounds of the kd-tree
+    float boxMax[3];
+    uint32_t numNodes;
+    uint32_t numPrimIndices;  // also the number of leafBlocks entries
+    uint32_t numBlocks;
+    uint32_t blockBytes;      // size of each block: sizeof(qTriBlock) for a compressed mesh, else sizeof(triBlock)
+    uint64_t nodesOffset;
+    uint64_t primIndicesOffset;
+    uint64_t blocksOffset;
+    uint64_t leafBlocksOffset;
+};
+
+/* A mapped .mesh.accel file */
+struct meshAccel
+{
+    const uint8_t* data;
+    size_t size;
+
+    meshAccel() : data(nullptr), size(0) {}
+    ~meshAccel();
+    meshAccel(const meshAccel&) = delete;
+    meshAccel &operator=(const meshAccel&) = delete;
+
+    const meshAccelHeader &header() const { return *(const meshAccelHeader*) data; }
+    aabb box() const;
+    arrayView<kdNode> nodes() const;
+    arrayView<uint32_t> primIndices() const;
+    arrayView<triBlock> blocks() const;    // empty unless the blocks are triBlocks
+    arrayView<qTriBlock> qBlocks() const;  // empty unless they're qTriBlocks
+    arrayView<uint32_t> leafBlocks() const;
+
+    /*
+    * Map the cache at path if it was built with the given key for a mesh of
+    * numTriangles triangles, compressed or not. Otherwise returns nullptr, with
+    * why it couldn't be used (missing, stale, broken) in reason.
+    */
+    static std::shared_ptr<const meshAccel> open(const std::string &path, uint64_t key, uint32_t numTriangles,
+                                                 bool compressed, std::string &reason);
+
+    /* Check every index in the arrays is in range. Returns false with the first that isn't in reason. */
+    bool indicesValid(uint32_t numTriangles, std::string &reason) const;
+};
+
+/* Hash what the kd-tree and blocks of a mesh depend on, with the mesh's stamp standing in for its contents */
+uint64_t meshAccelKey(const meshFile &file, const kdBuildOptions &options, bool compressed);
+
+/* Hash every byte of a mesh file */
+uint64_t meshContentHash(const meshFile &file);
+
+/*
+* Write a cache to path. It goes to a temporary file first and is renamed into
+* place, so other processes never map a half written one.
+*/
+bool saveMeshAccel(const std::string &path, uint64_t key, uint64_t contentHash, const kdTree &tree,
+                   arrayView<triBlock> blocks, arrayView<uint32_t> leafBlocks, std::string &error);
+bool saveMeshAccel(const std::string &path, uint64_t key, uint64_t contentHash, const kdTree &tree,
+                   arrayView<qTriBlock> blocks, arrayView<uint32_t> leafBlocks, std::string &error);
+
+#endif
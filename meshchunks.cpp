@@ -0,0 +1,255 @@
+/*
+* meshchunks.cpp
+* Implements writing and reading the .mesh.chunks format from meshchunks.hpp.
+*/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "meshchunks.hpp"
+
+static const char MESH_CHUNKS_MAGIC[8] = { 'R', 'A', 'E', 'C', 'H', 'U', 'N', 'K' };
+
+/* ----- writing ----- */
+
+bool writeMeshChunks(const std::string &sourcePath, const std::string &path, std::string &error)
+{
+    meshChunksHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MESH_CHUNKS_MAGIC, 8);
+    h.version = MESH_CHUNKS_VERSION;
+    h.headerBytes = sizeof(meshChunksHeader);
+
+    fileStamp stamp;
+    if (!statFile(sourcePath, stamp, error)) {
+        return false;
+    }
+
+    h.sourceSize = stamp.size;
+    h.sourceTime = stamp.time;
+
+    std::shared_ptr<const meshFile> source = meshLibrary::shared().open(sourcePath, error);
+    if (!source) {
+        return false;
+    }
+
+    const meshVertex* vertices = source->vertices();
+    const meshTriangle* tris = source->triangles();
+    uint32_t nt = source->nt;
+
+    aabb box;
+    for (uint32_t i = 0; i < source->nv; i++) {
+        box.extend(vertices[i].coords);
+    }
+
+    // sort the triangles along a Morton curve through their centroids, so each run of them is a compact cluster
+    std::vector<uint64_t> order(nt);
+
+    for (uint32_t i = 0; i < nt; i++) {
+        if (tris[i].i0 >= source->nv || tris[i].i1 >= source->nv || tris[i].i2 >= source->nv) {
+            error = "triangle " + std::to_string(i) + " uses a vertex past the last one";
+            return false;
+        }
+
+        vec3 c = (vertices[tris[i].i0].coords + vertices[tris[i].i1].coords + vertices[tris[i].i2].coords) / 3.0f;
+        order[i] = ((uint64_t) mortonCode(c, box) << 32) | i;
+    }
+
+    std::sort(order.begin(), order.end());
+
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        error = strerror(errno);
+        return false;
+    }
+
+    // the header goes in last, once the directory's been written
+    fwrite(&h, sizeof(h), 1, f);
+    uint64_t offset = sizeof(h);
+
+    std::vector<meshClusterEntry> directory;
+    std::vector<meshVertex> clusterVertices;
+    std::vector<meshTriangle> clusterTris;
+    std::unordered_map<uint32_t, uint32_t> local;  // source vertex -> index in the cluster
+
+    for (uint32_t first = 0; first < nt; first += MESH_CLUSTER_TRIS) {
+        uint32_t last = std::min(nt, first + MESH_CLUSTER_TRIS);
+        clusterVertices.clear();
+        clusterTris.clear();
+        local.clear();
+
+        auto localVertex = [&](uint32_t v) {
+            auto it = local.find(v);
+            if (it != local.end()) {
+                return it->second;
+            }
+
+            uint32_t idx = clusterVertices.size();
+            local[v] = idx;
+            clusterVertices.push_back(vertices[v]);
+            return idx;
+        };
+
+        aabb clusterBox;
+        for (uint32_t i = first; i < last; i++) {
+            const meshTriangle &tri = tris[(uint32_t) order[i]];
+            clusterTris.push_back({ localVertex(tri.i0), localVertex(tri.i1), localVertex(tri.i2) });
+        }
+
+        for (const meshVertex &v : clusterVertices) {
+            clusterBox.extend(v.coords);
+        }
+
+        meshClusterEntry e;
+        for (int a = 0; a < 3; a++) {
+            e.boxMin[a] = clusterBox.pmin.e[a];
+            e.boxMax[a] = clusterBox.pmax.e[a];
+        }
+        e.nv = clusterVertices.size();
+        e.nt = clusterTris.size();
+        e.offset = offset;
+        directory.push_back(e);
+
+        fwrite(clusterVertices.data(), sizeof(meshVertex), clusterVertices.size(), f);
+        fwrite(clusterTris.data(), sizeof(meshTriangle), clusterTris.size(), f);
+        offset += clusterVertices.size() * sizeof(meshVertex) + clusterTris.size() * sizeof(meshTriangle);
+    }
+
+    h.numTriangles = nt;
+    h.numClusters = directory.size();
+    h.directoryOffset = offset;
+    fwrite(directory.data(), sizeof(meshClusterEntry), directory.size(), f);
+
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        error = strerror(errno);
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/* ----- reading ----- */
+
+/* Read exactly size bytes at offset */
+static bool readAt(int fd, void* data, size_t size, uint64_t offset)
+{
+    uint8_t* out = (uint8_t*) data;
+
+    while (size > 0) {
+        ssize_t n = pread(fd, out, size, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        out += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+meshChunksFile::~meshChunksFile()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+aabb meshChunksFile::clusterBounds(uint32_t c) const
+{
+    const meshClusterEntry &e = directory[c];
+    return aabb(vec3(e.boxMin[0], e.boxMin[1], e.boxMin[2]), vec3(e.boxMax[0], e.boxMax[1], e.boxMax[2]));
+}
+
+bool meshChunksFile::readCluster(uint32_t c, std::vector<meshVertex> &vertices, std::vector<meshTriangle> &triangles,
+                                 std::string &error) const
+{
+    const meshClusterEntry &e = directory[c];
+    vertices.resize(e.nv);
+    triangles.resize(e.nt);
+
+    if (!readAt(fd, vertices.data(), e.nv * sizeof(meshVertex), e.offset) ||
+        !readAt(fd, triangles.data(), e.nt * sizeof(meshTriangle), e.offset + e.nv * sizeof(meshVertex))) {
+        error = "could not read cluster " + std::to_string(c) + " of '" + path + "'";
+        return false;
+    }
+
+    for (const meshTriangle &tri : triangles) {
+        if (tri.i0 >= e.nv || tri.i1 >= e.nv || tri.i2 >= e.nv) {
+            error = "cluster " + std::to_string(c) + " of '" + path + "' is broken";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::shared_ptr<const meshChunksFile> meshChunksFile::open(const std::string &path, const std::string &sourcePath, std::string &reason)
+{
+    fileStamp source;
+    if (!statFile(sourcePath, source, reason)) {
+        return nullptr;
+    }
+
+    std::shared_ptr<meshChunksFile> chunks(new meshChunksFile());
+    chunks->path = path;
+    chunks->fd = ::open(path.c_str(), O_RDONLY);
+
+    if (chunks->fd < 0) {
+        reason = strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    meshChunksHeader &h = chunks->header;
+
+    if (fstat(chunks->fd, &st) < 0 || !readAt(chunks->fd, &h, sizeof(h), 0) || memcmp(h.magic, MESH_CHUNKS_MAGIC, 8) != 0) {
+        reason = "not a chunked mesh";
+        return nullptr;
+    }
+
+    if (h.version != MESH_CHUNKS_VERSION || h.headerBytes != sizeof(meshChunksHeader) ||
+        h.sourceSize != source.size || h.sourceTime != source.time) {
+        reason = "stale";
+        return nullptr;
+    }
+
+    uint64_t directoryBytes = (uint64_t) h.numClusters * sizeof(meshClusterEntry);
+    if (h.directoryOffset > (uint64_t) st.st_size || directoryBytes > (uint64_t) st.st_size - h.directoryOffset) {
+        reason = "truncated";
+        return nullptr;
+    }
+
+    chunks->directory.resize(h.numClusters);
+    if (!readAt(chunks->fd, chunks->directory.data(), directoryBytes, h.directoryOffset)) {
+        reason = "truncated";
+        return nullptr;
+    }
+
+    for (const meshClusterEntry &e : chunks->directory) {
+        uint64_t bytes = (uint64_t) e.nv * sizeof(meshVertex) + (uint64_t) e.nt * sizeof(meshTriangle);
+        if (e.offset > h.directoryOffset || bytes > h.directoryOffset - e.offset) {
+            reason = "truncated";
+            return nullptr;
+        }
+    }
+
+    return chunks;
+}
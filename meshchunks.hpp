@@ -0,0 +1,84 @@
+/*
+* meshchunks.hpp
+* Contains the .mesh.chunks format, for meshes too big to keep in memory. The
+* triangles are sorted along a Morton curve and cut into clusters of
+* MESH_CLUSTER_TRIS, and each cluster is stored with its own copy of the
+* vertices it uses, so it can be read (and thrown away again) on its own. A
+* directory at the end of the file holds the bounds of every cluster and where
+* it is; that's all that stays in memory. streamedMesh reads clusters through
+* the geometryCache as rays reach them.
+*/
+
+#ifndef MESHCHUNKS_H
+#define MESHCHUNKS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "aabb.hpp"
+#include "meshfile.hpp"
+
+const uint32_t MESH_CHUNKS_VERSION = 1;
+const uint32_t MESH_CLUSTER_TRIS = 128;  // triangles per cluster, the unit that gets paged in and out
+
+struct meshChunksHeader
+{
+    char magic[8];            // "RAECHUNK"
+    uint32_t version;         // MESH_CHUNKS_VERSION
+    uint32_t headerBytes;     // sizeof(meshChunksHeader)
+    uint64_t sourceSize;      // size and modification time of the .mesh file it was made from
+    int64_t sourceTime;
+    uint64_t numTriangles;
+    uint32_t numClusters;
+    uint32_t unused;
+    uint64_t directoryOffset; // numClusters meshClusterEntry start here
+};
+
+/*
+* Where a cluster is in the file. It's nv meshVertex, then nt meshTriangle
+* indexing into those vertices.
+*/
+struct meshClusterEntry
+{
+    float boxMin[3];
+    float boxMax[3];
+    uint32_t nv;
+    uint32_t nt;
+    uint64_t offset;
+};
+
+/* An open .mesh.chunks file. Clusters are read with pread, so any thread can read one at any time. */
+struct meshChunksFile
+{
+    std::string path;
+    int fd;
+    meshChunksHeader header;
+    std::vector<meshClusterEntry> directory;
+
+    meshChunksFile() : fd(-1) {}
+    ~meshChunksFile();
+    meshChunksFile(const meshChunksFile&) = delete;
+    meshChunksFile &operator=(const meshChunksFile&) = delete;
+
+    aabb clusterBounds(uint32_t c) const;
+
+    /* Read cluster c. Returns false with the reason in error if the file can't be read. */
+    bool readCluster(uint32_t c, std::vector<meshVertex> &vertices, std::vector<meshTriangle> &triangles,
+                     std::string &error) const;
+
+    /*
+    * Open the chunks at path, made from the .mesh at sourcePath as it is now.
+    * Returns nullptr with why not (missing, stale, broken) in reason otherwise.
+    */
+    static std::shared_ptr<const meshChunksFile> open(const std::string &path, const std::string &sourcePath, std::string &reason);
+};
+
+/*
+* Cut the .mesh at sourcePath into clusters and write them to path. The source
+* is mapped rather than read, so it only needs memory for an index per triangle
+* and one cluster at a time.
+*/
+bool writeMeshChunks(const std::string &sourcePath, const std::string &path, std::string &error);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+* meshfile.cpp
+* Implements mapping .mesh files and sharing the mappings, from meshfile.hpp.
+*/
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "meshfile.hpp"
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t seed)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = seed;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ mix64(w + k)) * k;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    h = (h ^ mix64(tail ^ size)) * k;
+
+    return mix64(h);
+}
+
+static void stampOf(const struct stat &st, fileStamp &stamp)
+{
+    stamp.size = st.st_size;
+    stamp.time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    stamp.inode = st.st_ino;
+}
+
+bool statFile(const std::string &path, fileStamp &stamp, std::string &error)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        error = strerror(errno);
+        return false;
+    }
+
+    stampOf(st, stamp);
+    return true;
+}
+
+const uint8_t* mapFile(const std::string &path, size_t &size, std::string &error, fileStamp* stamp)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        error = "empty file";
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file open
+
+    if (data == MAP_FAILED) {
+        error = strerror(errno);
+        return nullptr;
+    }
+
+    size = st.st_size;
+    if (stamp) {
+        stampOf(st, *stamp);
+    }
+
+    return (const uint8_t*) data;
+}
+
+void unmapFile(const uint8_t* data, size_t size)
+{
+    if (data) {
+        munmap((void*) data, size);
+    }
+}
+
+meshFile::~meshFile()
+{
+    unmapFile(data, size);
+}
+
+meshLibrary &meshLibrary::shared()
+{
+    static meshLibrary library;
+    return library;
+}
+
+const size_t MESH_SAMPLES = 64;       // pieces of a file its sampled hash covers
+const size_t MESH_SAMPLE_BYTES = 64;  // ...and how big each is
+
+/* Hash of MESH_SAMPLES pieces spread evenly over the file, the first and last included */
+static uint64_t sampledHash(const meshFile &f)
+{
+    if (f.size <= MESH_SAMPLES * MESH_SAMPLE_BYTES) {
+        return hashBytes(f.data, f.size, 0);
+    }
+
+    uint64_t h = 0;
+    size_t stride = (f.size - MESH_SAMPLE_BYTES) / (MESH_SAMPLES - 1);
+
+    for (size_t i = 0; i < MESH_SAMPLES; i++) {
+        size_t at = i + 1 < MESH_SAMPLES ? i * stride : f.size - MESH_SAMPLE_BYTES;
+        h = hashBytes(f.data + at, MESH_SAMPLE_BYTES, h);
+    }
+
+    return h;
+}
+
+std::shared_ptr<const meshFile> meshLibrary::open(const std::string &fname, std::string &error)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(fname.c_str(), resolved)) {
+        error = strerror(errno);
+        return nullptr;
+    }
+
+    std::string path(resolved);
+
+    // drop the mappings nothing uses any more, and look for this path among the rest
+    std::vector<openFile> open;
+    for (openFile &f : files) {
+        if (std::shared_ptr<const meshFile> m = f.file.lock()) {
+            if (m->path == path) {
+                return m;
+            }
+            open.push_back(f);
+        }
+    }
+
+    files = open;
+
+    std::shared_ptr<meshFile> m(new meshFile());
+    m->path = path;
+    m->data = mapFile(path, m->size, error, &m->stamp);
+
+    if (!m->data) {
+        return nullptr;
+    }
+
+    if (m->size < MESH_HEADER_BYTES) {
+        error = "too short to be a mesh file";
+        return nullptr;
+    }
+
+    memcpy(&m->nv, m->data, sizeof(uint32_t));
+    memcpy(&m->nt, m->data + sizeof(uint32_t), sizeof(uint32_t));
+
+    uint64_t expected = MESH_HEADER_BYTES + (uint64_t) m->nv * sizeof(meshVertex) + (uint64_t) m->nt * sizeof(meshTriangle);
+    if (m->size < expected) {
+        error = "file is " + std::to_string(m->size) + " bytes, but its header says " + std::to_string(m->nv) +
+                " vertices and " + std::to_string(m->nt) + " triangles, which needs " + std::to_string(expected);
+        return nullptr;
+    }
+
+    // Another path with the same contents (a copy, a hard link) can share its mapping. Only
+    // files of the same size are compared, and only ones whose samples match get read through.
+    openFile added;
+    added.file = m;
+
+    for (openFile &other : files) {
+        std::shared_ptr<const meshFile> o = other.file.lock();
+        if (!o || o->size != m->size) {
+            continue;
+        }
+
+        if (!added.sampled) {
+            added.sampledHash = sampledHash(*m);
+            added.sampled = true;
+        }
+
+        if (!other.sampled) {
+            other.sampledHash = sampledHash(*o);
+            other.sampled = true;
+        }
+
+        if (other.sampledHash != added.sampledHash) {
+            continue;
+        }
+
+        if (!added.hashed) {
+            added.fullHash = hashBytes(m->data, m->size, 0);
+            added.hashed = true;
+        }
+
+        if (!other.hashed) {
+            other.fullHash = hashBytes(o->data, o->size, 0);
+            other.hashed = true;
+        }
+
+        if (other.fullHash == added.fullHash) {
+            std::cout << "'" << fname << "' is the same as '" << o->path << "', sharing it.\n";
+            return o;
+        }
+    }
+
+    files.push_back(added);
+    return m;
+}
@@ -0,0 +1,117 @@
+/*
+* meshfile.hpp
+* Contains the layout of .mesh files and meshFile, a .mesh file mapped
+* read-only into memory. Meshes read their triangles straight out of the
+* mapping, so loading one doesn't copy or even read the whole file, and every
+* process rendering the same mesh shares its pages through the page cache.
+*
+* Files are opened through meshLibrary, which hands out one shared mapping per
+* file: loading the same path twice, or two files with the same contents,
+* gives back the mapping that's already open. Contents are compared by hash,
+* and only between files of the same size: first a hash of a few samples of
+* each, then of the whole file if those match. Each file's hashes are worked
+* out once, the first time they're needed.
+*/
+
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "vec.hpp"
+
+/*
+* A vertex read from a .mesh file.
+*/
+struct meshVertex {
+    vec3 coords;    // Position of the vertex
+    vec2 texCoord;  // Map for the texture components
+    vec3 normal;    // Normal of the vertex
+};
+
+/*
+* Triangle in a mesh from a .mesh file. Note that triangles are
+* stored in CW order.
+*/
+struct meshTriangle {
+    uint32_t i0; // ID of first vertex in the mesh
+    uint32_t i1; // ID of second vertex in the mesh
+    uint32_t i2; // ID of third vertex in the mesh
+};
+
+/* 64 bit hash of size bytes, eight at a time, starting from seed */
+uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t seed);
+
+/*
+* Which version of a file is on disk: files built from it are keyed on this
+* instead of its contents, so checking them doesn't read the whole file.
+*/
+struct fileStamp
+{
+    uint64_t size = 0;
+    int64_t time = 0;    // last modified, in nanoseconds
+    uint64_t inode = 0;  // so that a different file moved into place is noticed too
+};
+
+/* Stamp of the file at path. Returns false with the reason in error if it can't be looked at. */
+bool statFile(const std::string &path, fileStamp &stamp, std::string &error);
+
+/*
+* Map a whole file read-only. Returns nullptr with the reason in error if it
+* can't be opened or is empty. unmapFile() undoes it. If stamp isn't null, it's
+* set to the stamp of the file that got mapped.
+*/
+const uint8_t* mapFile(const std::string &path, size_t &size, std::string &error, fileStamp* stamp = nullptr);
+void unmapFile(const uint8_t* data, size_t size);
+
+/*
+* A .mesh file is the number of vertices and the number of triangles as 32 bit
+* integers, then that many meshVertex, then that many meshTriangle.
+*/
+const size_t MESH_HEADER_BYTES = 2 * sizeof(uint32_t);
+
+struct meshFile
+{
+    std::string path;           // canonical path of the file
+    const uint8_t* data;        // the whole file, read-only
+    size_t size;                // in bytes
+    fileStamp stamp;            // of the file when it was mapped
+    uint32_t nv;                // number of vertices
+    uint32_t nt;                // number of triangles
+
+    meshFile() : data(nullptr), size(0), nv(0), nt(0) {}
+    ~meshFile();
+    meshFile(const meshFile&) = delete;
+    meshFile &operator=(const meshFile&) = delete;
+
+    const meshVertex* vertices() const { return (const meshVertex*) (data + MESH_HEADER_BYTES); }
+    const meshTriangle* triangles() const { return (const meshTriangle*) (data + MESH_HEADER_BYTES + nv * sizeof(meshVertex)); }
+};
+
+struct meshLibrary
+{
+    /* A mapping, and the hashes of it worked out so far */
+    struct openFile
+    {
+        std::weak_ptr<const meshFile> file;
+        uint64_t sampledHash = 0;  // of a few bits spread over the file
+        uint64_t fullHash = 0;
+        bool sampled = false;
+        bool hashed = false;
+    };
+
+    std::vector<openFile> files;  // every mapping still in use by some mesh
+
+    /*
+    * Map fname, or return the mapping of an open file that's the same file or
+    * has the same contents. Returns nullptr with the reason in error if the file
+    * can't be opened or isn't a valid .mesh file.
+    */
+    std::shared_ptr<const meshFile> open(const std::string &fname, std::string &error);
+
+    static meshLibrary &shared();  // the library every triangleMesh loads through
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+* packet.hpp
+* Contains the rayPacket type for tracing PACKET_SIZE coherent rays together
+* (e.g. primary rays through neighbouring pixels). Rays are stored as structure
+* of arrays, and the kernels that use packets loop over the lanes with no
+* branches in the loop body so the compiler can turn them into SIMD code.
+* Lanes that aren't in use (or have finished) are left out of the active mask.
+*/
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstdint>
+#include "vec.hpp"
+#include "ray.hpp"
+#include "aabb.hpp"
+#include "matrix.hpp"
+
+// Number of rays in a packet: 4, 8 or 16. Packets cover 2x2, 4x2 or 4x4 pixels.
+#ifndef PACKET_SIZE
+#define PACKET_SIZE 8
+#endif
+
+#if PACKET_SIZE == 4
+const int PACKET_COLS = 2;
+#elif PACKET_SIZE == 8 || PACKET_SIZE == 16
+const int PACKET_COLS = 4;
+#else
+#error "PACKET_SIZE must be 4, 8 or 16"
+#endif
+const int PACKET_ROWS = PACKET_SIZE / PACKET_COLS;
+
+typedef uint32_t laneMask;
+const laneMask ALL_LANES = (PACKET_SIZE == 32) ? 0xffffffffu : ((1u << PACKET_SIZE) - 1);
+
+struct rayPacket
+{
+    float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];    // origins
+    float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];    // directions
+    float idx[PACKET_SIZE], idy[PACKET_SIZE], idz[PACKET_SIZE]; // 1 / directions
+    float tmax[PACKET_SIZE]; // closest hit found so far in each lane
+    laneMask active;         // lanes holding real rays
+
+    void set(int lane, const ray &r, float tmax_)
+    {
+        ox[lane] = r.origin.x;
+        oy[lane] = r.origin.y;
+        oz[lane] = r.origin.z;
+        dx[lane] = r.direction.x;
+        dy[lane] = r.direction.y;
+        dz[lane] = r.direction.z;
+        idx[lane] = 1.0f / r.direction.x;
+        idy[lane] = 1.0f / r.direction.y;
+        idz[lane] = 1.0f / r.direction.z;
+        tmax[lane] = tmax_;
+    }
+
+    ray get(int lane) const
+    {
+        return ray(vec3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane]));
+    }
+
+    /* Fill in the unused lanes with copies of an active one so the kernels can ignore them */
+    void padInactive()
+    {
+        int src = 0;
+        while (src < PACKET_SIZE && !(active & (1u << src))) {
+            src++;
+        }
+
+        for (int l = 0; l < PACKET_SIZE && src < PACKET_SIZE; l++) {
+            if (!(active & (1u << l))) {
+                set(l, get(src), -INF);
+            }
+        }
+    }
+
+    /* Directions' sign along axis a if every active lane agrees: 1 or -1. 0 if they don't. */
+    int commonSign(int a) const
+    {
+        const float* d = a == 0 ? dx : (a == 1 ? dy : dz);
+        bool pos = false, neg = false;
+
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            bool on = (active >> l) & 1;
+            pos |= on && d[l] >= 0;
+            neg |= on && d[l] < 0;
+        }
+
+        return (pos && neg) ? 0 : (pos ? 1 : -1);
+    }
+};
+
+/* Transform every ray of p by mat into out (e.g. into an instance's local space) */
+inline void transformPacket(const affineMat &mat, const rayPacket &p, rayPacket &out)
+{
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        out.ox[l] = mat.m[0][0]*p.ox[l] + mat.m[0][1]*p.oy[l] + mat.m[0][2]*p.oz[l] + mat.m[0][3];
+        out.oy[l] = mat.m[1][0]*p.ox[l] + mat.m[1][1]*p.oy[l] + mat.m[1][2]*p.oz[l] + mat.m[1][3];
+        out.oz[l] = mat.m[2][0]*p.ox[l] + mat.m[2][1]*p.oy[l] + mat.m[2][2]*p.oz[l] + mat.m[2][3];
+        out.dx[l] = mat.m[0][0]*p.dx[l] + mat.m[0][1]*p.dy[l] + mat.m[0][2]*p.dz[l];
+        out.dy[l] = mat.m[1][0]*p.dx[l] + mat.m[1][1]*p.dy[l] + mat.m[1][2]*p.dz[l];
+        out.dz[l] = mat.m[2][0]*p.dx[l] + mat.m[2][1]*p.dy[l] + mat.m[2][2]*p.dz[l];
+        out.idx[l] = 1.0f / out.dx[l];
+        out.idy[l] = 1.0f / out.dy[l];
+        out.idz[l] = 1.0f / out.dz[l];
+        out.tmax[l] = p.tmax[l];
+    }
+
+    out.active = p.active;
+}
+
+/*
+* Slab test every lane against box at once. Returns the lanes that hit it
+* somewhere in [tmin, tmax[lane]], and their entry/exit distances in t0/t1.
+*/
+inline laneMask packetHitsBox(const rayPacket &p, const aabb &box, float tmin,
+                              float t0[PACKET_SIZE], float t1[PACKET_SIZE])
+{
+    // work in local arrays, so the compiler knows the stores can't change p or box
+    // and vectorizes the loop
+    const float x0 = box.pmin.x, y0 = box.pmin.y, z0 = box.pmin.z;
+    const float x1 = box.pmax.x, y1 = box.pmax.y, z1 = box.pmax.z;
+    float lo[PACKET_SIZE], hi[PACKET_SIZE];
+    laneMask m = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        float xa = (x0 - p.ox[l]) * p.idx[l], xb = (x1 - p.ox[l]) * p.idx[l];
+        float ya = (y0 - p.oy[l]) * p.idy[l], yb = (y1 - p.oy[l]) * p.idy[l];
+        float za = (z0 - p.oz[l]) * p.idz[l], zb = (z1 - p.oz[l]) * p.idz[l];
+
+        lo[l] = std::max(std::max(std::min(xa, xb), std::min(ya, yb)), std::max(std::min(za, zb), tmin));
+        hi[l] = std::min(std::min(std::max(xa, xb), std::max(ya, yb)), std::min(std::max(za, zb), p.tmax[l]));
+    }
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        t0[l] = lo[l];
+        t1[l] = hi[l];
+        m |= (laneMask) (lo[l] <= hi[l]) << l;
+    }
+
+    return m & p.active;
+}
+
+/*
+* Test one triangle against every lane of p at once, using the same Cramer's
+* rule as triangle::hit in shape.cpp. Returns the lanes that hit it in
+* [tmin, tmax[lane]], along with each lane's t and barycentric coordinates.
+*/
+inline laneMask hitTrianglePacket(const rayPacket &p, const vec3 &p0, const vec3 &p1, const vec3 &p2,
+                                  float tmin, float tval[PACKET_SIZE],
+                                  float beta[PACKET_SIZE], float gamma[PACKET_SIZE])
+{
+    // edges from p1 -> p0 and p2 -> p0 are the same for every lane
+    float A = p0.x - p1.x;
+    float B = p0.y - p1.y;
+    float C = p0.z - p1.z;
+    float D = p0.x - p2.x;
+    float E = p0.y - p2.y;
+    float F = p0.z - p2.z;
+    laneMask hitLanes = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        float G = p.dx[l];
+        float H = p.dy[l];
+        float I = p.dz[l];
+        float J = p0.x - p.ox[l];
+        float K = p0.y - p.oy[l];
+        float L = p0.z - p.oz[l];
+
+        float EIHF = E*I - H*F;
+        float GFDI = G*F - D*I;
+        float DHEG = D*H - E*G;
+        float invDenom = 1.0f / (A*EIHF + B*GFDI + C*DHEG);
+
+        float AKJB = A*K - J*B;
+        float JCAL = J*C - A*L;
+        float BLKC = B*L - K*C;
+
+        float b = (J*EIHF + K*GFDI + L*DHEG) * invDenom;
+        float g = (I*AKJB + H*JCAL + G*BLKC) * invDenom;
+        float t = -(F*AKJB + E*JCAL + D*BLKC) * invDenom;
+
+        bool hit = b > 0.0f && b < 1.0f && g > 0.0f && b + g < 1.0f && t >= tmin && t <= p.tmax[l];
+        hitLanes |= (laneMask) hit << l;
+        tval[l] = t;
+        beta[l] = b;
+        gamma[l] = g;
+    }
+
+    return hitLanes & p.active;
+}
+
+/*
+* The frustum of a packet, as intervals over its lanes' origins and inverse
+* directions. If every lane points the same way along each axis, interval
+* arithmetic gives a conservative test of whether the whole packet misses a box,
+* which is a lot cheaper than testing every lane.
+*/
+struct packetFrustum
+{
+    vec3 omin, omax;    // bounds of the origins
+    vec3 idmin, idmax;  // bounds of the inverse directions
+    float tmaxAll;      // largest tmax of any lane
+    bool valid;         // false if the lanes' directions don't share signs
+
+    void build(const rayPacket &p)
+    {
+        omin = vec3(INF);
+        omax = vec3(-INF);
+        idmin = vec3(INF);
+        idmax = vec3(-INF);
+        tmaxAll = -INF;
+
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (!(p.active & (1u << l))) {
+                continue;
+            }
+
+            omin = minVec(omin, vec3(p.ox[l], p.oy[l], p.oz[l]));
+            omax = maxVec(omax, vec3(p.ox[l], p.oy[l], p.oz[l]));
+            idmin = minVec(idmin, vec3(p.idx[l], p.idy[l], p.idz[l]));
+            idmax = maxVec(idmax, vec3(p.idx[l], p.idy[l], p.idz[l]));
+            tmaxAll = std::max(tmaxAll, p.tmax[l]);
+        }
+
+        valid = p.commonSign(0) != 0 && p.commonSign(1) != 0 && p.commonSign(2) != 0 &&
+                std::isfinite(idmin.x) && std::isfinite(idmin.y) && std::isfinite(idmin.z) &&
+                std::isfinite(idmax.x) && std::isfinite(idmax.y) && std::isfinite(idmax.z);
+    }
+
+    /* True only if no lane can hit box */
+    bool misses(const aabb &box, float tmin) const
+    {
+        if (!valid) {
+            return false;
+        }
+
+        float enter = tmin;
+        float exit = tmaxAll;
+
+        for (int a = 0; a < 3; a++) {
+            // the near and far slabs depend on which way the rays point
+            bool pos = idmin.e[a] >= 0;
+            float nearPlane = pos ? box.pmin.e[a] : box.pmax.e[a];
+            float farPlane = pos ? box.pmax.e[a] : box.pmin.e[a];
+
+            // smallest possible entry and largest possible exit over all lanes
+            float n0 = (nearPlane - omax.e[a]) * idmin.e[a], n1 = (nearPlane - omax.e[a]) * idmax.e[a];
+            float n2 = (nearPlane - omin.e[a]) * idmin.e[a], n3 = (nearPlane - omin.e[a]) * idmax.e[a];
+            float f0 = (farPlane - omax.e[a]) * idmin.e[a], f1 = (farPlane - omax.e[a]) * idmax.e[a];
+            float f2 = (farPlane - omin.e[a]) * idmin.e[a], f3 = (farPlane - omin.e[a]) * idmax.e[a];
+
+            enter = std::max(enter, std::min(std::min(n0, n1), std::min(n2, n3)));
+            exit = std::min(exit, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+
+        return enter > exit;
+    }
+};
+
+#endif
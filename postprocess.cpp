@@ -0,0 +1,233 @@
+/*
+* postprocess.cpp
+* Implements the post-processing pass from postprocess.hpp.
+*/
+
+#include "postprocess.hpp"
+#include "rng.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* The pipeline's settings, worked out once per row */
+struct postConstants
+{
+    float scale;      // 2^exposure
+    float invGamma;
+    uint32_t key;     // mixed into the dither hash
+};
+
+static postConstants constantsFor(const postSettings &s)
+{
+    postConstants c;
+    c.scale = std::exp2(s.exposure);
+    c.invGamma = 1.0f / s.gamma;
+    c.key = pcgHash(s.seed);
+    return c;
+}
+
+static inline float toneMap(toneMapOp op, float x)
+{
+    switch (op) {
+    case TONEMAP_REINHARD:
+        return x / (1.0f + x);
+
+    case TONEMAP_ACES:
+        return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+
+    default:
+        return x;
+    }
+}
+
+static inline float toSRGB(float v)
+{
+    return v <= 0.0031308f ? 12.92f * v : 1.055f * fastPow(v, 1.0f / 2.4f) - 0.055f;
+}
+
+#if defined(__AVX2__)
+
+/* The pipeline for one value, for the ends of rows */
+static inline uint8_t postProcessValue(const postSettings &s, const postConstants &c, float v, uint32_t k)
+{
+    // written so NaNs go to 0
+    v *= c.scale;
+    v = v > 0.0f ? v : 0.0f;
+    v = std::min(toneMap(s.toneMap, v), 1.0f);
+
+    if (s.transfer == TRANSFER_GAMMA) {
+        v = fastPow(v, c.invGamma);
+    }
+
+    else if (s.transfer == TRANSFER_SRGB) {
+        v = toSRGB(v);
+    }
+
+    // truncating 256 v + u, u uniform in [0, 1), rounds to the nearest level on average
+    float d = s.dither ? toUnitFloat(pcgHash(k ^ c.key)) : 0.0f;
+    return (uint8_t) (int) std::min(256.0f * v + d, 255.0f);
+}
+
+/* Eight wide versions of fastLog2, fastExp2, pcgHash and toUnitFloat */
+static inline __m256 log2x8(__m256 x)
+{
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i mantissa = _mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff));
+    __m256i big = _mm256_cmpgt_epi32(mantissa, _mm256_set1_epi32(0x3504f3));  // all ones where it's past sqrt(2)
+    __m256i e = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)), big);
+    __m256 ef = _mm256_cvtepi32_ps(e);
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(mantissa, _mm256_add_epi32(_mm256_set1_epi32(0x3f800000),
+                                                                              _mm256_slli_epi32(big, 23))));
+
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+    __m256 t2 = _mm256_mul_ps(t, t);
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(0.577078016f), _mm256_mul_ps(t2, _mm256_set1_ps(0.412198583f)));
+    p = _mm256_add_ps(_mm256_set1_ps(0.961796694f), _mm256_mul_ps(t2, p));
+    p = _mm256_add_ps(_mm256_set1_ps(2.88539008f), _mm256_mul_ps(t2, p));
+    return _mm256_add_ps(ef, _mm256_mul_ps(t, p));
+}
+
+static inline __m256 exp2x8(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(126.0f));
+    __m256i i = _mm256_sub_epi32(_mm256_cvttps_epi32(_mm256_add_ps(x, _mm256_set1_ps(127.5f))), _mm256_set1_epi32(127));
+    __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(0.00133335581f), _mm256_mul_ps(f, _mm256_set1_ps(0.000154035304f)));
+    p = _mm256_add_ps(_mm256_set1_ps(0.00961812911f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(0.0555041087f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(0.240226507f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(0.693147181f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(f, p));
+
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+}
+
+/* x^p for x in [0, 1] */
+static inline __m256 powx8(__m256 x, float p)
+{
+    __m256 y = exp2x8(_mm256_mul_ps(_mm256_set1_ps(p), log2x8(_mm256_max_ps(x, _mm256_set1_ps(1e-30f)))));
+    return _mm256_and_ps(y, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+
+static inline __m256 ditherx8(__m256i k)
+{
+    __m256i state = _mm256_add_epi32(_mm256_mullo_epi32(k, _mm256_set1_epi32(747796405u)), _mm256_set1_epi32(2891336453u));
+    __m256i shift = _mm256_add_epi32(_mm256_srli_epi32(state, 28), _mm256_set1_epi32(4));
+    __m256i word = _mm256_mullo_epi32(_mm256_xor_si256(_mm256_srlv_epi32(state, shift), state), _mm256_set1_epi32(277803737u));
+    __m256i h = _mm256_xor_si256(_mm256_srli_epi32(word, 22), word);
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)), _mm256_set1_ps(1.0f / 16777216.0f));
+}
+
+void postProcessRow(const postSettings &s, float* values, uint8_t* out, int count, uint32_t first)
+{
+    postConstants c = constantsFor(s);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int k = 0;
+
+    for (; k + 8 <= count; k += 8) {
+        // max returns its second operand for NaNs, so they go to 0
+        __m256 v = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(values + k), _mm256_set1_ps(c.scale)), zero);
+
+        if (s.toneMap == TONEMAP_REINHARD) {
+            v = _mm256_div_ps(v, _mm256_add_ps(one, v));
+        }
+
+        else if (s.toneMap == TONEMAP_ACES) {
+            __m256 num = _mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), v), _mm256_set1_ps(0.03f)));
+            __m256 den = _mm256_add_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), v),
+                                                                      _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+            v = _mm256_div_ps(num, den);
+        }
+
+        v = _mm256_min_ps(v, one);
+
+        if (s.transfer == TRANSFER_GAMMA) {
+            v = powx8(v, c.invGamma);
+        }
+
+        else if (s.transfer == TRANSFER_SRGB) {
+            __m256 curve = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(1.055f), powx8(v, 1.0f / 2.4f)), _mm256_set1_ps(0.055f));
+            __m256 toe = _mm256_mul_ps(_mm256_set1_ps(12.92f), v);
+            v = _mm256_blendv_ps(curve, toe, _mm256_cmp_ps(v, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ));
+        }
+
+        __m256 q = _mm256_mul_ps(_mm256_set1_ps(256.0f), v);
+        if (s.dither) {
+            __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(first + k), lane);
+            q = _mm256_add_ps(q, ditherx8(_mm256_xor_si256(idx, _mm256_set1_epi32(c.key))));
+        }
+
+        // truncate to int, then pack the 8 ints down to 8 bytes
+        __m256i qi = _mm256_cvttps_epi32(_mm256_min_ps(q, _mm256_set1_ps(255.0f)));
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(qi), _mm256_extracti128_si256(qi, 1));
+        _mm_storel_epi64((__m128i*) (out + k), _mm_packus_epi16(words, words));
+    }
+
+    for (; k < count; k++) {
+        out[k] = postProcessValue(s, c, values[k], first + k);
+    }
+}
+
+#else
+
+/* Same as the AVX2 version above. Each stage is a loop of its own, so the settings are looked at once a row. */
+void postProcessRow(const postSettings &s, float* values, uint8_t* out, int count, uint32_t first)
+{
+    postConstants c = constantsFor(s);
+
+    // written so NaNs go to 0
+    for (int k = 0; k < count; k++) {
+        float v = values[k] * c.scale;
+        values[k] = v > 0.0f ? v : 0.0f;
+    }
+
+    if (s.toneMap != TONEMAP_NONE) {
+        for (int k = 0; k < count; k++) {
+            values[k] = toneMap(s.toneMap, values[k]);
+        }
+    }
+
+    if (s.transfer == TRANSFER_GAMMA) {
+        for (int k = 0; k < count; k++) {
+            values[k] = fastPow(std::min(values[k], 1.0f), c.invGamma);
+        }
+    }
+
+    else if (s.transfer == TRANSFER_SRGB) {
+        for (int k = 0; k < count; k++) {
+            values[k] = toSRGB(std::min(values[k], 1.0f));
+        }
+    }
+
+    // truncating 256 v + u, u uniform in [0, 1), rounds to the nearest level on average
+    if (s.dither) {
+        for (int k = 0; k < count; k++) {
+            float d = toUnitFloat(pcgHash((first + k) ^ c.key));
+            out[k] = (uint8_t) (int) std::min(256.0f * std::min(values[k], 1.0f) + d, 255.0f);
+        }
+    }
+
+    else {
+        for (int k = 0; k < count; k++) {
+            out[k] = (uint8_t) (int) std::min(256.0f * std::min(values[k], 1.0f), 255.0f);
+        }
+    }
+}
+
+#endif
+
+void toneMapRow(const postSettings &s, float* values, int count)
+{
+    postConstants c = constantsFor(s);
+
+    for (int k = 0; k < count; k++) {
+        float v = values[k] * c.scale;
+        values[k] = s.toneMap == TONEMAP_NONE ? v : toneMap(s.toneMap, v > 0.0f ? v : 0.0f);
+    }
+}
@@ -0,0 +1,108 @@
+/*
+* postprocess.hpp
+* Contains the post-processing that turns the linear radiance in the image into
+* what gets written: exposure, a tonemap operator, a transfer function (gamma or
+* sRGB) and dithering, fused into one pass per row that ends in 8 bit values.
+* With -mavx2 the pass runs 8 values at a time in AVX registers; otherwise it's
+* a plain loop. Powers are worked out with the polynomial fastLog2/fastExp2
+* below rather than pow.
+*/
+
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+enum toneMapOp
+{
+    TONEMAP_NONE,      // clamp to [0, 1]
+    TONEMAP_REINHARD,  // x / (1 + x)
+    TONEMAP_ACES       // Narkowicz's fit of the ACES filmic curve
+};
+
+enum transferFunc
+{
+    TRANSFER_LINEAR,
+    TRANSFER_GAMMA,    // x^(1/gamma)
+    TRANSFER_SRGB
+};
+
+struct postSettings
+{
+    float exposure = 0.0f;              // in stops; the image is scaled by 2^exposure first
+    toneMapOp toneMap = TONEMAP_NONE;
+    transferFunc transfer = TRANSFER_LINEAR;
+    float gamma = 2.2f;                 // for TRANSFER_GAMMA
+    bool dither = false;                // add noise before quantizing, so gradients don't band
+    uint32_t seed = 0;                  // of the dither noise
+};
+
+inline float bitsToFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+inline uint32_t floatToBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+/*
+* log2(x) for normal x > 0, good to about 1e-7. x = 2^e * m with m in
+* [sqrt(1/2), sqrt(2)), and log2(m) is the atanh series in (m - 1) / (m + 1).
+* It and fastExp2 are branch free, and do exactly what their eight wide
+* versions in postprocess.cpp do, so both paths give the same bytes.
+*/
+inline float fastLog2(float x)
+{
+    // m is the mantissa with an exponent of 0, or -1 if that puts it past sqrt(2) (0x3fb504f3)
+    uint32_t bits = floatToBits(x);
+    uint32_t mantissa = bits & 0x7fffff;
+    uint32_t big = mantissa > 0x3504f3;
+    float e = (float) ((int) (bits >> 23) - 127 + (int) big);
+    float m = bitsToFloat(mantissa | (0x3f800000 - (big << 23)));
+
+    float t = (m - 1.0f) / (m + 1.0f);
+    float t2 = t * t;
+    return e + t * (2.88539008f + t2 * (0.961796694f + t2 * (0.577078016f + t2 * 0.412198583f)));
+}
+
+/* 2^x, good to about 2e-7 relative. x is clamped to the exponents a normal float has. */
+inline float fastExp2(float x)
+{
+    // x rounded to the nearest integer i, with f = x - i. The offset keeps what's truncated positive.
+    x = std::min(std::max(x, -126.0f), 126.0f);
+    int i = (int) (x + 127.5f) - 127;
+    float f = x - i;
+
+    // Taylor series of e^(f ln 2) for f in [-1/2, 1/2]
+    float p = 1.0f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f +
+              f * (0.00961812911f + f * (0.00133335581f + f * 0.000154035304f)))));
+    return p * bitsToFloat((uint32_t) (i + 127) << 23);
+}
+
+/* x^p for x >= 0 */
+inline float fastPow(float x, float p)
+{
+    return x > 0.0f ? fastExp2(p * fastLog2(std::max(x, 1e-30f))) : 0.0f;
+}
+
+/*
+* Run the whole pipeline on count channel values (rgb interleaved) and write
+* them to out as bytes. values may be overwritten along the way. first is the
+* index of values[0] among all the channel values of the image, which keys the
+* dither noise so it doesn't depend on how the image was split up.
+*/
+void postProcessRow(const postSettings &s, float* values, uint8_t* out, int count, uint32_t first);
+
+/* Just exposure and the tonemap, in place, for float output. Nothing is clamped if there's no tonemap. */
+void toneMapRow(const postSettings &s, float* values, int count);
+
+#endif
@@ -0,0 +1,463 @@
+/*
+* primitives.cpp
+* Implements the primitive arrays from primitives.hpp. The intersection maths is
+* the same as the matching shapes' in shape.cpp, except for spheres, which go
+* through the float kernels in sphereblock.hpp.
+*/
+
+#include "primitives.hpp"
+#include "sphereblock.hpp"
+
+/* ----- sphereList ----- */
+
+uint32_t sphereList::add(const vec3 &centre, float r, const rgb &c, bool m)
+{
+    cx.push_back(centre.x);
+    cy.push_back(centre.y);
+    cz.push_back(centre.z);
+    radius.push_back(r);
+    radius2.push_back(r * r);
+    colour.push_back(c);
+    mirror.push_back(m);
+    return size() - 1;
+}
+
+aabb sphereList::bounds(uint32_t i) const
+{
+    vec3 centre(cx[i], cy[i], cz[i]);
+    return aabb(centre - vec3(radius[i]), centre + vec3(radius[i]));
+}
+
+/*
+* Put the spheres in the given order (sphere i becomes the one that was
+* order[i]), then pad the arrays the block kernels read so a block can start
+* at any sphere.
+*/
+void sphereList::pack(const std::vector<uint32_t> &order)
+{
+    sphereList packed;
+    for (auto i : order) {
+        packed.add(vec3(cx[i], cy[i], cz[i]), radius[i], colour[i], mirror[i]);
+    }
+
+    for (int k = 1; k < SPHERE_BLOCK_SIZE; k++) {
+        packed.cx.push_back(0.0f);
+        packed.cy.push_back(0.0f);
+        packed.cz.push_back(0.0f);
+        packed.radius2.push_back(0.0f);
+    }
+
+    *this = packed;
+}
+
+/*
+* Nearest root at or after tmin of the quadratic from the block kernels, if
+* there is one, worked out in double from the start. It's what slots the
+* kernels aren't sure about fall back to.
+*/
+static inline bool sphereRoot(const ray &r, const vec3 &centre, float radius, float tmin, double &t)
+{
+    double fx = (double) r.origin.x - centre.x;
+    double fy = (double) r.origin.y - centre.y;
+    double fz = (double) r.origin.z - centre.z;
+    double dx = r.direction.x, dy = r.direction.y, dz = r.direction.z;
+    double r2 = (double) radius * radius;
+
+    double a = dx*dx + dy*dy + dz*dz;
+    double b = fx*dx + fy*dy + fz*dz;
+    double c = fx*fx + fy*fy + fz*fz - r2;
+
+    double s = b / a;
+    double lx = fx - s*dx, ly = fy - s*dy, lz = fz - s*dz;
+    double discriminant = a * (r2 - (lx*lx + ly*ly + lz*lz));
+
+    if (discriminant <= 0) {
+        return false;
+    }
+
+    double q = -(b + std::copysign(sqrt(discriminant), b));
+    double t0 = c / q;
+    double t1 = q / a;
+    t = std::min(t0, t1);
+
+    if (t < tmin) {
+        t = std::max(t0, t1);
+    }
+
+    return t >= tmin;
+}
+
+/*
+* Test r against the spheres ids[k..k+m), where m is as many as fit in a block
+* and follow on from ids[k] in the arrays; in a packed list that's every sphere
+* in a bvh leaf. Returns the slots hit in [tmin, tmax], with their distances in t.
+* Slots the block kernel isn't sure about are redone in double.
+*/
+static inline uint32_t sphereBlockHits(const sphereList &spheres, const uint32_t* ids, int n, int k, int &m,
+                                       const ray &r, float tmin, float tmax, float t[SPHERE_BLOCK_SIZE])
+{
+    uint32_t first = primIndex(ids[k]);
+    m = 1;
+    while (k + m < n && m < SPHERE_BLOCK_SIZE && primIndex(ids[k + m]) == first + m) {
+        m++;
+    }
+
+    uint32_t careful;
+    uint32_t used = (1u << m) - 1;
+    uint32_t hitMask = intersectSphereBlock(&spheres.cx[first], &spheres.cy[first], &spheres.cz[first],
+                                            &spheres.radius2[first], r, tmin, tmax, t, careful) & used;
+
+    for (careful &= used; careful; careful &= careful - 1) {
+        int slot = __builtin_ctz(careful);
+        uint32_t i = first + slot;
+        double dt;
+
+        if (sphereRoot(r, vec3(spheres.cx[i], spheres.cy[i], spheres.cz[i]), spheres.radius[i], tmin, dt) && dt <= tmax) {
+            hitMask |= 1u << slot;
+            t[slot] = dt;
+        }
+
+        else {
+            hitMask &= ~(1u << slot);
+        }
+    }
+
+    return hitMask;
+}
+
+int sphereList::hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const
+{
+    int closest = -1;
+    float t[SPHERE_BLOCK_SIZE];
+
+    for (int k = 0, m; k < n; k += m) {
+        uint32_t hitMask = sphereBlockHits(*this, ids, n, k, m, r, tmin, tmax, t);
+
+        for (; hitMask; hitMask &= hitMask - 1) {
+            int slot = __builtin_ctz(hitMask);
+            if (t[slot] <= tmax) {
+                tmax = t[slot];
+                closest = primIndex(ids[k]) + slot;
+            }
+        }
+    }
+
+    if (closest >= 0) {
+        record.t = tmax;
+        record.normal = makeUnitVector(r.origin + tmax*r.direction - vec3(cx[closest], cy[closest], cz[closest]));
+        record.colour = colour[closest];
+        record.mirror = mirror[closest];
+    }
+
+    return closest;
+}
+
+int sphereList::occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const
+{
+    float t[SPHERE_BLOCK_SIZE];
+
+    for (int k = 0, m; k < n; k += m) {
+        uint32_t hitMask = sphereBlockHits(*this, ids, n, k, m, r, tmin, tmax, t);
+
+        if (hitMask) {
+            return primIndex(ids[k]) + __builtin_ctz(hitMask);
+        }
+    }
+
+    return -1;
+}
+
+/*
+* Test every lane of p against sphere i with the maths of the block kernels.
+* Returns the active lanes that hit it in [tmin, p.tmax[lane]], with their
+* distances in t. Lanes the kernel isn't sure about are redone in double.
+*/
+static inline laneMask spherePacketHits(const sphereList &spheres, uint32_t i, const rayPacket &p, float tmin,
+                                        float t[PACKET_SIZE])
+{
+    laneMask hitLanes = 0;
+    laneMask careful = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        bool close;
+        bool hit = intersectSphereSlot(p.ox[l] - spheres.cx[i], p.oy[l] - spheres.cy[i], p.oz[l] - spheres.cz[i],
+                                       p.dx[l], p.dy[l], p.dz[l], spheres.radius2[i], tmin, p.tmax[l], t[l], close);
+        hitLanes |= (laneMask) hit << l;
+        careful |= (laneMask) close << l;
+    }
+
+    hitLanes &= p.active;
+
+    for (careful &= p.active; careful; careful &= careful - 1) {
+        int l = __builtin_ctz(careful);
+        double dt;
+
+        if (sphereRoot(p.get(l), vec3(spheres.cx[i], spheres.cy[i], spheres.cz[i]), spheres.radius[i], tmin, dt) &&
+            dt <= p.tmax[l]) {
+            hitLanes |= 1u << l;
+            t[l] = dt;
+        }
+
+        else {
+            hitLanes &= ~(1u << l);
+        }
+    }
+
+    return hitLanes;
+}
+
+laneMask sphereList::hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    float tval[PACKET_SIZE];
+    laneMask hitLanes = spherePacketHits(*this, i, p, tmin, tval);
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (hitLanes & (1u << l)) {
+            vec3 o(p.ox[l], p.oy[l], p.oz[l]);
+            vec3 d(p.dx[l], p.dy[l], p.dz[l]);
+
+            p.tmax[l] = tval[l];
+            records[l].t = tval[l];
+            records[l].normal = makeUnitVector(o + tval[l]*d - vec3(cx[i], cy[i], cz[i]));
+            records[l].colour = colour[i];
+            records[l].mirror = mirror[i];
+        }
+    }
+
+    return hitLanes;
+}
+
+laneMask sphereList::shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const
+{
+    float t[PACKET_SIZE];
+    return spherePacketHits(*this, i, p, tmin, t);
+}
+
+/* ----- triangleList ----- */
+
+uint32_t triangleList::add(const vec3 &p0, const vec3 &p1, const vec3 &p2, const rgb &c, bool m)
+{
+    p0x.push_back(p0.x);
+    p0y.push_back(p0.y);
+    p0z.push_back(p0.z);
+    p1x.push_back(p1.x);
+    p1y.push_back(p1.y);
+    p1z.push_back(p1.z);
+    p2x.push_back(p2.x);
+    p2y.push_back(p2.y);
+    p2z.push_back(p2.z);
+    normal.push_back(makeUnitVector(cross(p1 - p0, p2 - p0)));
+    colour.push_back(c);
+    mirror.push_back(m);
+    return size() - 1;
+}
+
+aabb triangleList::bounds(uint32_t i) const
+{
+    aabb b;
+    b.extend(vec3(p0x[i], p0y[i], p0z[i]));
+    b.extend(vec3(p1x[i], p1y[i], p1z[i]));
+    b.extend(vec3(p2x[i], p2y[i], p2z[i]));
+    return b;
+}
+
+/* Distance along r to triangle i by Cramer's rule, as in triangle::hit. Misses give -INF. */
+static inline float triangleDistance(const triangleList &tris, uint32_t i, const ray &r)
+{
+    float A = tris.p0x[i] - tris.p1x[i];
+    float B = tris.p0y[i] - tris.p1y[i];
+    float C = tris.p0z[i] - tris.p1z[i];
+    float D = tris.p0x[i] - tris.p2x[i];
+    float E = tris.p0y[i] - tris.p2y[i];
+    float F = tris.p0z[i] - tris.p2z[i];
+    float G = r.direction.x;
+    float H = r.direction.y;
+    float I = r.direction.z;
+    float J = tris.p0x[i] - r.origin.x;
+    float K = tris.p0y[i] - r.origin.y;
+    float L = tris.p0z[i] - r.origin.z;
+
+    float EIHF = E*I - H*F;
+    float GFDI = G*F - D*I;
+    float DHEG = D*H - E*G;
+    float denom = A*EIHF + B*GFDI + C*DHEG;
+    float beta = (J*EIHF + K*GFDI + L*DHEG) / denom;
+
+    float AKJB = A*K - J*B;
+    float JCAL = J*C - A*L;
+    float BLKC = B*L - K*C;
+    float gamma = (I*AKJB + H*JCAL + G*BLKC) / denom;
+
+    if (!(beta > 0.0f && beta < 1.0f && gamma > 0.0f && beta + gamma < 1.0f)) {
+        return -INF;
+    }
+
+    return -(F*AKJB + E*JCAL + D*BLKC) / denom;
+}
+
+int triangleList::hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const
+{
+    int closest = -1;
+
+    for (int k = 0; k < n; k++) {
+        uint32_t i = primIndex(ids[k]);
+        float t = triangleDistance(*this, i, r);
+
+        if (t >= tmin && t <= tmax) {
+            tmax = t;
+            closest = i;
+        }
+    }
+
+    if (closest >= 0) {
+        record.t = tmax;
+        record.normal = normal[closest];
+        record.colour = colour[closest];
+        record.mirror = mirror[closest];
+    }
+
+    return closest;
+}
+
+int triangleList::occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const
+{
+    for (int k = 0; k < n; k++) {
+        uint32_t i = primIndex(ids[k]);
+        float t = triangleDistance(*this, i, r);
+
+        if (t >= tmin && t <= tmax) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+laneMask triangleList::hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    float tval[PACKET_SIZE], beta[PACKET_SIZE], gamma[PACKET_SIZE];
+    laneMask hitLanes = hitTrianglePacket(p, vec3(p0x[i], p0y[i], p0z[i]), vec3(p1x[i], p1y[i], p1z[i]),
+                                          vec3(p2x[i], p2y[i], p2z[i]), tmin, tval, beta, gamma);
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (hitLanes & (1u << l)) {
+            p.tmax[l] = tval[l];
+            records[l].t = tval[l];
+            records[l].normal = normal[i];
+            records[l].colour = colour[i];
+            records[l].mirror = mirror[i];
+        }
+    }
+
+    return hitLanes;
+}
+
+laneMask triangleList::shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const
+{
+    float tval[PACKET_SIZE], beta[PACKET_SIZE], gamma[PACKET_SIZE];
+    return hitTrianglePacket(p, vec3(p0x[i], p0y[i], p0z[i]), vec3(p1x[i], p1y[i], p1z[i]),
+                             vec3(p2x[i], p2y[i], p2z[i]), tmin, tval, beta, gamma);
+}
+
+/* ----- planeList ----- */
+
+uint32_t planeList::add(const vec3 &pt, const vec3 &n, const rgb &c, bool m)
+{
+    px.push_back(pt.x);
+    py.push_back(pt.y);
+    pz.push_back(pt.z);
+    nx.push_back(n.x);
+    ny.push_back(n.y);
+    nz.push_back(n.z);
+    colour.push_back(c);
+    mirror.push_back(m);
+    return size() - 1;
+}
+
+/*
+* Distance along r to plane i, or -INF if r is too close to parallel with it.
+* Like plane::shadowHit, shadow rays only count the plane from behind.
+*/
+static inline float planeDistance(const planeList &planes, uint32_t i, const ray &r, bool shadow)
+{
+    float denom = planes.nx[i]*r.direction.x + planes.ny[i]*r.direction.y + planes.nz[i]*r.direction.z;
+    bool parallel = shadow ? denom - COLLISION_EPS < COLLISION_EPS : fabs(denom - COLLISION_EPS) < COLLISION_EPS;
+
+    if (parallel) {
+        return -INF;
+    }
+
+    return (planes.nx[i] * (planes.px[i] - r.origin.x) +
+            planes.ny[i] * (planes.py[i] - r.origin.y) +
+            planes.nz[i] * (planes.pz[i] - r.origin.z)) / denom;
+}
+
+int planeList::hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const
+{
+    int closest = -1;
+
+    for (int k = 0; k < n; k++) {
+        uint32_t i = primIndex(ids[k]);
+        float t = planeDistance(*this, i, r, false);
+
+        if (t >= tmin && t <= tmax) {
+            tmax = t;
+            closest = i;
+        }
+    }
+
+    if (closest >= 0) {
+        record.t = tmax;
+        record.normal = vec3(nx[closest], ny[closest], nz[closest]);
+        record.colour = colour[closest];
+        record.mirror = mirror[closest];
+    }
+
+    return closest;
+}
+
+int planeList::occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const
+{
+    for (int k = 0; k < n; k++) {
+        uint32_t i = primIndex(ids[k]);
+        float t = planeDistance(*this, i, r, true);
+
+        if (t >= tmin && t <= tmax) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+laneMask planeList::hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    laneMask hitLanes = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        float t = planeDistance(*this, i, p.get(l), false);
+
+        if ((p.active & (1u << l)) && t >= tmin && t <= p.tmax[l]) {
+            p.tmax[l] = t;
+            records[l].t = t;
+            records[l].normal = vec3(nx[i], ny[i], nz[i]);
+            records[l].colour = colour[i];
+            records[l].mirror = mirror[i];
+            hitLanes |= 1u << l;
+        }
+    }
+
+    return hitLanes;
+}
+
+laneMask planeList::shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const
+{
+    laneMask blocked = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        float t = planeDistance(*this, i, p.get(l), true);
+        blocked |= (laneMask) (t >= tmin && t <= p.tmax[l]) << l;
+    }
+
+    return blocked & p.active;
+}
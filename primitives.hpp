@@ -0,0 +1,123 @@
+/*
+* primitives.hpp
+* Contains the arrays the scene compiles its geometry into: one per type of
+* primitive, stored as structure of arrays, each with routines that test a ray
+* against a batch of its primitives at once. The scene dispatches on type once
+* per run of same-typed primitives in a bvh leaf instead of making a virtual
+* call per primitive.
+*
+* Primitives are named by ids with their type in the top bits and their index
+* in the array for that type in the rest, so sorting ids groups them by type.
+*/
+
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <vector>
+#include <cstdint>
+#include "shape.hpp"
+
+enum primType : uint32_t
+{
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_PLANE,
+    PRIM_MESH,      // triangleMeshes added to the scene directly
+    PRIM_INSTANCE,  // instances that couldn't be turned into one of the above
+    PRIM_SHAPE,     // any other kind of shape, through its virtual functions
+    NUM_PRIM_TYPES
+};
+
+const int PRIM_TYPE_SHIFT = 28;
+const uint32_t PRIM_INDEX_MASK = (1u << PRIM_TYPE_SHIFT) - 1;
+const uint32_t NO_PRIM = 0xffffffffu;
+
+inline uint32_t makePrimId(primType type, uint32_t index) { return ((uint32_t) type << PRIM_TYPE_SHIFT) | index; }
+inline primType primTypeOf(uint32_t id) { return (primType) (id >> PRIM_TYPE_SHIFT); }
+inline uint32_t primIndex(uint32_t id) { return id & PRIM_INDEX_MASK; }
+
+/*
+* Call f(ids, n) for every run of ids with the same type in ids[0..count).
+* The ids must be sorted.
+*/
+template <typename F>
+inline void forEachRun(const uint32_t* ids, uint32_t count, F f)
+{
+    uint32_t start = 0;
+
+    for (uint32_t i = 1; i <= count; i++) {
+        if (i == count || primTypeOf(ids[i]) != primTypeOf(ids[start])) {
+            f(ids + start, i - start);
+            start = i;
+        }
+    }
+}
+
+/*
+* The batch routines below all work the same way. hit() finds the closest of
+* the primitives ids[0..n) hit by r before tmax; it shrinks tmax, fills in
+* record and returns the index of the primitive, or -1 on a miss. occluded()
+* returns the index of the first one found blocking r between tmin and tmax,
+* or -1. The packet routines test one primitive against every active lane.
+*/
+
+/*
+* World space spheres. Once packed, the spheres in each bvh leaf are next to
+* each other, and batches of them are tested SPHERE_BLOCK_SIZE at a time.
+*/
+struct sphereList
+{
+    std::vector<float> cx, cy, cz, radius2;  // padded once packed
+    std::vector<float> radius;
+    std::vector<rgb> colour;
+    std::vector<uint8_t> mirror;
+
+    uint32_t add(const vec3 &centre, float r, const rgb &c, bool m);
+    void pack(const std::vector<uint32_t> &order);
+    uint32_t size() const { return radius.size(); }
+    aabb bounds(uint32_t i) const;
+
+    int hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const;
+    int occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const;
+    laneMask hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const;
+};
+
+/* Single triangles (not part of a mesh) */
+struct triangleList
+{
+    std::vector<float> p0x, p0y, p0z;
+    std::vector<float> p1x, p1y, p1z;
+    std::vector<float> p2x, p2y, p2z;
+    std::vector<vec3> normal;
+    std::vector<rgb> colour;
+    std::vector<uint8_t> mirror;
+
+    uint32_t add(const vec3 &p0, const vec3 &p1, const vec3 &p2, const rgb &c, bool m);
+    uint32_t size() const { return p0x.size(); }
+    aabb bounds(uint32_t i) const;
+
+    int hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const;
+    int occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const;
+    laneMask hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const;
+};
+
+/* Planes, which are unbounded */
+struct planeList
+{
+    std::vector<float> px, py, pz;  // point on the plane
+    std::vector<float> nx, ny, nz;  // unit normal
+    std::vector<rgb> colour;
+    std::vector<uint8_t> mirror;
+
+    uint32_t add(const vec3 &pt, const vec3 &n, const rgb &c, bool m);
+    uint32_t size() const { return px.size(); }
+
+    int hit(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const;
+    int occluded(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const;
+    laneMask hitPacket(uint32_t i, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask shadowHitPacket(uint32_t i, const rayPacket &p, float tmin) const;
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+* rng.hpp
+* Counter based random numbers. Instead of a generator with hidden state like
+* drand48, every random number is a hash (Philox4x32-10) of where it's used:
+* (seed, pixel, sample index, dimension). Two runs with the same seed get
+* the same numbers in every pixel no matter which thread or tile order
+* renders it, and there's nothing to share or lock between threads. The hash
+* is straight line integer code, so compilers can vectorize loops over it.
+*/
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+/* Philox4x32 with 10 rounds: scrambles ctr using key, in place */
+inline void philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1)
+{
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0];
+        uint64_t p1 = (uint64_t) PHILOX_M1 * ctr[2];
+        uint32_t hi0 = (uint32_t) (p0 >> 32), lo0 = (uint32_t) p0;
+        uint32_t hi1 = (uint32_t) (p1 >> 32), lo1 = (uint32_t) p1;
+
+        ctr[0] = hi1 ^ ctr[1] ^ k0;
+        ctr[1] = lo1;
+        ctr[2] = hi0 ^ ctr[3] ^ k1;
+        ctr[3] = lo0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+/* Map the top 24 bits of x to a float in [0, 1) */
+inline float toUnitFloat(uint32_t x)
+{
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/* The number for (seed, pixel, sample, dimension) */
+inline uint32_t hashedUint(uint32_t seed, uint32_t pixel, uint32_t sampleIdx, uint32_t dimension)
+{
+    uint32_t ctr[4] = { sampleIdx, dimension, 0, 0 };
+    philox4x32(ctr, pixel, seed);
+    return ctr[0];
+}
+
+/* A cheap 32 bit hash (PCG output function), for mixing keys together */
+inline uint32_t pcgHash(uint32_t v)
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline uint32_t hashCombine(uint32_t a, uint32_t b)
+{
+    return pcgHash(a ^ (pcgHash(b) + 0x9E3779B9u + (a << 6) + (a >> 2)));
+}
+
+#endif
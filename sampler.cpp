@@ -0,0 +1,259 @@
+/*
+* sampler.cpp
+* Implements the samplers from sampler.hpp.
+*/
+
+#include <cmath>
+#include "sampler.hpp"
+
+/* ----- helpers ----- */
+
+/*
+* Return element i of a random permutation of [0, l) picked by p, without
+* storing the permutation (Kensler, "Correlated Multi-Jittered Sampling").
+*/
+static uint32_t permutationElement(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+
+    return (i + p) % l;
+}
+
+/* Keep samples strictly below 1 so they never land on the next pixel */
+static float belowOne(float x)
+{
+    return x < 0.99999994f ? x : 0.99999994f;
+}
+
+/* ----- randomSampler ----- */
+
+float randomSampler::get1D()
+{
+    return toUnitFloat(hashedUint(seed, pixel, sampleIdx, dim++));
+}
+
+vec2 randomSampler::get2D()
+{
+    uint32_t ctr[4] = { sampleIdx, dim, 0, 0 };
+    philox4x32(ctr, pixel, seed);
+    dim += 2;
+    return vec2(toUnitFloat(ctr[0]), toUnitFloat(ctr[1]));
+}
+
+/* ----- stratifiedSampler ----- */
+
+float stratifiedSampler::get1D()
+{
+    uint32_t key = hashCombine(hashCombine(seed, pixel), hashCombine(dim, sampleIdx / spp));
+    uint32_t stratum = permutationElement(sampleIdx % spp, spp, key);
+    float jitter = toUnitFloat(hashedUint(seed, pixel, sampleIdx, dim++));
+    return belowOne((stratum + jitter) / spp);
+}
+
+/*
+* Split the square into an nx by ny grid with at least spp cells and give each
+* sample its own cell. If spp is a perfect square every cell gets used.
+*/
+vec2 stratifiedSampler::get2D()
+{
+    uint32_t nx = (uint32_t) std::ceil(std::sqrt((float) spp));
+    uint32_t ny = (spp + nx - 1) / nx;
+    uint32_t key = hashCombine(hashCombine(seed, pixel), hashCombine(dim, sampleIdx / spp));
+    uint32_t cell = permutationElement(sampleIdx % spp, nx * ny, key);
+
+    uint32_t ctr[4] = { sampleIdx, dim, 0, 0 };
+    philox4x32(ctr, pixel, seed);
+    dim += 2;
+
+    return vec2(belowOne((cell % nx + toUnitFloat(ctr[0])) / nx),
+                belowOne((cell / nx + toUnitFloat(ctr[1])) / ny));
+}
+
+/* ----- haltonSampler ----- */
+
+static const int NUM_PRIMES = 48;
+static const uint32_t primes[NUM_PRIMES] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223
+};
+
+/* Mirror the base b digits of i around the decimal point */
+static float radicalInverse(uint32_t base, uint32_t i)
+{
+    float invBase = 1.0f / base;
+    float invBaseN = 1.0f;
+    uint32_t reversed = 0;
+
+    while (i) {
+        uint32_t next = i / base;
+        reversed = reversed * base + (i - next * base);
+        invBaseN *= invBase;
+        i = next;
+    }
+
+    return belowOne(reversed * invBaseN);
+}
+
+float haltonSampler::get1D()
+{
+    float x = radicalInverse(primes[dim % NUM_PRIMES], sampleIdx);
+    float offset = toUnitFloat(hashCombine(hashCombine(seed, pixel), dim));
+    dim++;
+
+    x += offset;
+    return belowOne(x >= 1.0f ? x - 1.0f : x);
+}
+
+vec2 haltonSampler::get2D()
+{
+    float x = get1D();
+    float y = get1D();
+    return vec2(x, y);
+}
+
+/* ----- sobolSampler ----- */
+
+static const int SOBOL_DIMS = 4;
+
+/*
+* Direction numbers for the first 4 Sobol dimensions, from the primitive
+* polynomials and initial numbers of Joe and Kuo.
+*/
+struct sobolTable
+{
+    uint32_t v[SOBOL_DIMS][32];
+
+    sobolTable()
+    {
+        const uint32_t s[SOBOL_DIMS] = { 0, 1, 2, 3 };  // polynomial degree
+        const uint32_t a[SOBOL_DIMS] = { 0, 0, 1, 1 };  // polynomial coefficients
+        const uint32_t m[SOBOL_DIMS][3] = { {0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1} };
+
+        // dimension 0 is the van der Corput sequence
+        for (int i = 0; i < 32; i++) {
+            v[0][i] = 1u << (31 - i);
+        }
+
+        for (int d = 1; d < SOBOL_DIMS; d++) {
+            for (uint32_t i = 0; i < s[d]; i++) {
+                v[d][i] = m[d][i] << (31 - i);
+            }
+
+            for (uint32_t i = s[d]; i < 32; i++) {
+                v[d][i] = v[d][i - s[d]] ^ (v[d][i - s[d]] >> s[d]);
+                for (uint32_t k = 1; k < s[d]; k++) {
+                    v[d][i] ^= ((a[d] >> (s[d] - 1 - k)) & 1) * v[d][i - k];
+                }
+            }
+        }
+    }
+};
+
+static const sobolTable sobolDirections;
+
+static uint32_t sobol(uint32_t index, int d)
+{
+    uint32_t x = 0;
+
+    for (int bit = 0; index; bit++, index >>= 1) {
+        if (index & 1) {
+            x ^= sobolDirections.v[d][bit];
+        }
+    }
+
+    return x;
+}
+
+static uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/* Hash based Owen scrambling (Laine and Karras, improved by Burley) */
+static uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+float sobolSampler::get1D()
+{
+    uint32_t group = dim / SOBOL_DIMS;
+    uint32_t pixelSeed = hashCombine(seed, pixel);
+    uint32_t index = owenScramble(sampleIdx, hashCombine(pixelSeed, group));
+    uint32_t x = owenScramble(sobol(index, dim % SOBOL_DIMS), hashCombine(pixelSeed, dim + 0x1000));
+    dim++;
+
+    return belowOne(toUnitFloat(x));
+}
+
+/* Take both dimensions from the same group so the pair is stratified in 2D */
+vec2 sobolSampler::get2D()
+{
+    if (dim % SOBOL_DIMS == SOBOL_DIMS - 1) {
+        dim++;
+    }
+
+    float x = get1D();
+    float y = get1D();
+    return vec2(x, y);
+}
+
+/* ----- factory ----- */
+
+sampler* createSampler(const std::string &name, int spp, uint32_t seed)
+{
+    if (name == "random") {
+        return new randomSampler(spp, seed);
+    }
+
+    else if (name == "stratified") {
+        return new stratifiedSampler(spp, seed);
+    }
+
+    else if (name == "halton") {
+        return new haltonSampler(spp, seed);
+    }
+
+    else if (name == "sobol") {
+        return new sobolSampler(spp, seed);
+    }
+
+    return nullptr;
+}
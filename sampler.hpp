@@ -0,0 +1,93 @@
+/*
+* sampler.hpp
+* Contains the sampler interface and the samplers that implement it.
+* A sampler hands out the numbers for one sample of one pixel, one dimension at
+* a time: dimensions 0 and 1 pick the point in the pixel, and each bounce of the
+* ray gets its own block of DIMS_PER_BOUNCE dimensions after that (for picking
+* lights etc.), so the same dimension always means the same thing.
+* Every sampler is a pure function of (seed, pixel, sample index, dimension),
+* so it gives the same image at any thread count.
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <string>
+#include "vec.hpp"
+#include "rng.hpp"
+
+const int PIXEL_DIMS = 2;       // dimensions used to pick the point in the pixel
+const int DIMS_PER_BOUNCE = 4;  // dimensions reserved for each bounce
+
+struct sampler
+{
+    int spp;             // samples per pixel the sampler is stratifying over
+    uint32_t seed;
+    uint32_t pixel = 0;
+    uint32_t sampleIdx = 0;
+    uint32_t dim = 0;    // next dimension to hand out
+
+    sampler(int spp_, uint32_t seed_) : spp(spp_), seed(seed_) {}
+    virtual ~sampler() {}
+
+    void startPixelSample(uint32_t pixel_, uint32_t sampleIdx_)
+    {
+        pixel = pixel_;
+        sampleIdx = sampleIdx_;
+        dim = 0;
+    }
+
+    void startBounce(int bounce) { dim = PIXEL_DIMS + bounce * DIMS_PER_BOUNCE; }
+
+    /* Point in the pixel, in [0,1)^2 */
+    vec2 getPixel2D()
+    {
+        dim = 0;
+        return get2D();
+    }
+
+    virtual float get1D() = 0;
+    virtual vec2 get2D() = 0;
+};
+
+/* Independent random numbers, what we had before */
+struct randomSampler : sampler
+{
+    randomSampler(int spp_, uint32_t seed_) : sampler(spp_, seed_) {}
+    float get1D();
+    vec2 get2D();
+};
+
+/* Jittered strata, with the strata shuffled differently in every dimension */
+struct stratifiedSampler : sampler
+{
+    stratifiedSampler(int spp_, uint32_t seed_) : sampler(spp_, seed_) {}
+    float get1D();
+    vec2 get2D();
+};
+
+/* The Halton sequence, randomly rotated (Cranley-Patterson) in every pixel */
+struct haltonSampler : sampler
+{
+    haltonSampler(int spp_, uint32_t seed_) : sampler(spp_, seed_) {}
+    float get1D();
+    vec2 get2D();
+};
+
+/*
+* Owen scrambled Sobol points (Burley 2020). Dimensions are handed out in
+* groups of 4 Sobol dimensions, with the sample order shuffled per group so the
+* groups aren't correlated with each other.
+*/
+struct sobolSampler : sampler
+{
+    sobolSampler(int spp_, uint32_t seed_) : sampler(spp_, seed_) {}
+    float get1D();
+    vec2 get2D();
+};
+
+/* Make the sampler called name ("random", "stratified", "halton" or "sobol"), or nullptr */
+sampler* createSampler(const std::string &name, int spp, uint32_t seed);
+
+#endif
@@ -0,0 +1,634 @@
+/*
+* scene.cpp
+* Implements building and intersecting the scene from scene.hpp.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include "scene.hpp"
+
+// shadow packets with this few lanes left go one ray at a time
+const int SHADOW_PACKET_MIN_LANES = 2;
+
+// most primitives the top level bvh puts in a leaf
+const int TOP_LEAF_SIZE = 4;
+
+/* Add a shape to the scene. */
+void scene::add(shape* s)
+{
+    shapes.push_back(s);
+}
+
+/* Add a copy of prototype moved by transform (which must be affine) to the scene. */
+void scene::addInstance(const tmat &transform, shape* prototype, bool mirror)
+{
+    // scenes only have a handful of prototypes, and usually add the same one many times in a row
+    auto found = std::find(prototypes.rbegin(), prototypes.rend(), prototype);
+    uint32_t index = found.base() - prototypes.begin() - 1;
+
+    if (found == prototypes.rend()) {
+        index = prototypes.size();
+        prototypes.push_back(prototype);
+    }
+
+    instanceRecord inst;
+    inst.toWorld = affineMat(transform);
+    inst.toLocal = affineMat(inverse(transform));
+    inst.prototype = index;
+    inst.mirror = mirror;
+    instances.push_back(inst);
+}
+
+/*
+* The uniform scale of an affine transform with no shear or non-uniform scaling,
+* i.e. one that maps spheres to spheres. Returns 0 for any other transform.
+*/
+static float similarityScale(const affineMat &mat)
+{
+    vec3 c0(mat.m[0][0], mat.m[1][0], mat.m[2][0]);
+    vec3 c1(mat.m[0][1], mat.m[1][1], mat.m[2][1]);
+    vec3 c2(mat.m[0][2], mat.m[1][2], mat.m[2][2]);
+    float s2 = lengthSquared(c0);
+    float eps = 1e-5f * s2;
+
+    bool similar = std::fabs(lengthSquared(c1) - s2) <= eps && std::fabs(lengthSquared(c2) - s2) <= eps &&
+                   std::fabs(dot(c0, c1)) <= eps && std::fabs(dot(c1, c2)) <= eps && std::fabs(dot(c0, c2)) <= eps;
+
+    return similar ? std::sqrt(s2) : 0.0f;
+}
+
+/*
+* Compile everything that was added into the primitive arrays, and build the top
+* level tree over the bounded ones. Instances of spheres that are only moved,
+* rotated and uniformly scaled become world space spheres. The tree is built
+* with the given method, in parallel if there's a pool.
+*/
+void scene::build(bvhBuildMethod method, threadPool* pool)
+{
+    std::vector<uint32_t> ids;
+    int numBaked = 0;
+
+    for (auto s : shapes) {
+        if (const sphere* sp = dynamic_cast<const sphere*>(s)) {
+            ids.push_back(makePrimId(PRIM_SPHERE, spheres.add(sp->centre, sp->radius, sp->colour, sp->mirror)));
+        }
+
+        else if (const triangle* tri = dynamic_cast<const triangle*>(s)) {
+            ids.push_back(makePrimId(PRIM_TRIANGLE, triangles.add(tri->p0, tri->p1, tri->p2, tri->colour, tri->mirror)));
+        }
+
+        else if (const plane* pl = dynamic_cast<const plane*>(s)) {
+            ids.push_back(makePrimId(PRIM_PLANE, planes.add(pl->pt, pl->n, pl->colour, pl->mirror)));
+        }
+
+        else if (const triangleMesh* m = dynamic_cast<const triangleMesh*>(s)) {
+            ids.push_back(makePrimId(PRIM_MESH, meshes.size()));
+            meshes.push_back(m);
+        }
+
+        else {
+            ids.push_back(makePrimId(PRIM_SHAPE, others.size()));
+            others.push_back(s);
+        }
+    }
+
+    prototypeTypes.clear();
+    for (auto p : prototypes) {
+        prototypeTypes.push_back(dynamic_cast<const sphere*>(p) ? PRIM_SPHERE :
+                                 dynamic_cast<const triangleMesh*>(p) ? PRIM_MESH : PRIM_SHAPE);
+    }
+
+    // bake what instances we can, and pack the rest down
+    uint32_t kept = 0;
+    for (size_t i = 0; i < instances.size(); i++) {
+        const instanceRecord &inst = instances[i];
+        float s = prototypeTypes[inst.prototype] == PRIM_SPHERE ? similarityScale(inst.toWorld) : 0.0f;
+
+        if (s > 0.0f) {
+            const sphere* sp = static_cast<const sphere*>(prototypes[inst.prototype]);
+            ids.push_back(makePrimId(PRIM_SPHERE, spheres.add(transformPt(inst.toWorld, sp->centre),
+                                                              sp->radius * s, sp->colour, inst.mirror)));
+            numBaked++;
+        }
+
+        else {
+            ids.push_back(makePrimId(PRIM_INSTANCE, kept));
+            instances[kept++] = inst;
+        }
+    }
+    instances.resize(kept);
+
+    std::vector<aabb> boxes;
+    std::vector<uint32_t> bounded;
+    unbounded.clear();
+
+    for (auto id : ids) {
+        aabb b = primBounds(id);
+
+        if (b.bounded()) {
+            bounded.push_back(id);
+            boxes.push_back(b);
+        }
+
+        else {
+            unbounded.push_back(id);
+        }
+    }
+
+    bvhBuildOptions options;
+    options.maxLeafSize = TOP_LEAF_SIZE;
+    options.method = method;
+    options.pool = pool;
+
+    auto start = std::chrono::steady_clock::now();
+    top.build(boxes, options);
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // make the leaves refer to ids directly, sorted so each one is a few runs of one type
+    for (auto &i : top.indices) {
+        i = bounded[i];
+    }
+
+    for (const bvhNode &node : top.nodes) {
+        if (node.count > 0) {
+            std::sort(top.indices.begin() + node.offset, top.indices.begin() + node.offset + node.count);
+        }
+    }
+
+    std::sort(unbounded.begin(), unbounded.end());
+
+    // renumber the spheres in leaf order, so the ones in a leaf can be tested as a block
+    std::vector<uint32_t> order;
+    for (auto &id : top.indices) {
+        if (primTypeOf(id) == PRIM_SPHERE) {
+            order.push_back(primIndex(id));
+            id = makePrimId(PRIM_SPHERE, order.size() - 1);
+        }
+    }
+    spheres.pack(order);
+
+    std::cout << "Built scene bvh: " << bounded.size() << " bounded, " << unbounded.size() << " unbounded, "
+              << top.nodes.size() << " nodes. " << spheres.size() << " spheres (" << numBaked << " from instances), "
+              << triangles.size() << " triangles, " << planes.size() << " planes, " << meshes.size() << " meshes, "
+              << instances.size() << " instances of " << prototypes.size() << " prototypes ("
+              << instances.size() * sizeof(instanceRecord) / 1024 << " KB), " << others.size() << " other shapes.\n";
+    std::cout << "Top level bvh: " << (method == BVH_LBVH ? "LBVH" : "SAH") << " builder, " << buildMs
+              << " ms, SAH cost " << top.sahCost() << ".\n";
+}
+
+/* Number of primitives in the scene, once it's been built */
+size_t scene::size() const
+{
+    return spheres.size() + triangles.size() + planes.size() + meshes.size() + instances.size() + others.size();
+}
+
+/* World space bounds of the primitive with the given id */
+aabb scene::primBounds(uint32_t id) const
+{
+    uint32_t i = primIndex(id);
+
+    switch (primTypeOf(id)) {
+    case PRIM_SPHERE:
+        return spheres.bounds(i);
+
+    case PRIM_TRIANGLE:
+        return triangles.bounds(i);
+
+    case PRIM_MESH:
+        return meshes[i]->triangleMesh::bounds();
+
+    case PRIM_INSTANCE:
+        return transformBox(instances[i].toWorld, prototypes[instances[i].prototype]->bounds());
+
+    case PRIM_SHAPE:
+        return others[i]->bounds();
+
+    default:
+        return aabb(vec3(-INF), vec3(INF));
+    }
+}
+
+/* ----- prototypes ----- */
+
+/*
+* Calls on the prototype of an instance. Meshes and spheres, the usual
+* prototypes, are called directly instead of through the vtable.
+*/
+bool scene::prototypeHit(uint32_t k, const ray &r, float tmin, float tmax, hitRecord &record) const
+{
+    switch (prototypeTypes[k]) {
+    case PRIM_MESH:
+        return static_cast<const triangleMesh*>(prototypes[k])->triangleMesh::hit(r, tmin, tmax, 0, record);
+
+    case PRIM_SPHERE:
+        return static_cast<const sphere*>(prototypes[k])->sphere::hit(r, tmin, tmax, 0, record);
+
+    default:
+        return prototypes[k]->hit(r, tmin, tmax, 0, record);
+    }
+}
+
+bool scene::prototypeShadowHit(uint32_t k, const ray &r, float tmin, float tmax) const
+{
+    switch (prototypeTypes[k]) {
+    case PRIM_MESH:
+        return static_cast<const triangleMesh*>(prototypes[k])->triangleMesh::shadowHit(r, tmin, tmax, 0);
+
+    case PRIM_SPHERE:
+        return static_cast<const sphere*>(prototypes[k])->sphere::shadowHit(r, tmin, tmax, 0);
+
+    default:
+        return prototypes[k]->shadowHit(r, tmin, tmax, 0);
+    }
+}
+
+laneMask scene::prototypeHitPacket(uint32_t k, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    switch (prototypeTypes[k]) {
+    case PRIM_MESH:
+        return static_cast<const triangleMesh*>(prototypes[k])->triangleMesh::hitPacket(p, tmin, 0, records);
+
+    case PRIM_SPHERE:
+        return static_cast<const sphere*>(prototypes[k])->sphere::hitPacket(p, tmin, 0, records);
+
+    default:
+        return prototypes[k]->hitPacket(p, tmin, 0, records);
+    }
+}
+
+laneMask scene::prototypeShadowHitPacket(uint32_t k, const rayPacket &p, float tmin) const
+{
+    switch (prototypeTypes[k]) {
+    case PRIM_MESH:
+        return static_cast<const triangleMesh*>(prototypes[k])->triangleMesh::shadowHitPacket(p, tmin, 0);
+
+    default:
+        return prototypes[k]->shadowHitPacket(p, tmin, 0);
+    }
+}
+
+/* ----- runs of primitives ----- */
+
+/*
+* Find the closest hit among ids[0..n), which all have the same type, and shrink
+* tmax to it. Instances transform r into local space, hit their prototype, and
+* transform the hit data back.
+*/
+bool scene::hitRun(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const
+{
+    bool hitSomething = false;
+
+    switch (primTypeOf(ids[0])) {
+    case PRIM_SPHERE:
+        return spheres.hit(ids, n, r, tmin, tmax, record) >= 0;
+
+    case PRIM_TRIANGLE:
+        return triangles.hit(ids, n, r, tmin, tmax, record) >= 0;
+
+    case PRIM_PLANE:
+        return planes.hit(ids, n, r, tmin, tmax, record) >= 0;
+
+    case PRIM_MESH:
+        for (int k = 0; k < n; k++) {
+            const triangleMesh* m = meshes[primIndex(ids[k])];
+            if (m->triangleMesh::hit(r, tmin, tmax, 0, record)) {
+                tmax = record.t;
+                record.mirror = m->mirror;
+                hitSomething = true;
+            }
+        }
+        return hitSomething;
+
+    case PRIM_INSTANCE:
+        for (int k = 0; k < n; k++) {
+            const instanceRecord &inst = instances[primIndex(ids[k])];
+            if (prototypeHit(inst.prototype, inst.toLocal * r, tmin, tmax, record)) {
+                tmax = record.t;
+                record.pointOnSurface = transformPt(inst.toWorld, record.pointOnSurface);
+                record.normal = makeUnitVector(transformNormal(inst.toLocal, record.normal));
+                record.mirror = inst.mirror;
+                hitSomething = true;
+            }
+        }
+        return hitSomething;
+
+    default:
+        for (int k = 0; k < n; k++) {
+            const shape* s = others[primIndex(ids[k])];
+            if (s->hit(r, tmin, tmax, 0, record)) {
+                tmax = record.t;
+                record.mirror = s->mirror;
+                hitSomething = true;
+            }
+        }
+        return hitSomething;
+    }
+}
+
+/* Return the id of the first of ids[0..n) found blocking r between tmin and tmax, or NO_PRIM */
+uint32_t scene::occludedRun(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const
+{
+    primType type = primTypeOf(ids[0]);
+    int found = -1;
+
+    switch (type) {
+    case PRIM_SPHERE:
+        found = spheres.occluded(ids, n, r, tmin, tmax);
+        break;
+
+    case PRIM_TRIANGLE:
+        found = triangles.occluded(ids, n, r, tmin, tmax);
+        break;
+
+    case PRIM_PLANE:
+        found = planes.occluded(ids, n, r, tmin, tmax);
+        break;
+
+    case PRIM_MESH:
+        for (int k = 0; k < n && found < 0; k++) {
+            if (meshes[primIndex(ids[k])]->triangleMesh::shadowHit(r, tmin, tmax, 0)) {
+                found = primIndex(ids[k]);
+            }
+        }
+        break;
+
+    case PRIM_INSTANCE:
+        for (int k = 0; k < n && found < 0; k++) {
+            const instanceRecord &inst = instances[primIndex(ids[k])];
+            if (prototypeShadowHit(inst.prototype, inst.toLocal * r, tmin, tmax)) {
+                found = primIndex(ids[k]);
+            }
+        }
+        break;
+
+    default:
+        for (int k = 0; k < n && found < 0; k++) {
+            if (others[primIndex(ids[k])]->shadowHit(r, tmin, tmax, 0)) {
+                found = primIndex(ids[k]);
+            }
+        }
+        break;
+    }
+
+    return found < 0 ? NO_PRIM : makePrimId(type, found);
+}
+
+/* Intersect one primitive with every active lane of p */
+laneMask scene::primHitPacket(uint32_t id, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    uint32_t i = primIndex(id);
+    laneMask hitLanes = 0;
+
+    switch (primTypeOf(id)) {
+    case PRIM_SPHERE:
+        return spheres.hitPacket(i, p, tmin, records);
+
+    case PRIM_TRIANGLE:
+        return triangles.hitPacket(i, p, tmin, records);
+
+    case PRIM_PLANE:
+        return planes.hitPacket(i, p, tmin, records);
+
+    case PRIM_MESH:
+        hitLanes = meshes[i]->triangleMesh::hitPacket(p, tmin, 0, records);
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (hitLanes & (1u << l)) {
+                records[l].mirror = meshes[i]->mirror;
+            }
+        }
+        return hitLanes;
+
+    case PRIM_INSTANCE: {
+        const instanceRecord &inst = instances[i];
+        rayPacket local;
+        transformPacket(inst.toLocal, p, local);
+        hitLanes = prototypeHitPacket(inst.prototype, local, tmin, records);
+
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (hitLanes & (1u << l)) {
+                p.tmax[l] = local.tmax[l];
+                records[l].pointOnSurface = transformPt(inst.toWorld, records[l].pointOnSurface);
+                records[l].normal = makeUnitVector(transformNormal(inst.toLocal, records[l].normal));
+                records[l].mirror = inst.mirror;
+            }
+        }
+        return hitLanes;
+    }
+
+    default:
+        hitLanes = others[i]->hitPacket(p, tmin, 0, records);
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (hitLanes & (1u << l)) {
+                records[l].mirror = others[i]->mirror;
+            }
+        }
+        return hitLanes;
+    }
+}
+
+/* Return the active lanes of p that one primitive blocks */
+laneMask scene::primShadowHitPacket(uint32_t id, const rayPacket &p, float tmin) const
+{
+    uint32_t i = primIndex(id);
+
+    switch (primTypeOf(id)) {
+    case PRIM_SPHERE:
+        return spheres.shadowHitPacket(i, p, tmin);
+
+    case PRIM_TRIANGLE:
+        return triangles.shadowHitPacket(i, p, tmin);
+
+    case PRIM_PLANE:
+        return planes.shadowHitPacket(i, p, tmin);
+
+    case PRIM_MESH:
+        return meshes[i]->triangleMesh::shadowHitPacket(p, tmin, 0);
+
+    case PRIM_INSTANCE: {
+        rayPacket local;
+        transformPacket(instances[i].toLocal, p, local);
+        return prototypeShadowHitPacket(instances[i].prototype, local, tmin);
+    }
+
+    default:
+        return others[i]->shadowHitPacket(p, tmin, 0);
+    }
+}
+
+/* ----- whole scene ----- */
+
+/* Find the closest thing hit by r, if one exists, and fill in record. */
+bool scene::hit(const ray &r, float tmin, float tmax, hitRecord &record) const
+{
+    bool hitSomething = false;
+
+    forEachRun(unbounded.data(), unbounded.size(), [&](const uint32_t* ids, int n) {
+        hitSomething |= hitRun(ids, n, r, tmin, tmax, record);
+    });
+
+    top.traverse(r, tmin, tmax, [&](const bvhNode &leaf, float &tclosest) {
+        bool hitLeaf = false;
+        forEachRun(&top.indices[leaf.offset], leaf.count, [&](const uint32_t* ids, int n) {
+            hitLeaf |= hitRun(ids, n, r, tmin, tclosest, record);
+        });
+        hitSomething |= hitLeaf;
+        return hitLeaf;
+    });
+
+    return hitSomething;
+}
+
+/* Return true if anything in the scene blocks r between tmin and tmax */
+bool scene::shadowHit(const ray &r, float tmin, float tmax) const
+{
+    uint32_t occluder = NO_PRIM;
+    return shadowHit(r, tmin, tmax, occluder);
+}
+
+/*
+* Same as above, but the id in occluder is tested first if it's set (e.g. from
+* an occluderCache). When something else blocks r, occluder is set to its id.
+*/
+bool scene::shadowHit(const ray &r, float tmin, float tmax, uint32_t &occluder) const
+{
+    if (occluder != NO_PRIM && occludedRun(&occluder, 1, r, tmin, tmax) != NO_PRIM) {
+        return true;
+    }
+
+    uint32_t found = findOccluder(r, tmin, tmax);
+    if (found != NO_PRIM) {
+        occluder = found;
+    }
+
+    return found != NO_PRIM;
+}
+
+/* Return the id of the first thing found blocking r between tmin and tmax, or NO_PRIM */
+uint32_t scene::findOccluder(const ray &r, float tmin, float tmax) const
+{
+    uint32_t found = NO_PRIM;
+
+    forEachRun(unbounded.data(), unbounded.size(), [&](const uint32_t* ids, int n) {
+        if (found == NO_PRIM) {
+            found = occludedRun(ids, n, r, tmin, tmax);
+        }
+    });
+
+    if (found != NO_PRIM) {
+        return found;
+    }
+
+    top.traverseAny(r, tmin, tmax, [&](const bvhNode &leaf, float tfar) {
+        forEachRun(&top.indices[leaf.offset], leaf.count, [&](const uint32_t* ids, int n) {
+            if (found == NO_PRIM) {
+                found = occludedRun(ids, n, r, tmin, tfar);
+            }
+        });
+        return found != NO_PRIM;
+    });
+
+    return found;
+}
+
+/* Find the closest thing hit by every lane of p. Returns the lanes that hit something. */
+laneMask scene::hitPacket(rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const
+{
+    laneMask hitLanes = 0;
+
+    for (auto id : unbounded) {
+        hitLanes |= primHitPacket(id, p, tmin, records);
+    }
+
+    laneMask active = p.active;
+
+    // only the lanes that reached a leaf need to test it, but the rest of the
+    // traversal still needs all of them
+    hitLanes |= top.traversePacket(p, tmin, [&](const bvhNode &leaf, laneMask lanes) {
+        laneMask m = 0;
+        p.active = lanes;
+        for (uint32_t i = 0; i < leaf.count; i++) {
+            m |= primHitPacket(top.indices[leaf.offset + i], p, tmin, records);
+        }
+        p.active = active;
+        return m;
+    });
+
+    return hitLanes;
+}
+
+/*
+* Shadow rays for every active lane of p, e.g. from one point towards several
+* lights. With packetShadows set, the packet goes through the top level bvh
+* once, and lanes drop out as soon as something blocks them; otherwise each lane
+* is traced on its own. Returns the blocked lanes. As in shadowHit,
+* occluders[l] is tested first for lane l if it's set, and is set to whatever
+* else blocks lane l. Only the entries for active lanes are touched.
+*/
+laneMask scene::shadowPacket(rayPacket &p, float tmin, uint32_t occluders[]) const
+{
+    laneMask active = p.active;
+    laneMask blocked = 0;
+
+    // record the new occluders of the lanes in m
+    auto blockedBy = [&](uint32_t id, laneMask m) {
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (m & (1u << l)) {
+                occluders[l] = id;
+            }
+        }
+        blocked |= m;
+    };
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if ((active & (1u << l)) && occluders[l] != NO_PRIM &&
+            occludedRun(&occluders[l], 1, p.get(l), tmin, p.tmax[l]) != NO_PRIM) {
+            blocked |= 1u << l;
+        }
+    }
+
+    p.active = active & ~blocked;
+
+    // shadow rays from one point towards different lights hardly share any nodes, so
+    // unless packetShadows is set they're cheaper to trace one at a time. So are a lane or two on their own.
+    if (!packetShadows || __builtin_popcount(p.active) <= SHADOW_PACKET_MIN_LANES) {
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            uint32_t found = (p.active & (1u << l)) ? findOccluder(p.get(l), tmin, p.tmax[l]) : NO_PRIM;
+            if (found != NO_PRIM) {
+                blockedBy(found, 1u << l);
+            }
+        }
+
+        p.active = active;
+        return blocked;
+    }
+
+    for (auto id : unbounded) {
+        p.active = active & ~blocked;
+        if (p.active) {
+            blockedBy(id, primShadowHitPacket(id, p, tmin));
+        }
+    }
+
+    p.active = active & ~blocked;
+
+    if (p.active) {
+        top.traversePacket(p, tmin, [&](const bvhNode &leaf, laneMask lanes) {
+            laneMask remaining = p.active;
+            laneMask m = 0;
+
+            for (uint32_t i = 0; i < leaf.count && (lanes & ~m); i++) {
+                uint32_t id = top.indices[leaf.offset + i];
+                p.active = lanes & ~m;
+                laneMask b = primShadowHitPacket(id, p, tmin);
+                blockedBy(id, b);
+                m |= b;
+            }
+
+            p.active = remaining & ~m;
+            return m;
+        });
+    }
+
+    p.active = active;
+    return blocked;
+}
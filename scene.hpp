@@ -0,0 +1,92 @@
+/*
+* scene.hpp
+* Contains the scene struct, which owns the top level of the two level
+* acceleration structure. build() compiles the shapes and instances that were
+* added into one array per type of primitive (see primitives.hpp). Bounded
+* primitives go in a bvh over their world space bounds, and unbounded ones
+* (planes) are tested against every ray. The bottom level is whatever the shape
+* being instanced uses, e.g. the kd-tree inside a triangleMesh, so instances of
+* the same mesh share one tree.
+*/
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <cstdint>
+#include "shape.hpp"
+#include "bvh.hpp"
+#include "primitives.hpp"
+
+/*
+* A copy of a prototype shape moved into the scene by an affine transform.
+* Instances aren't shapes: they live in one array in the scene, 104 bytes each
+* with no vtable, so a scene can hold millions of them. The normal matrix is
+* the transpose of toLocal, see transformNormal().
+*/
+struct instanceRecord
+{
+    affineMat toWorld;   // local to world space
+    affineMat toLocal;   // world to local space, the inverse of toWorld
+    uint32_t prototype;  // index into scene::prototypes
+    bool mirror;
+};
+
+/*
+* The id of the primitive that last blocked a shadow ray towards each light.
+* Shadow rays from nearby points towards the same light are usually blocked by
+* the same thing, so it gets tested before searching the whole scene. Each
+* thread has its own.
+*/
+struct occluderCache
+{
+    std::vector<uint32_t> lastOccluder;  // indexed by light, NO_PRIM if none yet
+
+    occluderCache(size_t numLights = 0) : lastOccluder(numLights, NO_PRIM) {}
+};
+
+struct scene
+{
+    std::vector<shape*> shapes;              // shapes added to the scene, in order
+    std::vector<shape*> prototypes;          // shapes that instances refer to
+    std::vector<primType> prototypeTypes;    // PRIM_SPHERE, PRIM_MESH or PRIM_SHAPE for each prototype
+    std::vector<instanceRecord> instances;   // after build(), only the ones that stayed instances
+
+    // the primitives build() compiled everything into
+    sphereList spheres;
+    triangleList triangles;
+    planeList planes;
+    std::vector<const triangleMesh*> meshes;
+    std::vector<const shape*> others;        // shapes of any other type
+
+    std::vector<uint32_t> unbounded;         // ids that are always tested, sorted
+    bvh top;                                 // top level tree, its leaves hold sorted ids
+    bool packetShadows = false;              // trace shadowPacket's lanes through the tree together, not one by one
+
+    void add(shape* s);
+    void addInstance(const tmat &transform, shape* prototype, bool mirror = false);
+    void build(bvhBuildMethod method = BVH_SAH, threadPool* pool = nullptr);
+    size_t size() const;
+
+    bool hit(const ray &r, float tmin, float tmax, hitRecord &record) const;
+    bool shadowHit(const ray &r, float tmin, float tmax) const;
+    bool shadowHit(const ray &r, float tmin, float tmax, uint32_t &occluder) const;
+    uint32_t findOccluder(const ray &r, float tmin, float tmax) const;
+    laneMask hitPacket(rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask shadowPacket(rayPacket &p, float tmin, uint32_t occluders[]) const;
+
+    // the same for runs of primitives with the same type, or single primitives
+    aabb primBounds(uint32_t id) const;
+    bool hitRun(const uint32_t* ids, int n, const ray &r, float tmin, float &tmax, hitRecord &record) const;
+    uint32_t occludedRun(const uint32_t* ids, int n, const ray &r, float tmin, float tmax) const;
+    laneMask primHitPacket(uint32_t id, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask primShadowHitPacket(uint32_t id, const rayPacket &p, float tmin) const;
+
+    // and for prototypes, with rays already in their local space
+    bool prototypeHit(uint32_t k, const ray &r, float tmin, float tmax, hitRecord &record) const;
+    bool prototypeShadowHit(uint32_t k, const ray &r, float tmin, float tmax) const;
+    laneMask prototypeHitPacket(uint32_t k, rayPacket &p, float tmin, hitRecord records[PACKET_SIZE]) const;
+    laneMask prototypeShadowHitPacket(uint32_t k, const rayPacket &p, float tmin) const;
+};
+
+#endif
@@ -4,51 +4,45 @@
 * That includes constructors, hit functions output, etc.
 */
 
+#include <chrono>
 #include "shape.hpp"
-#define COLLISION_EPS 0.0001f
 
-/* ----- instance ----- */
-instance::instance(shape *s_) :
-s(s_)
-{
-}
-
-instance::instance(tmat transform_, tmat inverse_, shape* s_) :
-transform(transform_), inverseTransform(inverse_), s(s_)
-{}
+/* ----- shape ----- */
 
-instance::instance(tmat transform_, shape* s_) :
-transform(transform_), s(s_)
+/* Shapes that don't override bounds() (e.g. planes) go everywhere */
+aabb shape::bounds() const
 {
-    inverseTransform = inverse(transform);
+    return aabb(vec3(-INF), vec3(INF));
 }
 
-/* Transform a ray into local coordinates, call hit for the shape, and then
-* transform the hit data back.
-*/
-bool instance::hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const
+/* Intersect the lanes of p one at a time with hit() */
+laneMask shape::hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const
 {
-    //std::cout << "r: " << r << "\n";
-    //std::cout << "inverse:\n " << inverseTransform << "\n";
-    ray tr = inverseTransform * r; // note defn of tmat * ray in matrix.cpp
-    //std::cout << "tr: " << tr << "\n";
+    laneMask hitLanes = 0;
 
-    if (s->hit(tr, tmin, tmax, time, record)) {
-        record.pointOnSurface = transformPt(transform, record.pointOnSurface);
-        record.normal = makeUnitVector(vec3(transformVec(inverseTransform.transpose(), record.normal)));
-        return true;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if ((p.active & (1u << l)) && hit(p.get(l), tmin, p.tmax[l], time, records[l])) {
+            p.tmax[l] = records[l].t;
+            hitLanes |= 1u << l;
+        }
     }
 
-    return false;
+    return hitLanes;
 }
 
-bool instance::shadowHit(const ray &r, float tmin, float tmax, float time) const
+/* Test the lanes of p one at a time with shadowHit() */
+laneMask shape::shadowHitPacket(const rayPacket &p, float tmin, float time) const
 {
-    ray tr = inverseTransform * r;
-    return(s->shadowHit(tr, tmin, tmax, time));
-    return false;
-}
+    laneMask blocked = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if ((p.active & (1u << l)) && shadowHit(p.get(l), tmin, p.tmax[l], time)) {
+            blocked |= 1u << l;
+        }
+    }
 
+    return blocked;
+}
 
 /* ----- triangle ----- */ 
 
@@ -185,6 +179,33 @@ bool triangle::shadowHit(const ray &r, float tmin, float tmax, float time) const
     return (tval >= tmin && tval <= tmax);
 }
 
+laneMask triangle::hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const
+{
+    float tval[PACKET_SIZE], beta[PACKET_SIZE], gamma[PACKET_SIZE];
+    laneMask hitLanes = hitTrianglePacket(p, p0, p1, p2, tmin, tval, beta, gamma);
+    vec3 normal = makeUnitVector(cross((p1-p0), (p2-p0)));
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (hitLanes & (1u << l)) {
+            p.tmax[l] = tval[l];
+            records[l].t = tval[l];
+            records[l].normal = normal;
+            records[l].colour = colour;
+        }
+    }
+
+    return hitLanes;
+}
+
+aabb triangle::bounds() const
+{
+    aabb b;
+    b.extend(p0);
+    b.extend(p1);
+    b.extend(p2);
+    return b;
+}
+
 std::ostream &operator <<(std::ostream &out, const triangle &toString)
 {
     out << "([" << toString.p0 << "], [" << toString.p1 << "], [" << toString.p2 << "], colour: [" << toString.colour << "])";
@@ -195,199 +216,576 @@ std::ostream &operator <<(std::ostream &out, const triangle &toString)
 
 
 /*
-* Read in a mesh file and initialize a triangleMesh using it.
+* Load a mesh file through meshLibrary and initialize a triangleMesh using it.
 * 1st 4B of file: # vertices
 * 2nd 4B of file: # triangles
 * Next # vertices * sizeof(meshVertex) B: vertex data
 * Next # triangles * sizeof(meshTriangle) B: triangle data
+* If compressed_ is true, the vertices are kept quantized (see storeVertices).
+* If verifyCache is true, a .mesh.accel is only used if it was built from a
+* mesh with the same contents, not just the same size and modification time.
+* If the file can't be loaded, the error is reported, the mesh is left empty
+* and loaded() is false.
 */
-    triangleMesh::triangleMesh(std::string fname, const rgb &colour_) :
+triangleMesh::triangleMesh(std::string fname, const rgb &colour_, bool compressed_, threadPool* pool, bool verifyCache) :
 colour(colour_)
 {
     std::cout << "Loading mesh file '" << fname << "'...\n";
-    FILE* meshFile = fopen(fname.c_str(), "rb");
-    if (!meshFile) {
-        std::cerr << "Could not open '" << fname << "'.\n";
-        exit(-1);
+    geometry = meshGeometry::open(fname, compressed_, pool, verifyCache);
+}
+
+std::shared_ptr<const meshGeometry> meshGeometry::open(const std::string &fname, bool compressed, threadPool* pool,
+                                                       bool verifyCache)
+{
+    static std::vector<std::weak_ptr<const meshGeometry>> loaded;  // every geometry still in use by some mesh
+
+    std::string error;
+    std::shared_ptr<const meshFile> mapped = meshLibrary::shared().open(fname, error);
+    if (!mapped) {
+        std::cerr << "ERROR: Could not load mesh file '" << fname << "': " << error << "\n";
+        return nullptr;
     }
 
-    // Read in the number of vertices and then the number of triangles
-    if (fread(&nv, 4, 1, meshFile) < 1) {
-        std::cerr << "ERROR: Could not load mesh file. \n";
-        exit(-1);
+    // meshLibrary hands out one mapping per file (or per contents), so that's what identifies a mesh
+    std::vector<std::weak_ptr<const meshGeometry>> live;
+    for (auto &l : loaded) {
+        if (std::shared_ptr<const meshGeometry> g = l.lock()) {
+            if (g->file == mapped && g->compressed == compressed) {
+                std::cout << "'" << fname << "' is already loaded, sharing its vertices and kd-tree.\n";
+                return g;
+            }
+            live.push_back(g);
+        }
     }
 
-    if (fread(&nt, 4, 1, meshFile) < 1) {
-        std::cerr << "ERROR: Could not load mesh file. \n";
-        exit(-1);
+    loaded = live;
+
+    std::shared_ptr<meshGeometry> g(new meshGeometry());
+    g->compressed = compressed;
+    if (!g->load(fname, mapped, pool, verifyCache)) {
+        return nullptr;
     }
 
-    // Allocate memory for the vertex and triangle arrays
-    vertexArray = (meshVertex*) malloc(nv * sizeof(meshVertex));
-    if (!vertexArray) {
-        std::cerr << "ERROR: Could not allocate memory for vertexArray. (number of vertices = " << nv << ")\n";
-        exit(-1);
+    loaded.push_back(g);
+    return g;
+}
+
+/* Store the vertices of mapped and get a kd-tree over its triangles. Returns false, having reported why, if it's broken. */
+bool meshGeometry::load(const std::string &fname, std::shared_ptr<const meshFile> mapped, threadPool* pool, bool verifyCache)
+{
+    std::string error;
+
+    // a bad index would read past the vertices, so check them all before using any
+    const meshTriangle* tris = mapped->triangles();
+    for (uint32_t i = 0; i < mapped->nt; i++) {
+        if (tris[i].i0 >= mapped->nv || tris[i].i1 >= mapped->nv || tris[i].i2 >= mapped->nv) {
+            std::cerr << "ERROR: Could not load mesh file '" << fname << "': triangle " << i
+                      << " uses a vertex past the last one (" << mapped->nv << " vertices)\n";
+            return false;
+        }
+    }
+
+    file = mapped;
+    nv = file->nv;
+    nt = file->nt;
+    triangleArray = tris;
+
+    storeVertices(file->vertices(), nv);
+    std::cout << "Done loading '" << fname << "'. (" << nv << " vertices in " << vertexBytes() << " bytes"
+              << (compressed ? ", compressed" : "") << ")\n";
+
+    // triangles are tested a block at a time, so bigger leaves cost less than the default expects
+    kdBuildOptions options;
+    options.isectCost = 20.0f;
+    options.maxPrims = TRI_BLOCK_SIZE / 2;
+    options.pool = pool;
+
+    // use the kd-tree and blocks from the cache next to the mesh if they're up to date
+    std::string accelPath = fname + ".accel";
+    uint64_t key = meshAccelKey(*file, options, compressed);
+    std::string reason;
+    accel = meshAccel::open(accelPath, key, nt, compressed, reason);
+
+    if (accel && verifyCache && accel->header().contentHash != meshContentHash(*file)) {
+        reason = "stale: built from different contents";
+        accel = nullptr;
     }
 
-    triangleArray = (meshTriangle*) malloc(nt * sizeof(meshTriangle));
-    if (!triangleArray) {
-        std::cerr << "ERROR: Could not allocate memory for triangleArray. (number of triangles = " << nt << ")\n";
-        exit(-1);
+    if (accel) {
+        tree.use(accel->nodes(), accel->primIndices(), accel->box());
+        blocks = accel->blocks();
+        qBlocks = accel->qBlocks();
+        leafBlocks = accel->leafBlocks();
+        std::cout << "Mapped kd-tree for '" << fname << "' from '" << accelPath << "': " << tree.nodes.size()
+                  << " nodes, " << tree.primIndices.size() << " triangle references in " << numBlocks() << " blocks ("
+                  << blockBytes() << " bytes).\n";
+        return true;
     }
 
-    // Read in the vertexArray and the triangleArrays
-    if (fread(vertexArray, sizeof(float), nv * 8, meshFile) < (nv * 8)) {
-        std::cerr << "ERROR: Could not load mesh file. \n";
-        exit(-1);
+    // Build the kd-tree over the triangles. Every instance of this mesh uses it.
+    std::vector<aabb> triBounds(nt);
+    for (uint32_t i = 0; i < nt; i++) {
+        triBounds[i].extend(position(triangleArray[i].i0));
+        triBounds[i].extend(position(triangleArray[i].i1));
+        triBounds[i].extend(position(triangleArray[i].i2));
     }
 
-    if (fread(triangleArray, sizeof(int), nt * 3, meshFile) < (nt * 3)) {
-        std::cerr << "ERROR: Could not load mesh file. \n";
-        exit(-1);
+    auto start = std::chrono::steady_clock::now();
+    tree.build(triBounds, options);
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    buildBlocks();
+    std::cout << "Built kd-tree for '" << fname << "' (cache '" << accelPath << "': " << reason << "): " << tree.nodes.size()
+              << " nodes, " << tree.primIndices.size() << " triangle references in " << numBlocks() << " blocks ("
+              << blockBytes() << " bytes), " << buildMs << " ms, SAH cost " << tree.sahCost(options) << ".\n";
+
+    bool saved = compressed ? saveMeshAccel(accelPath, key, meshContentHash(*file), tree, qBlocks, leafBlocks, error)
+                            : saveMeshAccel(accelPath, key, meshContentHash(*file), tree, blocks, leafBlocks, error);
+    if (!saved) {
+        std::cerr << "Could not save '" << accelPath << "': " << error << "\n";
     }
 
-    fclose(meshFile);
-    std::cout << "Done loading '" << fname << "'.\n";
+    return true;
 }
 
-triangleMesh::~triangleMesh()
+/* Map a unit vector onto the octahedron |x| + |y| + |z| = 1, unfolded onto a square */
+static uint32_t encodeOctahedral(const vec3 &n)
 {
-    free(vertexArray);
-    free(triangleArray);
-}
+    float invL1 = 1.0f / (fabs(n.x) + fabs(n.y) + fabs(n.z));
+    float x = n.x * invL1;
+    float y = n.y * invL1;
+
+    // fold the lower half over the diagonals
+    if (n.z < 0.0f) {
+        float fx = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
 
+    uint16_t qx = (uint16_t) (int16_t) std::round(clamp(x, -1.0f, 1.0f) * 32767.0f);
+    uint16_t qy = (uint16_t) (int16_t) std::round(clamp(y, -1.0f, 1.0f) * 32767.0f);
+    return qx | ((uint32_t) qy << 16);
+}
 
-bool triangleMesh::hitMeshTriangle(const ray &r, float tmin, float tmax, float time, int tidx, hitRecord* record) const
+static vec3 decodeOctahedral(uint32_t e)
 {
-    meshTriangle tri = triangleArray[tidx]; // get the current mesh triangle
+    float x = (int16_t) (e & 0xffff) / 32767.0f;
+    float y = (int16_t) (e >> 16) / 32767.0f;
+    vec3 n(x, y, 1.0f - fabs(x) - fabs(y));
 
-    /* Coordinates for the triangle */
-    vec3 p0 = vertexArray[tri.i0].coords;
-    vec3 p1 = vertexArray[tri.i1].coords;
-    vec3 p2 = vertexArray[tri.i2].coords;
+    // unfold the lower half
+    float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
 
-    /* Normals for the triangle */
-    vec3 n0 = vertexArray[tri.i0].normal;
-    vec3 n1 = vertexArray[tri.i1].normal;
-    vec3 n2 = vertexArray[tri.i2].normal;
+    return makeUnitVector(n);
+}
 
-    float tval; // parameter for the intersection with the triangle
+/*
+* Split the vertices read from the file into the position and attribute streams.
+* In compressed mode positions are snapped to a 65535 step grid over the mesh's
+* bounds, and the bounds are the ones of the snapped positions.
+*/
+void meshGeometry::storeVertices(const meshVertex* vertices, uint32_t count)
+{
+    box = aabb();
+    for (uint32_t i = 0; i < count; i++) {
+        box.extend(vertices[i].coords);
+    }
 
-    // edge from p1 -> p0
-    float A = p0.x - p1.x;
-    float B = p0.y - p1.y;
-    float C = p0.z - p1.z; 
+    if (!compressed) {
+        positions.resize(count);
+        attributes.resize(count);
 
-    // edge from p2 -> p0
-    float D = p0.x - p2.x; 
-    float E = p0.y - p2.y;
-    float F = p0.z - p2.z;
+        for (size_t i = 0; i < count; i++) {
+            positions[i] = vertices[i].coords;
+            attributes[i].normal = vertices[i].normal;
+            attributes[i].texCoord = vertices[i].texCoord;
+        }
 
-    // components of ray
-    float G = r.direction.x;
-    float H = r.direction.y;
-    float I = r.direction.z;
+        return;
+    }
 
-    // edge from ray to p0 (lower left point on triangle)
-    float J = p0.x - r.origin.x;
-    float K = p0.y - r.origin.y;
-    float L = p0.z - r.origin.z;
+    vec3 extent = box.empty() ? vec3(0) : box.diagonal();
+    grid.origin = box.pmin;
+    grid.scale = extent / 65535.0f;
+    qPositions.resize(count);
+    qAttributes.resize(count);
 
-    // precompute differences for computing beta, gamma, and t by Cramer's rule
-    float EIHF = E*I - H*F;
-    float GFDI = G*F - D*I;
-    float DHEG = D*H - E*G;
-    float denom = A*EIHF + B*GFDI + C*DHEG;
+    for (size_t i = 0; i < count; i++) {
+        vec3 p = vertices[i].coords - box.pmin;
+        uint16_t q[3];
 
-    float beta = (J*EIHF + K*GFDI + L*DHEG) / denom;
+        for (int a = 0; a < 3; a++) {
+            q[a] = extent.e[a] > 0.0f ? (uint16_t) std::round(clamp(p.e[a] / extent.e[a], 0.0f, 1.0f) * 65535.0f) : 0;
+        }
 
-    // failed constraint 0 < beta < 1
-    if (beta <= 0.0f || beta >= 1.0f) {
-        return false;
+        qPositions[i] = { q[0], q[1], q[2] };
+        qAttributes[i].normal = encodeOctahedral(vertices[i].normal);
+        qAttributes[i].texCoord = vertices[i].texCoord;
     }
 
-    float AKJB = A*K - J*B;
-    float JCAL = J*C - A*L;
-    float BLKC = B*L - K*C;
-
-    float gamma = (I*AKJB + H*JCAL + G*BLKC) / denom;
+    aabb snapped;
+    for (uint32_t i = 0; i < count; i++) {
+        snapped.extend(position(i));
+    }
+    box = snapped;
+}
 
-    // failed constraint 0 < beta + gamma < 1
-    // get this by plugging in alpha = 1 - beta - gamma into 
-    // p(alpha,beta,gamma) = A*alpha + B*beta + C*gamma
-    if (gamma <= 0.0f || beta + gamma >= 1.0f) {
-        return false;
+vec3 meshGeometry::position(uint32_t v) const
+{
+    if (!compressed) {
+        return positions[v];
     }
 
-    tval = -(F*AKJB + E*JCAL + D*BLKC) / denom; // dist of intersection
+    const quantizedPosition &q = qPositions[v];
+    return grid.origin + grid.scale * vec3(q.x, q.y, q.z);
+}
 
-    if (tval >= tmin && tval <= tmax)
-    {
-        if (record) {
-            record->t = tval;
-            record->normal = makeUnitVector(n0 + beta * (n1 - n0) + gamma * (n2 - n0));
-            record->colour = colour;
+vec3 meshGeometry::normal(uint32_t v) const
+{
+    return compressed ? decodeOctahedral(qAttributes[v].normal) : attributes[v].normal;
+}
+
+/* Vertex v as it would be in the file (after compression, if the mesh is compressed) */
+meshVertex meshGeometry::vertex(uint32_t v) const
+{
+    meshVertex out;
+    out.coords = position(v);
+    out.texCoord = compressed ? qAttributes[v].texCoord : attributes[v].texCoord;
+    out.normal = normal(v);
+    return out;
+}
+
+/* Memory used by the vertex streams */
+size_t meshGeometry::vertexBytes() const
+{
+    return positions.size() * sizeof(vec3) + attributes.size() * sizeof(vertexAttributes) +
+           qPositions.size() * sizeof(quantizedPosition) + qAttributes.size() * sizeof(packedAttributes);
+}
+
+/*
+* Copy the triangles of every kd-tree leaf into triBlocks, with the first vertex
+* and edges precomputed, so a leaf can be tested a block at a time. Compressed
+* meshes get qTriBlocks holding the vertices' grid coordinates instead.
+*/
+void meshGeometry::buildBlocks()
+{
+    builtBlocks.clear();
+    builtQBlocks.clear();
+    builtLeafBlocks.assign(tree.primIndices.size(), 0);
+
+    for (const kdNode &node : tree.nodes) {
+        if (!node.isLeaf() || node.numPrims() == 0) {
+            continue;
+        }
+
+        builtLeafBlocks[node.primOffset] = compressed ? builtQBlocks.size() : builtBlocks.size();
+
+        for (uint32_t i = 0; i < node.numPrims(); i++) {
+            uint32_t tidx = tree.primIndices[node.primOffset + i];
+            const meshTriangle &tri = triangleArray[tidx];
+
+            if (!compressed) {
+                if (i % TRI_BLOCK_SIZE == 0) {
+                    builtBlocks.push_back(triBlock());
+                }
+
+                builtBlocks.back().set(i % TRI_BLOCK_SIZE, position(tri.i0), position(tri.i1), position(tri.i2), tidx);
+                continue;
+            }
+
+            if (i % TRI_BLOCK_SIZE == 0) {
+                builtQBlocks.push_back(qTriBlock());
+            }
+
+            const quantizedPosition &q0 = qPositions[tri.i0], &q1 = qPositions[tri.i1], &q2 = qPositions[tri.i2];
+            uint16_t p0[3] = { q0.x, q0.y, q0.z };
+            uint16_t p1[3] = { q1.x, q1.y, q1.z };
+            uint16_t p2[3] = { q2.x, q2.y, q2.z };
+            builtQBlocks.back().set(i % TRI_BLOCK_SIZE, p0, p1, p2, tidx);
         }
-        return true;
     }
-     
-     return false; 
+
+    blocks = builtBlocks;
+    qBlocks = builtQBlocks;
+    leafBlocks = builtLeafBlocks;
 }
 
-/* Using the barycentric coordinates method from triangle::hit on every triangle on the mesh. */
-bool triangleMesh::hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const
+/* Interpolate the vertex normals of triangle tidx at barycentric coordinates (beta, gamma) */
+vec3 meshGeometry::shadingNormal(uint32_t tidx, float beta, float gamma) const
 {
-    hitRecord rtmp;
-    float min = 1000000.0f;
-    bool hitSomething = false;
+    const meshTriangle &tri = triangleArray[tidx];
+    vec3 n0 = normal(tri.i0);
+    vec3 n1 = normal(tri.i1);
+    vec3 n2 = normal(tri.i2);
 
-    for (int i = 0; i < nt; i++) {
+    return makeUnitVector(n0 + beta * (n1 - n0) + gamma * (n2 - n0));
+}
 
-        if (hitMeshTriangle(r, tmin, tmax, time, i, &rtmp) && rtmp.t < min) {
-            hitSomething = true;
-            record.t = rtmp.t;
-            min = rtmp.t;
-            record.normal = rtmp.normal;
-            record.pointOnSurface = rtmp.pointOnSurface;
-            record.colour = rtmp.colour;
+/*
+* Test the ray against the blocks of triangles in the leaves of the mesh's kd-tree
+* that it passes through, front to back. Only the closest triangle's normal gets
+* interpolated, once the traversal is done.
+*/
+bool triangleMesh::hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const
+{
+    const meshGeometry &g = *geometry;
+
+    uint32_t closestTri = 0;
+    float closestBeta = 0, closestGamma = 0;
+
+    bool hitSomething = g.tree.traverse(r, tmin, tmax, [&](const kdNode &leaf, float &tclosest) {
+        uint32_t first = g.leafBlocks[leaf.primOffset];
+        uint32_t last = first + (leaf.numPrims() + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+        bool hitLeaf = false;
+
+        for (uint32_t b = first; b < last; b++) {
+            int slot = 0;
+            float beta, gamma;
+
+            if (g.compressed) {
+                if (closestTriBlock(g.qBlocks[b], g.grid, r, tmin, tclosest, slot, beta, gamma)) {
+                    closestTri = g.qBlocks[b].tri[slot];
+                    closestBeta = beta;
+                    closestGamma = gamma;
+                    hitLeaf = true;
+                }
+            }
+
+            else if (closestTriBlock(g.blocks[b], r, tmin, tclosest, slot, beta, gamma)) {
+                closestTri = g.blocks[b].tri[slot];
+                closestBeta = beta;
+                closestGamma = gamma;
+                hitLeaf = true;
+            }
         }
-    }
+
+        return hitLeaf;
+    });
 
     if (hitSomething) {
-        return true;
+        record.t = tmax;
+        record.normal = g.shadingNormal(closestTri, closestBeta, closestGamma);
+        record.colour = colour;
     }
 
-    else {
+    return hitSomething;
+}
+
+/*
+* Same as hit, but stops at the first block with any triangle in the way. As in
+* other shadowHit methods, this does not set colour etc.
+*/
+bool triangleMesh::shadowHit(const ray &r, float tmin, float tmax, float time) const
+{
+    const meshGeometry &g = *geometry;
+
+    return g.tree.traverseAny(r, tmin, tmax, [&](const kdNode &leaf, float tfar) {
+        uint32_t first = g.leafBlocks[leaf.primOffset];
+        uint32_t last = first + (leaf.numPrims() + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+
+        for (uint32_t b = first; b < last; b++) {
+            bool blocked = g.compressed ? occludedTriBlock(g.qBlocks[b], g.grid, r, tmin, tfar)
+                                        : occludedTriBlock(g.blocks[b], r, tmin, tfar);
+            if (blocked) {
+                return true;
+            }
+        }
+
         return false;
+    });
+}
+
+/*
+* Trace the packet through the kd-tree together, testing each triangle against
+* all of its lanes at once. Normals are only interpolated once per lane, for the
+* triangle that ends up closest. Packets whose lanes point different ways go
+* one ray at a time.
+*/
+laneMask triangleMesh::hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const
+{
+    if (!p.commonSign(0) || !p.commonSign(1) || !p.commonSign(2)) {
+        return shape::hitPacket(p, tmin, time, records);
+    }
+
+    const meshGeometry &g = *geometry;
+
+    uint32_t closestTri[PACKET_SIZE];
+    float closestBeta[PACKET_SIZE], closestGamma[PACKET_SIZE];
+
+    laneMask hitLanes = g.tree.traversePacket(p, tmin, [&](uint32_t i, laneMask lanes) {
+        const meshTriangle &tri = g.triangleArray[i];
+        float tval[PACKET_SIZE], beta[PACKET_SIZE], gamma[PACKET_SIZE];
+        laneMask m = lanes & hitTrianglePacket(p, g.position(tri.i0), g.position(tri.i1), g.position(tri.i2),
+                                               tmin, tval, beta, gamma);
+
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (m & (1u << l)) {
+                p.tmax[l] = tval[l];
+                closestTri[l] = i;
+                closestBeta[l] = beta[l];
+                closestGamma[l] = gamma[l];
+            }
+        }
+
+        return m;
+    });
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (hitLanes & (1u << l)) {
+            records[l].t = p.tmax[l];
+            records[l].normal = g.shadingNormal(closestTri[l], closestBeta[l], closestGamma[l]);
+            records[l].colour = colour;
+        }
     }
+
+    return hitLanes;
 }
 
-/* Using the barycentric coordinates method from triangle::hit on every triangle on the mesh.
-* As in other shadowHit methods, this does not set colour etc, but does keep track of
-* t.
+/*
+* Shadow rays for a packet, through the kd-tree together like hitPacket. Lanes
+* leave the packet as soon as a triangle blocks them.
 */
-bool triangleMesh::shadowHit(const ray &r, float tmin, float tmax, float time) const
+laneMask triangleMesh::shadowHitPacket(const rayPacket &p, float tmin, float time) const
+{
+    if (!p.commonSign(0) || !p.commonSign(1) || !p.commonSign(2)) {
+        return shape::shadowHitPacket(p, tmin, time);
+    }
+
+    const meshGeometry &g = *geometry;
+    rayPacket local = p;
+    laneMask blocked = 0;
+
+    g.tree.traversePacket(local, tmin, [&](uint32_t i, laneMask lanes) {
+        const meshTriangle &tri = g.triangleArray[i];
+        float tval[PACKET_SIZE], beta[PACKET_SIZE], gamma[PACKET_SIZE];
+        laneMask m = lanes & hitTrianglePacket(local, g.position(tri.i0), g.position(tri.i1), g.position(tri.i2),
+                                               tmin, tval, beta, gamma);
+
+        local.active &= ~m;
+        blocked |= m;
+        return m;
+    });
+
+    return blocked;
+}
+
+aabb triangleMesh::bounds() const
+{
+    return geometry->box;
+}
+
+
+/* ----- streamedMesh ----- */
+
+/*
+* Open fname's chunks (fname + ".chunks"), cutting fname into them first if
+* they're missing or older than it. If that fails, the error is reported and
+* loaded() is false.
+*/
+streamedMesh::streamedMesh(std::string fname, const rgb &colour_, threadPool* pool) :
+firstSlot(0), colour(colour_)
 {
-    hitRecord rtmp;
-    float min = 1000000.0f;
-    bool hitSomething = false;
+    std::string chunksPath = fname + ".chunks";
+    std::string reason, error;
+    std::shared_ptr<const meshChunksFile> opened = meshChunksFile::open(chunksPath, fname, reason);
 
-    for (int i = 0; i < nt; i++) {
-        if (hitMeshTriangle(r, tmin, tmax, time, i, &rtmp)) {
-            hitSomething = true;
-            min = rtmp.t;
+    if (!opened) {
+        std::cout << "Writing chunked mesh '" << chunksPath << "' (" << reason << ")...\n";
+
+        if (!writeMeshChunks(fname, chunksPath, error) || !(opened = meshChunksFile::open(chunksPath, fname, error))) {
+            std::cerr << "ERROR: Could not stream mesh file '" << fname << "': " << error << "\n";
+            return;
         }
     }
 
+    chunks = opened;
+    firstSlot = geometryCache::shared().addMesh(chunks);
+
+    std::vector<aabb> clusterBounds(chunks->directory.size());
+    for (uint32_t c = 0; c < clusterBounds.size(); c++) {
+        clusterBounds[c] = chunks->clusterBounds(c);
+    }
+
+    bvhBuildOptions options;
+    options.maxLeafSize = 1;
+    options.pool = pool;
+    tree.build(clusterBounds, options);
+
+    std::cout << "Streaming mesh '" << fname << "' from '" << chunksPath << "': " << chunks->header.numTriangles
+              << " triangles in " << clusterBounds.size() << " clusters.\n";
+}
+
+/*
+* Test the ray against the clusters whose boxes it goes through, front to back,
+* asking the cache for each one. The reader keeps the cluster holding the
+* closest hit alive until its normal has been interpolated.
+*/
+bool streamedMesh::hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const
+{
+    geometryCache::reader cache(geometryCache::shared());
+    const meshCluster *closest = nullptr;
+    uint32_t closestTri = 0;
+    float closestBeta = 0, closestGamma = 0;
+
+    bool hitSomething = tree.traverse(r, tmin, tmax, [&](const bvhNode &leaf, float &tclosest) {
+        bool hitLeaf = false;
+
+        for (uint32_t k = 0; k < leaf.count; k++) {
+            const meshCluster *cluster = cache.get(firstSlot + tree.indices[leaf.offset + k]);
+
+            for (const triBlock &b : cluster->blocks) {
+                int slot = 0;
+                float beta, gamma;
+
+                if (closestTriBlock(b, r, tmin, tclosest, slot, beta, gamma)) {
+                    closest = cluster;
+                    closestTri = b.tri[slot];
+                    closestBeta = beta;
+                    closestGamma = gamma;
+                    hitLeaf = true;
+                }
+            }
+        }
+
+        return hitLeaf;
+    });
+
     if (hitSomething) {
-        return true;
+        record.t = tmax;
+        record.normal = closest->shadingNormal(closestTri, closestBeta, closestGamma);
+        record.colour = colour;
     }
 
-    else {
+    return hitSomething;
+}
+
+/* Same as hit, but stops at the first block with any triangle in the way */
+bool streamedMesh::shadowHit(const ray &r, float tmin, float tmax, float time) const
+{
+    geometryCache::reader cache(geometryCache::shared());
+
+    return tree.traverseAny(r, tmin, tmax, [&](const bvhNode &leaf, float tfar) {
+        for (uint32_t k = 0; k < leaf.count; k++) {
+            const meshCluster *cluster = cache.get(firstSlot + tree.indices[leaf.offset + k]);
+
+            for (const triBlock &b : cluster->blocks) {
+                if (occludedTriBlock(b, r, tmin, tfar)) {
+                    return true;
+                }
+            }
+        }
+
         return false;
-    }
+    });
 }
 
+aabb streamedMesh::bounds() const
+{
+    return tree.bounds();
+}
 
 std::ostream &operator <<(std::ostream &out, const meshTriangle &t)
 {
@@ -401,15 +799,16 @@ std::ostream &operator <<(std::ostream &out, const meshVertex &v)
     return out;
 }
 
-std::ostream &operator <<(std::ostream &out, const triangleMesh &tm)
+std::ostream &operator <<(std::ostream &out, const triangleMesh &mesh)
 {
+    const meshGeometry &tm = *mesh.geometry;
     out << "nv: " << tm.nv << "\n" << "nt: " << tm.nt << "\n";
 
     for(int i = 0; i < tm.nt; i++) {
         out << tm.triangleArray[i] << "\n";
-        out << "i0 (vertex " << tm.triangleArray[i].i0 << ") " << tm.vertexArray[tm.triangleArray[i].i0] << "\n";
-        out << "i1 (vertex " << tm.triangleArray[i].i1 << ") " << tm.vertexArray[tm.triangleArray[i].i1] << "\n";
-        out << "i2 (vertex " << tm.triangleArray[i].i2 << ") " << tm.vertexArray[tm.triangleArray[i].i2] << "\n";
+        out << "i0 (vertex " << tm.triangleArray[i].i0 << ") " << tm.vertex(tm.triangleArray[i].i0) << "\n";
+        out << "i1 (vertex " << tm.triangleArray[i].i1 << ") " << tm.vertex(tm.triangleArray[i].i1) << "\n";
+        out << "i2 (vertex " << tm.triangleArray[i].i2 << ") " << tm.vertex(tm.triangleArray[i].i2) << "\n";
         out << "\n";
     }
 
@@ -489,6 +888,54 @@ bool sphere::shadowHit(const ray &r, float tmin, float tmax, float time) const
     return false;
 }
 
+/* Same quadratic as sphere::hit, for every lane at once */
+laneMask sphere::hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const
+{
+    float tval[PACKET_SIZE];
+    float r2 = radius * radius;
+    laneMask hitLanes = 0;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        float ocx = p.ox[l] - centre.x;
+        float ocy = p.oy[l] - centre.y;
+        float ocz = p.oz[l] - centre.z;
+
+        float a = p.dx[l]*p.dx[l] + p.dy[l]*p.dy[l] + p.dz[l]*p.dz[l];
+        float b = 2 * (p.dx[l]*ocx + p.dy[l]*ocy + p.dz[l]*ocz);
+        float c = ocx*ocx + ocy*ocy + ocz*ocz - r2;
+        float discriminant = b*b - 4*a*c;
+        float root = sqrtf(std::max(discriminant, 0.0f));
+
+        float t = (-b - root) / (2*a);
+        t = t < tmin ? (-b + root) / (2*a) : t;
+
+        bool hit = discriminant > 0 && t >= tmin && t <= p.tmax[l];
+        hitLanes |= (laneMask) hit << l;
+        tval[l] = t;
+    }
+
+    hitLanes &= p.active;
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (hitLanes & (1u << l)) {
+            vec3 o(p.ox[l], p.oy[l], p.oz[l]);
+            vec3 d(p.dx[l], p.dy[l], p.dz[l]);
+
+            p.tmax[l] = tval[l];
+            records[l].t = tval[l];
+            records[l].normal = makeUnitVector(o + tval[l]*d - centre);
+            records[l].colour = colour;
+        }
+    }
+
+    return hitLanes;
+}
+
+aabb sphere::bounds() const
+{
+    return aabb(centre - vec3(radius), centre + vec3(radius));
+}
+
 std::ostream &operator <<(std::ostream &out, const sphere &toString)
 {
     out << "( c = " << toString.centre << ", r = " << toString.radius << ", colour = " << toString.colour << ")";
@@ -18,6 +18,16 @@
 #include "ray.hpp"
 #include "vec.hpp"
 #include "matrix.hpp"
+#include "aabb.hpp"
+#include "kdtree.hpp"
+#include "triblock.hpp"
+#include "packet.hpp"
+#include "meshfile.hpp"
+#include "bvh.hpp"
+#include "geometrycache.hpp"
+#include "meshaccel.hpp"
+
+const float COLLISION_EPS = 0.0001f;  // planes closer than this to parallel with a ray are missed
 
 /* hitRecord: stores information to do with ray-object intersections */
 struct hitRecord
@@ -26,6 +36,7 @@ struct hitRecord
     vec3 normal;          // normal to the surface defined by the intersection
     vec3 pointOnSurface;  // point the ray hit
     rgb colour;           // colour of the point
+    bool mirror;          // whether the point is on a mirror (filled in by the scene)
 };
 
 /* shape: all shapes will be iterated over and checked for hit and shadowhit */
@@ -33,22 +44,20 @@ struct shape
 {
     bool mirror = false;
 
+    virtual ~shape() {}
     virtual bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const=0;
     virtual bool shadowHit(const ray &r, float tmin, float tmax, float time) const=0;
-};
+    virtual aabb bounds() const; // unbounded unless a shape says otherwise
 
-struct instance : shape
-{   
-    shape* s;                           // the actual shape we're looking at
-    tmat transform = identityMatrix();  // transformation to apply to the rays intersecting with the shape
-    tmat inverseTransform = identityMatrix();
+    /*
+    * Intersect every active lane of p. Lanes that find a hit closer than their
+    * tmax get tmax and records[lane] updated, and are returned in the mask.
+    * By default this is just hit() on one lane at a time.
+    */
+    virtual laneMask hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const;
 
-    instance(shape* s_);
-    instance(tmat transform_, tmat inverse_, shape* s_);
-    instance(tmat transform_, tmat inverse_, shape* s_, rgb colour_);
-    instance(tmat transform_, shape* s_);
-    bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const;
-    bool shadowHit(const ray &r, float tmin, float tmax, float time) const;
+    /* Return the active lanes of p blocked between tmin and their tmax. By default, shadowHit() per lane. */
+    virtual laneMask shadowHitPacket(const rayPacket &p, float tmin, float time) const;
 };
 
 /* triangle: defined by three points */
@@ -62,43 +71,127 @@ struct triangle : public shape
     triangle(const vec3 &p0_, const vec3 &p1_, const vec3& p2_, const rgb &colour_);
     bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const;
     bool shadowHit(const ray &r, float tmin, float tmax, float time) const;
+    aabb bounds() const;
+    laneMask hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const;
 };
 
 /*
-* A vertex read from a .mesh file.
+* A loaded mesh keeps its vertices in two streams: positions, which intersection
+* needs, and the attributes below, which are only read when shading a hit.
 */
-struct meshVertex {
-    vec3 coords;    // Position of the vertex 
-    vec2 texCoord;  // Map for the texture components
-    vec3 normal;    // Normal of the vertex
+struct vertexAttributes {
+    vec3 normal;
+    vec2 texCoord;
 };
 
 /*
-* Triangle in a mesh from a .mesh file. Note that triangles are
-* stored in CW order.
+* Compressed mesh vertices. Positions are 16 bits per axis relative to the
+* mesh's bounds, normals are octahedral encoded in 16 bits per component.
 */
-struct meshTriangle {
-    uint32_t i0; // ID of first vertex in vertexArray
-    uint32_t i1; // ID of second vertex in vertexArray     
-    uint32_t i2; // ID of third vertex in vertexArray
+struct quantizedPosition {
+    uint16_t x, y, z;
 };
 
-/* triangleMesh stored openGL style */
-struct triangleMesh : public shape
+struct packedAttributes {
+    uint32_t normal;  // octahedral x in the low 16 bits, y in the high 16 bits
+    vec2 texCoord;
+};
+
+/*
+* What's loaded from a .mesh file: the vertex streams, and the kd-tree and
+* triangle blocks over them. It doesn't change once loaded, so every
+* triangleMesh of the same file (or a copy of it) with the same compression
+* shares one, and only the colour is their own.
+*/
+struct meshGeometry
 {
+    std::shared_ptr<const meshFile> file;  // the mapped .mesh file
     uint32_t nv;                  // number of vertices
     uint32_t nt;                  // number of triangles
-    meshVertex* vertexArray;      // contains every vertex in the mesh
-    meshTriangle* triangleArray;  // contains every triangle in the mesh
+    const meshTriangle* triangleArray;  // contains every triangle in the mesh, inside file
+    aabb box;                     // bounds of every vertex in the mesh
+    bool compressed;              // whether the vertices are in the quantized streams
+
+    // vertex streams, either full precision...
+    std::vector<vec3> positions;
+    std::vector<vertexAttributes> attributes;
+
+    // ...or compressed
+    std::vector<quantizedPosition> qPositions;
+    std::vector<packedAttributes> qAttributes;
+    quantizedGrid grid;           // what qPositions are coordinates on
+    kdTree tree;                  // bottom level tree over triangleArray, shared by every instance of the mesh
+
+    // the triangles of each kd-tree leaf, TRI_BLOCK_SIZE at a time: in blocks, or qBlocks if compressed
+    arrayView<triBlock> blocks;
+    arrayView<qTriBlock> qBlocks;
+    arrayView<uint32_t> leafBlocks; // first block of each leaf, indexed by the leaf's primOffset
+
+    // where the tree and blocks live: either built here, or mapped from the .mesh.accel cache
+    std::vector<triBlock> builtBlocks;
+    std::vector<qTriBlock> builtQBlocks;
+    std::vector<uint32_t> builtLeafBlocks;
+    std::shared_ptr<const meshAccel> accel;
+
+    meshGeometry() : nv(0), nt(0), triangleArray(nullptr), compressed(false) {}
+    meshGeometry(const meshGeometry&) = delete;
+    meshGeometry &operator=(const meshGeometry&) = delete;
+
+    /*
+    * The geometry of fname, or of a mesh already loaded from the same file.
+    * Returns nullptr, with the error reported, if it can't be loaded.
+    */
+    static std::shared_ptr<const meshGeometry> open(const std::string &fname, bool compressed, threadPool* pool,
+                                                    bool verifyCache);
+    bool load(const std::string &fname, std::shared_ptr<const meshFile> mapped, threadPool* pool, bool verifyCache);
+
+    void storeVertices(const meshVertex* vertices, uint32_t count);
+    vec3 position(uint32_t v) const;
+    vec3 normal(uint32_t v) const;
+    meshVertex vertex(uint32_t v) const;
+    size_t vertexBytes() const;
+    size_t numBlocks() const { return blocks.size() + qBlocks.size(); }
+    size_t blockBytes() const { return blocks.size() * sizeof(triBlock) + qBlocks.size() * sizeof(qTriBlock); }
+
+    void buildBlocks();
+    vec3 shadingNormal(uint32_t tidx, float beta, float gamma) const;
+};
+
+/* triangleMesh stored openGL style */
+struct triangleMesh : public shape
+{
+    std::shared_ptr<const meshGeometry> geometry;  // possibly shared with other meshes
     rgb colour;
 
-    triangleMesh(std::string fname, const rgb &colour_);
-    ~triangleMesh();
+    triangleMesh(std::string fname, const rgb &colour_, bool compressed_ = false, threadPool* pool = nullptr,
+                 bool verifyCache = false);
+    bool loaded() const { return geometry != nullptr; }
 
-    bool hitMeshTriangle(const ray &r, float tmin, float tmax, float time, int tidx, hitRecord* record) const;
     bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const;
     bool shadowHit(const ray &r, float tmin, float tmax, float time) const;
+    aabb bounds() const;
+    laneMask hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const;
+    laneMask shadowHitPacket(const rayPacket &p, float tmin, float time) const;
+};
+
+/*
+* A mesh streamed from a .mesh.chunks file (see meshchunks.hpp), for meshes too
+* big to load. Only the bounds of its clusters stay in memory, in a bvh; a
+* cluster is read through the shared geometryCache when a ray reaches its box.
+*/
+struct streamedMesh : public shape
+{
+    std::shared_ptr<const meshChunksFile> chunks;
+    uint32_t firstSlot;           // cache slot of cluster 0, the rest follow it
+    bvh tree;                     // over the clusters' bounds
+    rgb colour;
 
+    streamedMesh(std::string fname, const rgb &colour_, threadPool* pool = nullptr);
+    bool loaded() const { return chunks != nullptr; }
+
+    bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const;
+    bool shadowHit(const ray &r, float tmin, float tmax, float time) const;
+    aabb bounds() const;
 };
 
 /* sphere: defined by a centre and a radius */
@@ -112,6 +205,8 @@ struct sphere : shape
     sphere(const vec3 &centre_, float radius_, const rgb &colour_, const tmat& transform_);
     bool hit(const ray &r, float tmin, float tmax, float time, hitRecord &record) const;
     bool shadowHit(const ray &r, float tmin, float tmax, float time) const;
+    aabb bounds() const;
+    laneMask hitPacket(rayPacket &p, float tmin, float time, hitRecord records[PACKET_SIZE]) const;
 };
 
 /* plane: defined by a point + a normal */
@@ -0,0 +1,146 @@
+/*
+* sphereblock.hpp
+* Contains the kernels that test a ray against SPHERE_BLOCK_SIZE spheres at
+* once, read straight out of structure of arrays (centre x/y/z and radius
+* squared). With -mavx2 they use 8 wide AVX registers; otherwise they're branch
+* free loops the compiler can vectorize. Packets are tested against a sphere
+* with the same maths, a lane at a time.
+*
+* Everything is in float, with the half-b form of the quadratic. Its
+* discriminant is worked out from the distance between the centre and the
+* closest point on the ray, rather than as b*b - a*c, which loses every digit
+* when the sphere is far away compared to its size. The smaller root is c/q
+* rather than (-b - sqrt(disc))/a for the same reason. Slots that are left
+* too close to call in float, where the ray grazes the sphere or starts on its
+* surface, are flagged so the caller can redo them in double.
+*/
+
+#ifndef SPHEREBLOCK_H
+#define SPHEREBLOCK_H
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "vec.hpp"
+#include "ray.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+const int SPHERE_BLOCK_SIZE = 8;
+
+// a slot is too close to call when the ray's squared distance from the centre,
+// or the squared distance of its origin, is this close to radius squared
+const float SPHERE_CAREFUL_EPS = 1e-3f;
+
+/*
+* One slot of the kernels below, which packets also use a lane at a time: the
+* sphere with radius squared r2, whose centre is at -f from the ray's origin,
+* against the ray with direction d. Returns whether it's hit in [tmin, tmax],
+* with the distance in t, and sets close if it's too close to call in float.
+*/
+inline bool intersectSphereSlot(float fx, float fy, float fz, float dx, float dy, float dz, float r2,
+                                float tmin, float tmax, float &t, bool &close)
+{
+    float a = dx * dx + dy * dy + dz * dz;
+    float invA = 1.0f / a;
+    float b = fx * dx + fy * dy + fz * dz;
+    float c = fx * fx + fy * fy + fz * fz - r2;
+
+    float s = b * invA;
+    float lx = fx - s * dx;
+    float ly = fy - s * dy;
+    float lz = fz - s * dz;
+    float h = r2 - (lx * lx + ly * ly + lz * lz);
+    float disc = a * h;
+
+    float q = -(b + std::copysign(std::sqrt(std::max(disc, 0.0f)), b));
+    float t0 = c / q;
+    float t1 = q * invA;
+    t = std::min(t0, t1) < tmin ? std::max(t0, t1) : std::min(t0, t1);
+
+    close = std::fabs(h) < SPHERE_CAREFUL_EPS * r2 || std::fabs(c) < SPHERE_CAREFUL_EPS * r2;
+    return disc > 0.0f && t >= tmin && t <= tmax;
+}
+
+#if defined(__AVX2__)
+
+/*
+* Test r against spheres [0, SPHERE_BLOCK_SIZE) of the given arrays. Returns
+* the slots hit in [tmin, tmax] as a bitmask with their distances in t. Slots
+* in careful may be wrong either way and should be tested again more carefully.
+*/
+inline uint32_t intersectSphereBlock(const float* cx, const float* cy, const float* cz, const float* r2,
+                                     const ray &r, float tmin, float tmax, float t[SPHERE_BLOCK_SIZE], uint32_t &careful)
+{
+    float a = dot(r.direction, r.direction);
+    __m256 dx = _mm256_set1_ps(r.direction.x), dy = _mm256_set1_ps(r.direction.y), dz = _mm256_set1_ps(r.direction.z);
+    __m256 va = _mm256_set1_ps(a), invA = _mm256_set1_ps(1.0f / a);
+    __m256 rr = _mm256_loadu_ps(r2);
+
+    // f = o - c, b = f . d, c = f . f - r^2
+    __m256 fx = _mm256_sub_ps(_mm256_set1_ps(r.origin.x), _mm256_loadu_ps(cx));
+    __m256 fy = _mm256_sub_ps(_mm256_set1_ps(r.origin.y), _mm256_loadu_ps(cy));
+    __m256 fz = _mm256_sub_ps(_mm256_set1_ps(r.origin.z), _mm256_loadu_ps(cz));
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fx, dx), _mm256_mul_ps(fy, dy)), _mm256_mul_ps(fz, dz));
+    __m256 ff = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)), _mm256_mul_ps(fz, fz));
+    __m256 c = _mm256_sub_ps(ff, rr);
+
+    // l = f - (b/a) d is the closest point on the line to the centre, disc = a (r^2 - l . l)
+    __m256 s = _mm256_mul_ps(b, invA);
+    __m256 lx = _mm256_sub_ps(fx, _mm256_mul_ps(s, dx));
+    __m256 ly = _mm256_sub_ps(fy, _mm256_mul_ps(s, dy));
+    __m256 lz = _mm256_sub_ps(fz, _mm256_mul_ps(s, dz));
+    __m256 h = _mm256_sub_ps(rr, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz)));
+    __m256 disc = _mm256_mul_ps(va, h);
+
+    // q = -(b + sign(b) sqrt(disc)), roots c/q and q/a
+    __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+    __m256 q = _mm256_xor_ps(_mm256_add_ps(b, _mm256_or_ps(root, _mm256_and_ps(b, signMask))), signMask);
+    __m256 t0 = _mm256_div_ps(c, q);
+    __m256 t1 = _mm256_mul_ps(q, invA);
+    __m256 tnear = _mm256_min_ps(t0, t1);
+    __m256 tfar = _mm256_max_ps(t0, t1);
+    __m256 vmin = _mm256_set1_ps(tmin);
+    __m256 tt = _mm256_blendv_ps(tnear, tfar, _mm256_cmp_ps(tnear, vmin, _CMP_LT_OQ));
+
+    // ordered compares, so NaNs count as misses
+    __m256 hit = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GT_OQ);
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, vmin, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LE_OQ));
+
+    __m256 eps = _mm256_mul_ps(_mm256_set1_ps(SPHERE_CAREFUL_EPS), rr);
+    __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 close = _mm256_or_ps(_mm256_cmp_ps(_mm256_and_ps(h, absMask), eps, _CMP_LT_OQ),
+                                _mm256_cmp_ps(_mm256_and_ps(c, absMask), eps, _CMP_LT_OQ));
+
+    _mm256_storeu_ps(t, tt);
+    careful = (uint32_t) _mm256_movemask_ps(close);
+    return (uint32_t) _mm256_movemask_ps(hit);
+}
+
+#else
+
+/* Same as the AVX2 version above, one slot per loop iteration */
+inline uint32_t intersectSphereBlock(const float* cx, const float* cy, const float* cz, const float* r2,
+                                     const ray &r, float tmin, float tmax, float t[SPHERE_BLOCK_SIZE], uint32_t &careful)
+{
+    uint32_t hitMask = 0;
+    careful = 0;
+
+    for (int k = 0; k < SPHERE_BLOCK_SIZE; k++) {
+        bool close;
+        bool hit = intersectSphereSlot(r.origin.x - cx[k], r.origin.y - cy[k], r.origin.z - cz[k],
+                                       r.direction.x, r.direction.y, r.direction.z, r2[k], tmin, tmax, t[k], close);
+        hitMask |= (uint32_t) hit << k;
+        careful |= (uint32_t) close << k;
+    }
+
+    return hitMask;
+}
+
+#endif
+
+#endif
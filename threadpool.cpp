@@ -0,0 +1,115 @@
+/*
+* threadpool.cpp
+* Implements the work stealing thread pool from threadpool.hpp.
+*/
+
+#include <algorithm>
+#include "threadpool.hpp"
+
+threadPool::threadPool(int numThreads) :
+queues(numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency())),
+remaining(0)
+{
+    for (int i = 0; i < (int) queues.size(); i++) {
+        workers.push_back(std::thread(&threadPool::workerLoop, this, i));
+    }
+}
+
+threadPool::~threadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(poolLock);
+        stopping = true;
+    }
+
+    startJob.notify_all();
+
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+/*
+* Split the tasks into one contiguous block per worker so neighbouring tiles
+* start out on the same thread, then let stealing even things out.
+*/
+void threadPool::parallelFor(int n, const std::function<void(int, int)> &task)
+{
+    if (n <= 0) {
+        return;
+    }
+
+    int numWorkers = queues.size();
+    job = task;
+    remaining = n;
+
+    for (int w = 0; w < numWorkers; w++) {
+        int begin = (long long) n * w / numWorkers;
+        int end = (long long) n * (w + 1) / numWorkers;
+
+        std::lock_guard<std::mutex> guard(queues[w].lock);
+        for (int i = begin; i < end; i++) {
+            queues[w].tasks.push_back(i);
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(poolLock);
+    generation++;
+    startJob.notify_all();
+    jobDone.wait(guard, [this] { return remaining == 0; });
+}
+
+/* Take a task from our own queue, or steal one from the back of another worker's */
+bool threadPool::popTask(int id, int &task)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[id].lock);
+        if (!queues[id].tasks.empty()) {
+            task = queues[id].tasks.front();
+            queues[id].tasks.pop_front();
+            return true;
+        }
+    }
+
+    int numWorkers = queues.size();
+    for (int k = 1; k < numWorkers; k++) {
+        workQueue &victim = queues[(id + k) % numWorkers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void threadPool::workerLoop(int id)
+{
+    unsigned seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(poolLock);
+            startJob.wait(guard, [&] { return stopping || generation != seen; });
+
+            if (stopping) {
+                return;
+            }
+
+            seen = generation;
+        }
+
+        int task;
+        while (popTask(id, task)) {
+            job(task, id);
+
+            if (--remaining == 0) {
+                std::lock_guard<std::mutex> guard(poolLock);
+                jobDone.notify_all();
+            }
+        }
+    }
+}
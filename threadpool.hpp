@@ -0,0 +1,53 @@
+/*
+* threadpool.hpp
+* Contains a fixed size pool of worker threads that run parallelFor jobs.
+* Each worker has its own queue of tasks. Workers take tasks from the front of
+* their own queue, and when it runs dry they steal from the back of someone
+* else's, so uneven tasks (tiles full of mirrors next to empty sky) balance out.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+struct workQueue
+{
+    std::mutex lock;
+    std::deque<int> tasks;
+};
+
+class threadPool
+{
+public:
+    threadPool(int numThreads); // numThreads <= 0 means one per hardware thread
+    ~threadPool();
+
+    int size() const { return workers.size(); }
+
+    /* Run task(i, threadIdx) for every i in [0, n) and wait for them all to finish */
+    void parallelFor(int n, const std::function<void(int, int)> &task);
+
+private:
+    void workerLoop(int id);
+    bool popTask(int id, int &task);
+
+    std::vector<std::thread> workers;
+    std::vector<workQueue> queues;     // queues[i] belongs to workers[i]
+    std::function<void(int, int)> job; // what parallelFor is currently running
+
+    std::mutex poolLock;
+    std::condition_variable startJob;  // signalled when a new job is posted
+    std::condition_variable jobDone;   // signalled when the last task of a job finishes
+    std::atomic<int> remaining;        // tasks in the current job that haven't finished
+    unsigned generation = 0;           // incremented for every job
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,285 @@
+/*
+* triblock.hpp
+* Contains triBlock, TRI_BLOCK_SIZE mesh triangles stored as structure of arrays
+* with their edges precomputed, and the kernels that test a ray against all of
+* them in one pass (Moller-Trumbore). With -mavx2 the kernels use 8 wide AVX
+* registers; otherwise they're branch free loops the compiler can vectorize.
+* Unused slots in a block are degenerate (zero edges) and never get hit.
+*
+* Compressed meshes use qTriBlock instead, which keeps each vertex as its 16 bit
+* grid coordinates within the mesh's bounds: 176 bytes for 8 triangles instead
+* of 320. The kernels decode them with the same sum as the mesh's position(),
+* so both kinds of block find the same hits (to the last bit, unless the
+* compiler fuses that sum into an fma in one place but not the other).
+*/
+
+#ifndef TRIBLOCK_H
+#define TRIBLOCK_H
+
+#include <cstdint>
+#include "vec.hpp"
+#include "ray.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+const int TRI_BLOCK_SIZE = 8;
+
+struct triBlock
+{
+    float p0x[TRI_BLOCK_SIZE], p0y[TRI_BLOCK_SIZE], p0z[TRI_BLOCK_SIZE];  // first vertex
+    float e1x[TRI_BLOCK_SIZE], e1y[TRI_BLOCK_SIZE], e1z[TRI_BLOCK_SIZE];  // p1 - p0
+    float e2x[TRI_BLOCK_SIZE], e2y[TRI_BLOCK_SIZE], e2z[TRI_BLOCK_SIZE];  // p2 - p0
+    uint32_t tri[TRI_BLOCK_SIZE];  // index of the triangle in its mesh
+
+    triBlock()
+    {
+        for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+            set(k, vec3(0), vec3(0), vec3(0), 0);
+        }
+    }
+
+    void set(int k, const vec3 &p0, const vec3 &p1, const vec3 &p2, uint32_t triIndex)
+    {
+        p0x[k] = p0.x;
+        p0y[k] = p0.y;
+        p0z[k] = p0.z;
+        e1x[k] = p1.x - p0.x;
+        e1y[k] = p1.y - p0.y;
+        e1z[k] = p1.z - p0.z;
+        e2x[k] = p2.x - p0.x;
+        e2y[k] = p2.y - p0.y;
+        e2z[k] = p2.z - p0.z;
+        tri[k] = triIndex;
+    }
+};
+
+/*
+* Where a compressed mesh's 16 bit grid is: vertex q is at
+* origin + scale * q, the same sum the mesh decodes positions with.
+*/
+struct quantizedGrid
+{
+    vec3 origin;
+    vec3 scale;
+};
+
+struct qTriBlock
+{
+    uint16_t p0x[TRI_BLOCK_SIZE], p0y[TRI_BLOCK_SIZE], p0z[TRI_BLOCK_SIZE];  // grid coordinates of each vertex
+    uint16_t p1x[TRI_BLOCK_SIZE], p1y[TRI_BLOCK_SIZE], p1z[TRI_BLOCK_SIZE];
+    uint16_t p2x[TRI_BLOCK_SIZE], p2y[TRI_BLOCK_SIZE], p2z[TRI_BLOCK_SIZE];
+    uint32_t tri[TRI_BLOCK_SIZE];  // index of the triangle in its mesh
+
+    qTriBlock()
+    {
+        uint16_t zero[3] = { 0, 0, 0 };
+        for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+            set(k, zero, zero, zero, 0);
+        }
+    }
+
+    void set(int k, const uint16_t p0[3], const uint16_t p1[3], const uint16_t p2[3], uint32_t triIndex)
+    {
+        p0x[k] = p0[0];
+        p0y[k] = p0[1];
+        p0z[k] = p0[2];
+        p1x[k] = p1[0];
+        p1y[k] = p1[1];
+        p1z[k] = p1[2];
+        p2x[k] = p2[0];
+        p2y[k] = p2[1];
+        p2z[k] = p2[2];
+        tri[k] = triIndex;
+    }
+};
+
+#if defined(__AVX2__)
+
+/* Moller-Trumbore on 8 triangles, given as their first vertex and edges */
+inline uint32_t intersectTriangles8(__m256 p0x, __m256 p0y, __m256 p0z, __m256 e1x, __m256 e1y, __m256 e1z,
+                                    __m256 e2x, __m256 e2y, __m256 e2z, const ray &r, float tmin, float tmax,
+                                    float t[TRI_BLOCK_SIZE], float u[TRI_BLOCK_SIZE], float v[TRI_BLOCK_SIZE])
+{
+    __m256 dx = _mm256_set1_ps(r.direction.x), dy = _mm256_set1_ps(r.direction.y), dz = _mm256_set1_ps(r.direction.z);
+
+
+    // p = d x e2, det = e1 . p
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+    // s = o - p0, u = (s . p) / det
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(r.origin.x), p0x);
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(r.origin.y), p0y);
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(r.origin.z), p0z);
+    __m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+
+    // q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+    __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+    // ordered compares, so NaNs from degenerate slots count as misses
+    __m256 zero = _mm256_setzero_ps();
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GT_OQ), _mm256_cmp_ps(vv, zero, _CMP_GT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(uu, vv), _mm256_set1_ps(1.0f), _CMP_LT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(tmin), _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LE_OQ));
+
+    _mm256_storeu_ps(t, tt);
+    _mm256_storeu_ps(u, uu);
+    _mm256_storeu_ps(v, vv);
+    return (uint32_t) _mm256_movemask_ps(hit);
+}
+
+/*
+* Test r against every triangle in b. Returns the slots hit in [tmin, tmax] as a
+* bitmask, with their distances and barycentric coordinates (u is the weight of
+* p1, v of p2) in t, u and v.
+*/
+inline uint32_t intersectTriBlock(const triBlock &b, const ray &r, float tmin, float tmax,
+                                  float t[TRI_BLOCK_SIZE], float u[TRI_BLOCK_SIZE], float v[TRI_BLOCK_SIZE])
+{
+    return intersectTriangles8(_mm256_loadu_ps(b.p0x), _mm256_loadu_ps(b.p0y), _mm256_loadu_ps(b.p0z),
+                               _mm256_loadu_ps(b.e1x), _mm256_loadu_ps(b.e1y), _mm256_loadu_ps(b.e1z),
+                               _mm256_loadu_ps(b.e2x), _mm256_loadu_ps(b.e2y), _mm256_loadu_ps(b.e2z),
+                               r, tmin, tmax, t, u, v);
+}
+
+/* origin + scale * q for 8 grid coordinates, as the mesh's position() works it out */
+inline __m256 decodeGrid8(const uint16_t q[TRI_BLOCK_SIZE], __m256 origin, __m256 scale)
+{
+    __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) q)));
+    return _mm256_add_ps(origin, _mm256_mul_ps(scale, f));
+}
+
+/* Same as for a triBlock, decoding the vertices of b on g in registers first */
+inline uint32_t intersectTriBlock(const qTriBlock &b, const quantizedGrid &g, const ray &r, float tmin, float tmax,
+                                  float t[TRI_BLOCK_SIZE], float u[TRI_BLOCK_SIZE], float v[TRI_BLOCK_SIZE])
+{
+    __m256 ox = _mm256_set1_ps(g.origin.x), oy = _mm256_set1_ps(g.origin.y), oz = _mm256_set1_ps(g.origin.z);
+    __m256 sx = _mm256_set1_ps(g.scale.x), sy = _mm256_set1_ps(g.scale.y), sz = _mm256_set1_ps(g.scale.z);
+
+    __m256 p0x = decodeGrid8(b.p0x, ox, sx), p0y = decodeGrid8(b.p0y, oy, sy), p0z = decodeGrid8(b.p0z, oz, sz);
+    __m256 e1x = _mm256_sub_ps(decodeGrid8(b.p1x, ox, sx), p0x);
+    __m256 e1y = _mm256_sub_ps(decodeGrid8(b.p1y, oy, sy), p0y);
+    __m256 e1z = _mm256_sub_ps(decodeGrid8(b.p1z, oz, sz), p0z);
+    __m256 e2x = _mm256_sub_ps(decodeGrid8(b.p2x, ox, sx), p0x);
+    __m256 e2y = _mm256_sub_ps(decodeGrid8(b.p2y, oy, sy), p0y);
+    __m256 e2z = _mm256_sub_ps(decodeGrid8(b.p2z, oz, sz), p0z);
+
+    return intersectTriangles8(p0x, p0y, p0z, e1x, e1y, e1z, e2x, e2y, e2z, r, tmin, tmax, t, u, v);
+}
+
+#else
+
+/* Same as the AVX2 version above, one slot per loop iteration */
+inline uint32_t intersectTriBlock(const triBlock &b, const ray &r, float tmin, float tmax,
+                                  float t[TRI_BLOCK_SIZE], float u[TRI_BLOCK_SIZE], float v[TRI_BLOCK_SIZE])
+{
+    uint32_t hitMask = 0;
+
+    for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+        float px = r.direction.y * b.e2z[k] - r.direction.z * b.e2y[k];
+        float py = r.direction.z * b.e2x[k] - r.direction.x * b.e2z[k];
+        float pz = r.direction.x * b.e2y[k] - r.direction.y * b.e2x[k];
+        float invDet = 1.0f / (b.e1x[k] * px + b.e1y[k] * py + b.e1z[k] * pz);
+
+        float sx = r.origin.x - b.p0x[k];
+        float sy = r.origin.y - b.p0y[k];
+        float sz = r.origin.z - b.p0z[k];
+        float uu = (sx * px + sy * py + sz * pz) * invDet;
+
+        float qx = sy * b.e1z[k] - sz * b.e1y[k];
+        float qy = sz * b.e1x[k] - sx * b.e1z[k];
+        float qz = sx * b.e1y[k] - sy * b.e1x[k];
+        float vv = (r.direction.x * qx + r.direction.y * qy + r.direction.z * qz) * invDet;
+        float tt = (b.e2x[k] * qx + b.e2y[k] * qy + b.e2z[k] * qz) * invDet;
+
+        bool hit = uu > 0.0f && vv > 0.0f && uu + vv < 1.0f && tt >= tmin && tt <= tmax;
+        hitMask |= (uint32_t) hit << k;
+        t[k] = tt;
+        u[k] = uu;
+        v[k] = vv;
+    }
+
+    return hitMask;
+}
+
+/* Same as for a triBlock, decoding b on g into one first */
+inline uint32_t intersectTriBlock(const qTriBlock &b, const quantizedGrid &g, const ray &r, float tmin, float tmax,
+                                  float t[TRI_BLOCK_SIZE], float u[TRI_BLOCK_SIZE], float v[TRI_BLOCK_SIZE])
+{
+    triBlock d;
+
+    for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+        vec3 p0 = g.origin + g.scale * vec3(b.p0x[k], b.p0y[k], b.p0z[k]);
+        vec3 p1 = g.origin + g.scale * vec3(b.p1x[k], b.p1y[k], b.p1z[k]);
+        vec3 p2 = g.origin + g.scale * vec3(b.p2x[k], b.p2y[k], b.p2z[k]);
+        d.set(k, p0, p1, p2, b.tri[k]);
+    }
+
+    return intersectTriBlock(d, r, tmin, tmax, t, u, v);
+}
+
+#endif
+
+/* Pick the closest of the slots in hitMask that's within tmax, as closestTriBlock does */
+inline bool closestSlot(uint32_t hitMask, const float ts[TRI_BLOCK_SIZE], const float us[TRI_BLOCK_SIZE],
+                        const float vs[TRI_BLOCK_SIZE], float &tmax, int &slot, float &u, float &v)
+{
+    if (!hitMask) {
+        return false;
+    }
+
+    for (int k = 0; k < TRI_BLOCK_SIZE; k++) {
+        if ((hitMask & (1u << k)) && ts[k] <= tmax) {
+            tmax = ts[k];
+            slot = k;
+        }
+    }
+
+    u = us[slot];
+    v = vs[slot];
+    return true;
+}
+
+/*
+* Find the closest triangle in b hit by r in [tmin, tmax]. On a hit, tmax
+* shrinks to it, and slot is the slot it's in with barycentrics u and v.
+*/
+inline bool closestTriBlock(const triBlock &b, const ray &r, float tmin, float &tmax, int &slot, float &u, float &v)
+{
+    float ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    uint32_t hitMask = intersectTriBlock(b, r, tmin, tmax, ts, us, vs);
+    return closestSlot(hitMask, ts, us, vs, tmax, slot, u, v);
+}
+
+inline bool closestTriBlock(const qTriBlock &b, const quantizedGrid &g, const ray &r, float tmin, float &tmax,
+                            int &slot, float &u, float &v)
+{
+    float ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    uint32_t hitMask = intersectTriBlock(b, g, r, tmin, tmax, ts, us, vs);
+    return closestSlot(hitMask, ts, us, vs, tmax, slot, u, v);
+}
+
+/* True if r hits any triangle in b between tmin and tmax */
+inline bool occludedTriBlock(const triBlock &b, const ray &r, float tmin, float tmax)
+{
+    float ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    return intersectTriBlock(b, r, tmin, tmax, ts, us, vs) != 0;
+}
+
+inline bool occludedTriBlock(const qTriBlock &b, const quantizedGrid &g, const ray &r, float tmin, float tmax)
+{
+    float ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    return intersectTriBlock(b, g, r, tmin, tmax, ts, us, vs) != 0;
+}
+
+#endif
@@ -1,216 +1,11 @@
 /*
 * vec.cpp
-* Implements the functions for the vec3 and vec2 structs
-* defined in vec.hpp
+* Implements the functions for the vec3 and vec2 structs defined in vec.hpp
+* that are not inline there (IO, clamp, mix and the component queries).
 */
 
 #include "vec.hpp"
 
-/* ------- Basic operations on vec3 types ------- */
-
-vec3& vec3::operator +=(const vec3 &other)
-{
-    x += other.x;
-    y += other.y;
-    z += other.z;
-
-    return *this;
-}
-
-vec3& vec3::operator *=(const vec3 &other)
-{
-    x *= other.x;
-    y *= other.y;
-    z *= other.z;
-
-    return *this;
-}
-
-vec3& vec3::operator /=(const vec3 &other)
-{
-    x /= other.x;
-    y /= other.y;
-    z /= other.z;
-
-    return *this;
-}
-
-vec3& vec3::operator -=(const vec3 &other)
-{
-    x -= other.x;
-    y -= other.y;
-    z -= other.z;
-
-    return *this;
-}
-
-vec3& vec3::operator *=(float other)
-{
-    x *= other;
-    y *= other;
-    z *= other;
-
-    return *this;
-}
-
-vec3& vec3::operator /=(float other)
-{
-    x /= other;
-    y /= other;
-    z /= other;
-
-    return *this;
-}
-
-vec3 operator *(vec3 v, float k)
-{
-    return v *= k;
-}
-
-vec3 operator *(float k, vec3 v)
-{
-    return v *= k;
-}
-
-vec3 operator *(vec3 v1, vec3 v2)
-{
-    return v1 *= v2;
-}
-
-vec3 operator /(vec3 v, float k)
-{
-    return v /= k;
-}
-
-vec3 operator /(vec3 v1, vec3 v2)
-{
-    return v1 /= v2;
-}
-
-vec3 operator +(vec3 v1, vec3 v2)
-{
-    return v1 += v2;
-}
-
-vec3 operator -(vec3 v1, vec3 v2)
-{
-    return v1 -= v2;
-}
-
-bool operator ==(const vec3 &v1, const vec3 &v2)
-{
-    if (v1.x == v2.x &&
-        v1.y == v2.y &&
-        v1.z == v2.z) {
-        return true;
-    }
-
-    else {
-        return false;
-    }
-}
-
-bool operator !=(const vec3 &v1, const vec3 &v2)
-{
-    return !(v1 == v2);
-}
-
-/* ------- Basic operations on vec2 types ------- */
-vec2& vec2::operator +=(const vec2 &other)
-{
-    x += other.x;
-    y += other.y;
-
-    return *this;
-}
-
-vec2& vec2::operator *=(const vec2 &other)
-{
-    x *= other.x;
-    y *= other.y;
-
-    return *this;
-}
-
-vec2& vec2::operator /=(const vec2 &other)
-{
-    x /= other.x;
-    y /= other.y;
-
-    return *this;
-}
-
-vec2& vec2::operator -=(const vec2 &other)
-{
-    x -= other.x;
-    y -= other.y;
-
-    return *this;
-}
-
-vec2& vec2::operator *=(float other)
-{
-    x *= other;
-    y *= other;
-
-    return *this;
-}
-
-vec2& vec2::operator /=(float other)
-{
-    x /= other;
-    y /= other;
-
-    return *this;
-}
-
-vec2 operator *(vec2 v, float k)
-{
-    return v *= k;
-}
-
-vec2 operator *(float k, vec2 v)
-{
-    return v *= k;
-}
-
-vec2 operator *(vec2 v1, vec2 v2)
-{
-    return v1 *= v2;
-}
-
-vec2 operator /(vec2 v, float k)
-{
-    return v /= k;
-}
-
-vec2 operator /(vec2 v1, vec2 v2)
-{
-    return v1 /= v2;
-}
-
-vec2 operator +(vec2 v1, vec2 v2)
-{
-    return v1 += v2;
-}
-
-bool operator ==(const vec2 &v1, const vec2 &v2)
-{
-    if (v1.x == v2.x &&
-        v1.y == v2.y) {
-        return true;
-    }
-
-    else {
-        return false;
-    }
-}
-
-bool operator !=(const vec2 &v1, const vec2 &v2)
-{
-    return !(v1 == v2);
-}
-
 /* ------- IO functions for vectors ------- */
 
 std::ostream& operator <<(std::ostream &out, const vec3 &toString)
@@ -336,86 +131,7 @@ vec3 mix(vec3 v1, vec3 v2, vec3 a)
                 v1.z * (1 - a.z) + (v2.z * a.z));
 }
 
-/* ---- mathematical vector operations ----- */
-
-/* Return the cross product of v1 and v2 */
-vec3 cross(const vec3 &v1, const vec3 &v2)
-{
-    vec3 tmp;
-
-    tmp.x = v1.y * v2.z - v1.z * v2.y;
-    tmp.y = v1.z * v2.x - v1.x * v2.z;
-    tmp.z = v1.x * v2.y - v1.y * v2.x;
-
-    return tmp;
-}
-
-/* Return the length of a 3D vector */
-float length(const vec3 &v)
-{
-    return sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
-}
-
-/* Return a vector of length 1 in the direction of v */
-vec3 makeUnitVector(vec3 v)
-{
-    return v/length(v);
-}
-
-float lengthSquared(vec3 v)
-{
-    return v.x*v.x + v.y*v.y + v.z*v.z;
-}
-
-float dot(const vec3 &v1, const vec3 &v2)
-{
-    return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
-}
-
-float tripleProduct(const vec3 &v1, const vec3 &v2, const vec3 &v3)
-{
-    return dot(cross(v1, v2), v3);
-}
-
 /* ----- other functions ----- */
-vec3 minVec(const vec3 &v1, const vec3 &v2)
-{
-    vec3 tmp = v1;
-
-    if (v2.x < v1.x) {
-        tmp.x = v2.x;
-    }
-
-    if (v2.y < v1.y) {
-        tmp.y = v2.y;
-    }
-
-    if (v2.z < v1.z) {
-        tmp.z = v2.z;
-    }
-
-    return tmp;
-}
-
-vec3 maxVec(const vec3 &v1, const vec3 &v2)
-{
-    vec3 tmp = v1;
-
-    if (v2.x > v1.x) {
-        tmp.x = v2.x;
-    }
-
-    if (v2.y > v1.y) {
-        tmp.y = v2.y;
-    }
-
-    if (v2.z > v1.z) {
-        tmp.z = v2.z;
-    }
-
-    return tmp;
-}
-
 float maxComponent(const vec3 &v)
 {
     if (v.x > v.y && v.x > v.z) {
@@ -1,6 +1,7 @@
 /*
 * vec.hpp
-* Defines vector2 and vector3 types, as well as rgb types.
+* Defines vector2 and vector3 types, as well as rgb types, and vec3a, a vec3
+* that lives in a SIMD register.
 */
 
 #ifndef VEC_H
@@ -9,6 +10,14 @@
 #include <iostream>
 #include <cmath>
 
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define VEC_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC_NEON
+#endif
+
 struct vec3 {
     union // allows us to refer to members of vec3 in different ways
     {
@@ -21,26 +30,9 @@ struct vec3 {
         };
     };
 
-    vec3() 
-    {
-        x = 0;
-        y = 0;
-        z = 0;
-    }
-
-    vec3(float x_, float y_, float z_)
-    {
-        x = x_;
-        y = y_;
-        z = z_;
-    }
-
-    vec3(float val)
-    {
-        x = val;
-        y = val;
-        z = val;
-    }
+    constexpr vec3() : e{0, 0, 0} {}
+    constexpr vec3(float x_, float y_, float z_) : e{x_, y_, z_} {}
+    constexpr vec3(float val) : e{val, val, val} {}
 
     vec3 operator +() const { return *this; }
     vec3 operator -() const { return vec3(-x, -y, -z); }
@@ -61,20 +53,9 @@ struct vec2 {
         };
     };
 
-    vec2() {
-        x = 0;
-        y = 0;
-    }
-
-    vec2(float x_, float y_) {
-        x = x_;
-        y = y_;
-    }
-
-    vec2(float val) {
-        x = val;
-        y = val;
-    }
+    constexpr vec2() : e{0, 0} {}
+    constexpr vec2(float x_, float y_) : e{x_, y_} {}
+    constexpr vec2(float val) : e{val, val} {}
 
     vec2 operator +() const { return *this; }
     vec2 operator -() const { return vec2(-x, -y); }
@@ -86,39 +67,12 @@ struct vec2 {
     vec2& operator *=(float other);
 };
 
-vec3 operator *(vec3 v, float k);
-vec3 operator *(float k, vec3 v);
-vec3 operator *(vec3 v1, vec3 v2);
-vec3 operator /(vec3 v, float k);
-vec3 operator /(vec3 v1, vec3 v2);
-vec3 operator +(vec3 v1, vec3 v2);
-vec3 operator -(vec3 v1, vec3 v2);
-bool operator ==(const vec3 &v1, const vec3 &v2);
-bool operator !=(const vec3 &v1, const vec3 &v2);
-
-vec2 operator *(vec2 v, float k);
-vec2 operator *(float k, vec2 v);
-vec2 operator *(vec2 v1, vec2 v2);
-vec2 operator /(vec2 v, float k);
-vec2 operator /(vec2 v1, vec2 v2);
-vec2 operator +(vec2 v1, vec2 v2);
-bool operator ==(const vec2 &v1, const vec2 &v2);
-bool operator !=(const vec2 &v1, const vec2 &v2);
-
 std::ostream& operator<<(std::ostream &out, const vec3 &toString);
 std::istream& operator>>(std::istream &in, vec3 &fromString);
 std::ostream& operator<<(std::ostream &out, const vec2 &toString);
 
 vec3 clamp(vec3 v, vec3 minVal, vec3 maxVal);
 vec3 mix(vec3 v1, vec3 v2, vec3 a);
-vec3 cross(const vec3 &v1, const vec3 &v2);
-vec3 makeUnitVector(vec3 v);
-float tripleProduct(const vec3 &v1, const vec3 &v2, const vec3 &v3);
-vec3 minVec(const vec3 &v1, const vec3 &v2);
-vec3 maxVec(const vec3 &v1, const vec3 &v2);
-float length(const vec3 &v);
-float lengthSquared(vec3 v);
-float dot(const vec3 &v1, const vec3 &v2);
 float maxComponent(const vec3 &v);
 float minComponent(const vec3 &v);
 float maxComponentAbs(const vec3 &v);
@@ -138,4 +92,331 @@ float mix(float x, float y, float a);
 
 typedef vec3 rgb;
 
+/*
+* The arithmetic below is in the header so every use gets inlined. It's called
+* several times per ray-triangle test, and as out of line calls that's a lot of
+* calls and copies for a few multiplies and adds.
+*/
+
+/* ------- Basic operations on vec3 types ------- */
+
+inline vec3& vec3::operator +=(const vec3 &other)
+{
+    x += other.x;
+    y += other.y;
+    z += other.z;
+
+    return *this;
+}
+
+inline vec3& vec3::operator *=(const vec3 &other)
+{
+    x *= other.x;
+    y *= other.y;
+    z *= other.z;
+
+    return *this;
+}
+
+inline vec3& vec3::operator /=(const vec3 &other)
+{
+    x /= other.x;
+    y /= other.y;
+    z /= other.z;
+
+    return *this;
+}
+
+inline vec3& vec3::operator -=(const vec3 &other)
+{
+    x -= other.x;
+    y -= other.y;
+    z -= other.z;
+
+    return *this;
+}
+
+inline vec3& vec3::operator *=(float other)
+{
+    x *= other;
+    y *= other;
+    z *= other;
+
+    return *this;
+}
+
+inline vec3& vec3::operator /=(float other)
+{
+    x /= other;
+    y /= other;
+    z /= other;
+
+    return *this;
+}
+
+inline vec3 operator *(vec3 v, float k) { return v *= k; }
+inline vec3 operator *(float k, vec3 v) { return v *= k; }
+inline vec3 operator *(vec3 v1, vec3 v2) { return v1 *= v2; }
+inline vec3 operator /(vec3 v, float k) { return v /= k; }
+inline vec3 operator /(vec3 v1, vec3 v2) { return v1 /= v2; }
+inline vec3 operator +(vec3 v1, vec3 v2) { return v1 += v2; }
+inline vec3 operator -(vec3 v1, vec3 v2) { return v1 -= v2; }
+
+inline bool operator ==(const vec3 &v1, const vec3 &v2)
+{
+    return v1.x == v2.x && v1.y == v2.y && v1.z == v2.z;
+}
+
+inline bool operator !=(const vec3 &v1, const vec3 &v2)
+{
+    return !(v1 == v2);
+}
+
+/* ------- Basic operations on vec2 types ------- */
+
+inline vec2& vec2::operator +=(const vec2 &other)
+{
+    x += other.x;
+    y += other.y;
+
+    return *this;
+}
+
+inline vec2& vec2::operator *=(const vec2 &other)
+{
+    x *= other.x;
+    y *= other.y;
+
+    return *this;
+}
+
+inline vec2& vec2::operator /=(const vec2 &other)
+{
+    x /= other.x;
+    y /= other.y;
+
+    return *this;
+}
+
+inline vec2& vec2::operator -=(const vec2 &other)
+{
+    x -= other.x;
+    y -= other.y;
+
+    return *this;
+}
+
+inline vec2& vec2::operator *=(float other)
+{
+    x *= other;
+    y *= other;
+
+    return *this;
+}
+
+inline vec2& vec2::operator /=(float other)
+{
+    x /= other;
+    y /= other;
+
+    return *this;
+}
+
+inline vec2 operator *(vec2 v, float k) { return v *= k; }
+inline vec2 operator *(float k, vec2 v) { return v *= k; }
+inline vec2 operator *(vec2 v1, vec2 v2) { return v1 *= v2; }
+inline vec2 operator /(vec2 v, float k) { return v /= k; }
+inline vec2 operator /(vec2 v1, vec2 v2) { return v1 /= v2; }
+inline vec2 operator +(vec2 v1, vec2 v2) { return v1 += v2; }
+
+inline bool operator ==(const vec2 &v1, const vec2 &v2)
+{
+    return v1.x == v2.x && v1.y == v2.y;
+}
+
+inline bool operator !=(const vec2 &v1, const vec2 &v2)
+{
+    return !(v1 == v2);
+}
+
+/* ---- mathematical vector operations ----- */
+
+/* Return the cross product of v1 and v2 */
+inline vec3 cross(const vec3 &v1, const vec3 &v2)
+{
+    return vec3(v1.y * v2.z - v1.z * v2.y,
+                v1.z * v2.x - v1.x * v2.z,
+                v1.x * v2.y - v1.y * v2.x);
+}
+
+inline float dot(const vec3 &v1, const vec3 &v2)
+{
+    return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
+}
+
+inline float lengthSquared(vec3 v)
+{
+    return v.x*v.x + v.y*v.y + v.z*v.z;
+}
+
+/* Return the length of a 3D vector */
+inline float length(const vec3 &v)
+{
+    return std::sqrt(lengthSquared(v));
+}
+
+inline float tripleProduct(const vec3 &v1, const vec3 &v2, const vec3 &v3)
+{
+    return dot(cross(v1, v2), v3);
+}
+
+/*
+* 1/sqrt(x) from the hardware estimate plus one Newton step, good to about
+* 1e-7 relative error. Falls back to 1/sqrt without SSE or NEON.
+*/
+inline float fastInvSqrt(float x)
+{
+#if defined(VEC_SSE)
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+#elif defined(VEC_NEON)
+    float32x2_t v = vdup_n_f32(x);
+    float32x2_t y = vrsqrte_f32(v);
+    y = vmul_f32(y, vrsqrts_f32(vmul_f32(v, y), y));
+    return vget_lane_f32(y, 0);
+#else
+    return 1.0f / std::sqrt(x);
+#endif
+}
+
+/*
+* Return a vector of length 1 in the direction of v. Compiling with
+* -DVEC_FAST_RSQRT uses fastInvSqrt instead of a divide and a square root.
+*/
+inline vec3 makeUnitVector(vec3 v)
+{
+#ifdef VEC_FAST_RSQRT
+    return v * fastInvSqrt(lengthSquared(v));
+#else
+    return v / length(v);
+#endif
+}
+
+inline vec3 minVec(const vec3 &v1, const vec3 &v2)
+{
+    return vec3(v2.x < v1.x ? v2.x : v1.x,
+                v2.y < v1.y ? v2.y : v1.y,
+                v2.z < v1.z ? v2.z : v1.z);
+}
+
+inline vec3 maxVec(const vec3 &v1, const vec3 &v2)
+{
+    return vec3(v2.x > v1.x ? v2.x : v1.x,
+                v2.y > v1.y ? v2.y : v1.y,
+                v2.z > v1.z ? v2.z : v1.z);
+}
+
+/* Relative luminance of a linear rgb colour (Rec. 709 weights) */
+inline float luminance(const rgb &c)
+{
+    return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+/*
+* vec3a: a vec3 padded to 4 floats and aligned to 16 bytes so it fits in one
+* SSE or NEON register. vec3 itself stays 12 bytes because mesh files are read
+* straight into arrays of them; use vec3a for values that get a lot of math done
+* on them in a loop and convert at the ends. The 4th lane is always 0.
+*/
+struct alignas(16) vec3a {
+    union
+    {
+#if defined(VEC_SSE)
+        __m128 v;
+#elif defined(VEC_NEON)
+        float32x4_t v;
+#endif
+        float e[4];
+    };
+
+    vec3a() : e{0, 0, 0, 0} {}
+    vec3a(float x, float y, float z) : e{x, y, z, 0} {}
+    vec3a(const vec3 &u) : e{u.x, u.y, u.z, 0} {}
+#if defined(VEC_SSE) || defined(VEC_NEON)
+    vec3a(decltype(v) v_) : v(v_) {}
+#endif
+
+    operator vec3() const { return vec3(e[0], e[1], e[2]); }
+};
+
+#if defined(VEC_SSE)
+
+inline vec3a operator +(const vec3a &a, const vec3a &b) { return _mm_add_ps(a.v, b.v); }
+inline vec3a operator -(const vec3a &a, const vec3a &b) { return _mm_sub_ps(a.v, b.v); }
+inline vec3a operator *(const vec3a &a, const vec3a &b) { return _mm_mul_ps(a.v, b.v); }
+inline vec3a operator *(const vec3a &a, float k) { return _mm_mul_ps(a.v, _mm_set1_ps(k)); }
+inline vec3a minVec(const vec3a &a, const vec3a &b) { return _mm_min_ps(a.v, b.v); }
+inline vec3a maxVec(const vec3a &a, const vec3a &b) { return _mm_max_ps(a.v, b.v); }
+
+inline float dot(const vec3a &a, const vec3a &b)
+{
+    __m128 m = _mm_mul_ps(a.v, b.v);
+    __m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));                       // x+z, y+w
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+inline vec3a cross(const vec3a &a, const vec3a &b)
+{
+    __m128 ayzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 byzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, byzx), _mm_mul_ps(ayzx, b.v));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+#elif defined(VEC_NEON)
+
+inline vec3a operator +(const vec3a &a, const vec3a &b) { return vaddq_f32(a.v, b.v); }
+inline vec3a operator -(const vec3a &a, const vec3a &b) { return vsubq_f32(a.v, b.v); }
+inline vec3a operator *(const vec3a &a, const vec3a &b) { return vmulq_f32(a.v, b.v); }
+inline vec3a operator *(const vec3a &a, float k) { return vmulq_n_f32(a.v, k); }
+inline vec3a minVec(const vec3a &a, const vec3a &b) { return vminq_f32(a.v, b.v); }
+inline vec3a maxVec(const vec3a &a, const vec3a &b) { return vmaxq_f32(a.v, b.v); }
+
+inline float dot(const vec3a &a, const vec3a &b)
+{
+    float32x4_t m = vmulq_f32(a.v, b.v);
+    float32x2_t s = vadd_f32(vget_low_f32(m), vget_high_f32(m));  // x+z, y+w
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+inline vec3a cross(const vec3a &a, const vec3a &b)
+{
+    return vec3a(a.e[1] * b.e[2] - a.e[2] * b.e[1],
+                 a.e[2] * b.e[0] - a.e[0] * b.e[2],
+                 a.e[0] * b.e[1] - a.e[1] * b.e[0]);
+}
+
+#else
+
+inline vec3a operator +(const vec3a &a, const vec3a &b) { return vec3a(a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2]); }
+inline vec3a operator -(const vec3a &a, const vec3a &b) { return vec3a(a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2]); }
+inline vec3a operator *(const vec3a &a, const vec3a &b) { return vec3a(a.e[0] * b.e[0], a.e[1] * b.e[1], a.e[2] * b.e[2]); }
+inline vec3a operator *(const vec3a &a, float k) { return vec3a(a.e[0] * k, a.e[1] * k, a.e[2] * k); }
+inline vec3a minVec(const vec3a &a, const vec3a &b) { return vec3a(minVec(vec3(a), vec3(b))); }
+inline vec3a maxVec(const vec3a &a, const vec3a &b) { return vec3a(maxVec(vec3(a), vec3(b))); }
+inline float dot(const vec3a &a, const vec3a &b) { return dot(vec3(a), vec3(b)); }
+inline vec3a cross(const vec3a &a, const vec3a &b) { return vec3a(cross(vec3(a), vec3(b))); }
+
+#endif
+
+inline float length(const vec3a &v)
+{
+    return std::sqrt(dot(v, v));
+}
+
+inline vec3a makeUnitVector(const vec3a &v)
+{
+    return v * fastInvSqrt(dot(v, v));
+}
+
 #endif
\ No newline at end of file